@@ -0,0 +1,46 @@
+// Checks or decompresses the compressed backups (".bckz") written by BACKUP
+// with --backup-format=lz, one block at a time.
+//
+// Usage: bckcat [--check] <backup>...
+// Without --check, the text of the backups is written to stdout.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bckfile.h"
+
+static void write_text(const char *data, size_t size, void *arg) {
+  (void)arg;
+  fwrite(data, 1, size, stdout);
+}
+
+int main(int argc, char **argv) {
+  int check = argc > 1 && strcmp(argv[1], "--check") == 0;
+  if (argc < 2 + check) {
+    fprintf(stderr, "Usage: %s [--check] <backup>...\n", argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 1 + check; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY);
+    if (fd < 0) {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    uint64_t text_size;
+    if (bck_read(fd, check ? NULL : write_text, NULL, &text_size) != 0) {
+      fprintf(stderr, "%s: damaged\n", argv[i]);
+      failed = 1;
+    } else if (check) {
+      printf("%s: OK, %" PRIu64 " bytes of text\n", argv[i], text_size);
+    }
+    close(fd);
+  }
+  fflush(stdout);
+  return failed;
+}
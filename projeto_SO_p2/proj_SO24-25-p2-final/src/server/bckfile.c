@@ -0,0 +1,195 @@
+#include "bckfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc.h"
+
+// Writes len bytes, retrying partial writes.
+static int write_all(int fd, const void *data, size_t len) {
+  const char *ptr = data;
+  while (len > 0) {
+    ssize_t written = write(fd, ptr, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    ptr += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Writes the text buffered, as is or as a compressed block, with a single
+// write, so blocks appended to the same file by several processes never mix.
+static void flush_block(BackupStream *stream) {
+  if (stream->used == 0 || stream->failed) {
+    stream->used = 0;
+    return;
+  }
+  unsigned char *text = stream->text + sizeof(BckBlockHeader);
+  if (!stream->compress) {
+    stream->failed = write_all(stream->fd, text, stream->used);
+    stream->used = 0;
+    return;
+  }
+
+  BckBlockHeader header = {.size = (uint32_t)stream->used, .stored = 0,
+                           .crc = crc32(0, text, stream->used)};
+  size_t packed = lz_compress(text, stream->used, stream->packed + sizeof(header),
+                              sizeof(stream->packed) - sizeof(header), stream->table);
+  unsigned char *block = stream->packed;
+  if (packed == 0 || packed >= stream->used) {
+    packed = stream->used;
+    block = stream->text;
+    header.stored = (uint32_t)packed | BCK_STORED;
+  } else {
+    header.stored = (uint32_t)packed;
+  }
+  memcpy(block, &header, sizeof(header));
+  stream->failed = write_all(stream->fd, block, sizeof(header) + packed);
+  stream->used = 0;
+}
+
+int bck_create(BackupStream *stream, const char *path, int compress) {
+  stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  stream->compress = compress;
+  stream->failed = 0;
+  stream->used = 0;
+  if (stream->fd < 0) {
+    return 1;
+  }
+  if (compress) {
+    stream->failed = write_all(stream->fd, BCKZ_MAGIC, BCKZ_MAGIC_SIZE);
+  }
+  return 0;
+}
+
+void bck_put(BackupStream *stream, const char *data, size_t size) {
+  if (size > BCK_BLOCK - stream->used) {
+    flush_block(stream);
+  }
+  memcpy(stream->text + sizeof(BckBlockHeader) + stream->used, data, size);
+  stream->used += size;
+}
+
+int bck_flush(BackupStream *stream) {
+  flush_block(stream);
+  return stream->failed;
+}
+
+int bck_close(BackupStream *stream) {
+  flush_block(stream);
+  if (stream->compress && !stream->failed) {
+    BckBlockHeader end = {0, 0, 0};
+    stream->failed = write_all(stream->fd, &end, sizeof(end));
+  }
+  if (close(stream->fd) != 0) {
+    stream->failed = 1;
+  }
+  return stream->failed;
+}
+
+// Reads len bytes, retrying partial reads.
+// @return Number of bytes read, less than len at the end of the file, or -1
+//         on failure.
+static ssize_t read_full(int fd, void *data, size_t len) {
+  char *ptr = data;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, ptr + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+static void report_short_read(ssize_t n, uint64_t num_block) {
+  if (n < 0) {
+    perror("Failed to read the backup");
+  } else {
+    fprintf(stderr, "Backup cut short at block %" PRIu64 "\n", num_block);
+  }
+}
+
+int bck_read(int fd, void (*text)(const char *data, size_t size, void *arg), void *arg,
+             uint64_t *text_size) {
+  char magic[BCKZ_MAGIC_SIZE];
+  if (read_full(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic) ||
+      memcmp(magic, BCKZ_MAGIC, BCKZ_MAGIC_SIZE) != 0) {
+    fprintf(stderr, "Not a compressed backup\n");
+    return 1;
+  }
+
+  unsigned char *packed = malloc(LZ_BOUND(BCK_BLOCK));
+  unsigned char *block = malloc(BCK_BLOCK);
+  if (packed == NULL || block == NULL) {
+    free(packed);
+    free(block);
+    fprintf(stderr, "Failed to allocate memory for the backup blocks\n");
+    return 1;
+  }
+
+  int result = 1;
+  uint64_t total = 0;
+  for (uint64_t num_block = 0;; num_block++) {
+    BckBlockHeader header;
+    ssize_t n = read_full(fd, &header, sizeof(header));
+    if (n != (ssize_t)sizeof(header)) {
+      report_short_read(n, num_block);
+      break;
+    }
+    if (header.size == 0) {
+      char extra;
+      if (header.stored != 0 || read_full(fd, &extra, 1) != 0) {
+        fprintf(stderr, "Unexpected data after the end of the backup\n");
+      } else {
+        result = 0;
+      }
+      break;
+    }
+
+    int stored = (header.stored & BCK_STORED) != 0;
+    size_t size = header.stored & ~BCK_STORED;
+    if (header.size > BCK_BLOCK || size > LZ_BOUND(BCK_BLOCK) || (stored && size != header.size)) {
+      fprintf(stderr, "Block %" PRIu64 " of the backup is damaged\n", num_block);
+      break;
+    }
+    n = read_full(fd, stored ? block : packed, size);
+    if (n != (ssize_t)size) {
+      report_short_read(n, num_block);
+      break;
+    }
+    if ((!stored && lz_decompress(packed, size, block, header.size) != 0) ||
+        crc32(0, block, header.size) != header.crc) {
+      fprintf(stderr, "Block %" PRIu64 " of the backup is damaged\n", num_block);
+      break;
+    }
+    if (text != NULL) {
+      text((const char *)block, header.size, arg);
+    }
+    total += header.size;
+  }
+
+  free(packed);
+  free(block);
+  if (text_size != NULL) {
+    *text_size = total;
+  }
+  return result;
+}
@@ -0,0 +1,86 @@
+#ifndef KVS_BCKFILE_H
+#define KVS_BCKFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+// Backup files written by BACKUP, as text or compressed.
+//
+// A text backup (".bck") has a line "(key, value)" per pair. A compressed one
+// (".bckz") starts with BCKZ_MAGIC and holds the same text cut in blocks of at
+// most BCK_BLOCK bytes, each compressed on its own (see lz.h) and stored as a
+// BckBlockHeader followed by the stored bytes. The header has the size of the
+// text, the size stored and the CRC-32 of the text; a block that would not
+// shrink is stored as is. The file ends with an empty block, so a backup cut
+// short is told apart from a complete one. Blocks are independent, so
+// bck_read checks and decompresses a backup one block at a time.
+//
+// Both are written through a BackupStream, which buffers the text to write it
+// a block at a time and only calls async signal safe functions, so it can run
+// in the child forked by BACKUP. A block only holds whole lines and is
+// appended with a single write, so several processes may write the blocks of
+// the same backup, each through its own copy of the stream (see bck_flush):
+// the lines of a backup are in no particular order anyway.
+
+#define BCKZ_MAGIC "KVSBCKZ1"
+#define BCKZ_MAGIC_SIZE 8
+#define BCK_BLOCK LZ_MAX_BLOCK
+#define BCK_STORED 0x80000000u  // set in the stored size of blocks stored as is
+
+typedef struct BckBlockHeader {
+  uint32_t size;    // bytes of text, 0 for the block ending the file
+  uint32_t stored;  // bytes that follow, BCK_STORED if they are the text as is
+  uint32_t crc;     // CRC-32 of the text
+} BckBlockHeader;
+
+typedef struct BackupStream {
+  int fd;
+  int compress;
+  int failed;
+  size_t used;  // bytes of text buffered
+  // Both start with room for the header of the block, written along with it
+  unsigned char text[sizeof(BckBlockHeader) + BCK_BLOCK];
+  unsigned char packed[sizeof(BckBlockHeader) + LZ_BOUND(BCK_BLOCK)];
+  uint16_t table[1 << LZ_HASH_BITS];
+} BackupStream;
+
+/// Creates a backup file, replacing the one at path.
+/// @param stream The stream to write it through.
+/// @param path Path of the file.
+/// @param compress 1 for a compressed backup, 0 for text.
+/// @return 0 if successful, 1 if the file could not be created.
+int bck_create(BackupStream *stream, const char *path, int compress);
+
+/// Adds a line, or a few, to the backup. They are never split between blocks.
+/// @param stream The stream.
+/// @param data The text.
+/// @param size Size of the text, at most BCK_BLOCK.
+void bck_put(BackupStream *stream, const char *data, size_t size);
+
+/// Writes the text buffered, leaving the file open. A process writing part of
+/// a backup through a copy of the stream calls it once done; the backup is
+/// ended by bck_close, in the process that created it, after every part was
+/// written.
+/// @param stream The stream.
+/// @return 0 if everything added so far was written, 1 otherwise.
+int bck_flush(BackupStream *stream);
+
+/// Writes what is left of the backup and closes the file.
+/// @param stream The stream.
+/// @return 0 if the whole backup was written, 1 otherwise.
+int bck_close(BackupStream *stream);
+
+/// Reads a compressed backup, checking the CRC-32 of every block, and reports
+/// the first problem found on stderr.
+/// @param fd File descriptor of the backup.
+/// @param text Called with the text of each block, in order, NULL to only
+///             check the backup.
+/// @param arg Passed to text.
+/// @param text_size Where to store the size of the text, NULL if not needed.
+/// @return 0 if the backup is complete and undamaged, 1 otherwise.
+int bck_read(int fd, void (*text)(const char *data, size_t size, void *arg), void *arg,
+             uint64_t *text_size);
+
+#endif  // KVS_BCKFILE_H
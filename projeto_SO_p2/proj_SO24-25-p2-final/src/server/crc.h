@@ -0,0 +1,15 @@
+#ifndef KVS_CRC_H
+#define KVS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Computes the CRC-32 (as used by zlib) of a buffer. Async signal safe.
+/// @param crc 0, or the CRC-32 of the data that comes before the buffer, to
+///            compute the checksum of data split in several buffers.
+/// @param data The buffer.
+/// @param size Size of the buffer in bytes.
+/// @return The checksum.
+uint32_t crc32(uint32_t crc, const void *data, size_t size);
+
+#endif  // KVS_CRC_H
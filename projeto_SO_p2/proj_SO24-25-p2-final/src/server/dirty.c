@@ -0,0 +1,145 @@
+#include "dirty.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+
+#define MIN_SLOTS 16
+#define SHRINK_SLOTS 1024  // sets with more slots are freed when emptied mostly unused
+
+typedef struct DirtyKey {
+  uint64_t hash;
+  char key[MAX_STRING_SIZE];
+} DirtyKey;
+
+// Keys of one stripe, in the order they were marked. slots is an open
+// addressing table of indexes into keys (plus one, so 0 is a free slot), at
+// most half full.
+typedef struct DirtyStripe {
+  DirtyKey *keys;
+  size_t count;
+  uint32_t *slots;
+  size_t num_slots;  // a power of two, 0 until the first key
+  int lost;          // 1 if a key could not be added
+} DirtyStripe;
+
+struct DirtyKeys {
+  DirtyStripe stripes[NUM_STRIPES];  // stripes[i] is protected by stripe i of the table
+};
+
+DirtyKeys *create_dirty_keys(void) {
+  return calloc(1, sizeof(DirtyKeys));
+}
+
+// The low bits of the hash pick the stripe, so the slots use the high ones.
+static size_t slot_of(const DirtyStripe *stripe, uint64_t h) {
+  return (size_t)(h >> 32) & (stripe->num_slots - 1);
+}
+
+// Makes room for one more key, doubling the slots when half of them are used.
+// @return 0 if successful, 1 if memory ran out.
+static int stripe_reserve(DirtyStripe *stripe) {
+  if (2 * (stripe->count + 1) <= stripe->num_slots) {
+    return 0;
+  }
+  size_t num_slots = stripe->num_slots ? 2 * stripe->num_slots : MIN_SLOTS;
+  uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+  DirtyKey *keys = realloc(stripe->keys, num_slots / 2 * sizeof(DirtyKey));
+  if (slots == NULL || keys == NULL) {
+    free(slots);
+    if (keys != NULL) {
+      stripe->keys = keys;
+    }
+    return 1;
+  }
+  stripe->keys = keys;
+  free(stripe->slots);
+  stripe->slots = slots;
+  stripe->num_slots = num_slots;
+  for (size_t i = 0; i < stripe->count; i++) {
+    size_t slot = slot_of(stripe, keys[i].hash);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    slots[slot] = (uint32_t)(i + 1);
+  }
+  return 0;
+}
+
+void dirty_mark(DirtyKeys *dirty, const char *key) {
+  uint64_t h = hash(key);
+  DirtyStripe *stripe = &dirty->stripes[h & (NUM_STRIPES - 1)];
+  if (stripe->count > 0) {
+    for (size_t slot = slot_of(stripe, h); stripe->slots[slot] != 0;
+         slot = (slot + 1) & (stripe->num_slots - 1)) {
+      const DirtyKey *marked = &stripe->keys[stripe->slots[slot] - 1];
+      if (marked->hash == h && strcmp(marked->key, key) == 0) {
+        return;
+      }
+    }
+  }
+  if (stripe->count == UINT32_MAX - 1 || stripe_reserve(stripe) != 0) {
+    stripe->lost = 1;
+    return;
+  }
+
+  size_t slot = slot_of(stripe, h);
+  while (stripe->slots[slot] != 0) {
+    slot = (slot + 1) & (stripe->num_slots - 1);
+  }
+  DirtyKey *marked = &stripe->keys[stripe->count++];
+  marked->hash = h;
+  strncpy(marked->key, key, MAX_STRING_SIZE - 1);
+  marked->key[MAX_STRING_SIZE - 1] = '\0';
+  stripe->slots[slot] = (uint32_t)stripe->count;
+}
+
+size_t dirty_count(const DirtyKeys *dirty) {
+  size_t count = 0;
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    count += dirty->stripes[i].count;
+  }
+  return count;
+}
+
+int dirty_lost(const DirtyKeys *dirty) {
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    if (dirty->stripes[i].lost) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void dirty_take(DirtyKeys *dirty, void (*visit)(const char *key, void *arg), void *arg) {
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    DirtyStripe *stripe = &dirty->stripes[i];
+    for (size_t j = 0; visit != NULL && j < stripe->count; j++) {
+      visit(stripe->keys[j].key, arg);
+    }
+
+    // A burst of changes should not leave large sets behind, which would have
+    // to be cleared at every backup
+    if (stripe->num_slots > SHRINK_SLOTS && 8 * stripe->count < stripe->num_slots) {
+      free(stripe->keys);
+      free(stripe->slots);
+      stripe->keys = NULL;
+      stripe->slots = NULL;
+      stripe->num_slots = 0;
+    } else if (stripe->count > 0) {
+      memset(stripe->slots, 0, stripe->num_slots * sizeof(uint32_t));
+    }
+    stripe->count = 0;
+    stripe->lost = 0;
+  }
+}
+
+void free_dirty_keys(DirtyKeys *dirty) {
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    free(dirty->stripes[i].keys);
+    free(dirty->stripes[i].slots);
+  }
+  free(dirty);
+}
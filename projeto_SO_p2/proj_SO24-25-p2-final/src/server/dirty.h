@@ -0,0 +1,50 @@
+#ifndef KVS_DIRTY_H
+#define KVS_DIRTY_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+// Keys changed (written, deleted, expired or evicted) since the last BACKUP,
+// so a delta backup only has to copy those.
+//
+// There is a set per lock stripe, protected by the stripe lock the callers
+// already hold: marking a key is a lookup in a small hash table of the
+// stripe, and taking the keys for a backup only walks the keys that changed,
+// never the whole table.
+
+typedef struct DirtyKeys DirtyKeys;
+
+/// Creates an empty set.
+/// @return The set, NULL if memory ran out.
+DirtyKeys *create_dirty_keys(void);
+
+/// Adds a key to the set, if it is not there yet. Must be called with the
+/// key's stripe locked for writing. If memory runs out the key is lost, and
+/// dirty_lost tells the next backup it cannot be a delta.
+/// @param dirty The set.
+/// @param key The key.
+void dirty_mark(DirtyKeys *dirty, const char *key);
+
+/// Must be called with the table locked (lock_table).
+/// @param dirty The set.
+/// @return Number of keys in the set.
+size_t dirty_count(const DirtyKeys *dirty);
+
+/// Must be called with the table locked (lock_table).
+/// @param dirty The set.
+/// @return 1 if a key could not be marked since the set was last emptied.
+int dirty_lost(const DirtyKeys *dirty);
+
+/// Calls visit for each key of the set, stripe by stripe, and empties it. Must
+/// be called with the table locked (lock_table).
+/// @param dirty The set.
+/// @param visit Called with each key, NULL to just empty the set.
+/// @param arg Passed to visit.
+void dirty_take(DirtyKeys *dirty, void (*visit)(const char *key, void *arg), void *arg);
+
+/// Frees the set.
+/// @param dirty The set.
+void free_dirty_keys(DirtyKeys *dirty);
+
+#endif  // KVS_DIRTY_H
@@ -0,0 +1,162 @@
+#include "ebr.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EBR_ADVANCE_EVERY 64  // retirements between attempts to advance the epoch
+
+typedef struct Retired {
+  void *ptr;
+  void (*free_fn)(void *ptr);
+} Retired;
+
+// Memory retired by one thread during one epoch.
+typedef struct Limbo {
+  Retired *items;
+  size_t count;
+  size_t capacity;
+  uint64_t epoch;
+} Limbo;
+
+// Per thread state. Records are never freed: when a thread exits its record
+// (and whatever is still in its limbo lists) is taken over by the next thread
+// that registers.
+typedef struct EbrThread {
+  // Global epoch seen by the current read section, shifted left by one, with
+  // the low bit set while inside ebr_enter()/ebr_exit(). Both go in one word
+  // so entering a section costs a single full barrier.
+  atomic_uint_fast64_t section;
+  atomic_int in_use;           // 1 while owned by a running thread
+  Limbo limbo[3];              // indexed by epoch % 3
+  size_t retired_since_advance;
+  struct EbrThread *next;
+} EbrThread;
+
+static _Atomic(EbrThread *) registry = NULL;
+// Starts at 2 so "epoch + 2 <= global" never has to deal with underflow
+static atomic_uint_fast64_t global_epoch = 2;
+
+static _Thread_local EbrThread *self = NULL;
+static pthread_key_t self_key;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+
+static void release_self(void *arg) {
+  EbrThread *thread = arg;
+  atomic_store(&thread->section, 0);
+  atomic_store_explicit(&thread->in_use, 0, memory_order_release);
+}
+
+static void create_self_key(void) {
+  pthread_key_create(&self_key, release_self);
+}
+
+static EbrThread *get_self(void) {
+  if (self != NULL) {
+    return self;
+  }
+
+  // Reuse the record of a thread that already exited
+  for (EbrThread *thread = atomic_load(&registry); thread != NULL; thread = thread->next) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&thread->in_use, &expected, 1)) {
+      self = thread;
+      break;
+    }
+  }
+
+  if (self == NULL) {
+    EbrThread *thread = calloc(1, sizeof(EbrThread));
+    if (thread == NULL) {
+      fprintf(stderr, "Failed to allocate memory for epoch reclamation\n");
+      exit(1);
+    }
+    atomic_init(&thread->in_use, 1);
+    thread->next = atomic_load(&registry);
+    while (!atomic_compare_exchange_weak(&registry, &thread->next, thread))
+      ;
+    self = thread;
+  }
+
+  pthread_once(&self_key_once, create_self_key);
+  pthread_setspecific(self_key, self);
+  return self;
+}
+
+void ebr_enter(void) {
+  EbrThread *thread = get_self();
+  // Publish the epoch and check it is still the current one, so the epoch
+  // cannot move two steps ahead while this section is reading
+  uint_fast64_t epoch;
+  do {
+    epoch = atomic_load(&global_epoch);
+    atomic_store(&thread->section, epoch << 1 | 1);
+  } while (atomic_load(&global_epoch) != epoch);
+}
+
+void ebr_exit(void) {
+  atomic_store_explicit(&self->section, 0, memory_order_release);
+}
+
+static void free_limbo(Limbo *limbo) {
+  for (size_t i = 0; i < limbo->count; i++) {
+    limbo->items[i].free_fn(limbo->items[i].ptr);
+  }
+  limbo->count = 0;
+}
+
+// Advances the global epoch if every active reader already saw it.
+static void try_advance(void) {
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  for (EbrThread *thread = atomic_load(&registry); thread != NULL; thread = thread->next) {
+    uint_fast64_t section = atomic_load(&thread->section);
+    if ((section & 1) && section >> 1 != epoch) {
+      return;
+    }
+  }
+  atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+void ebr_retire(void *ptr, void (*free_fn)(void *ptr)) {
+  EbrThread *thread = get_self();
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  Limbo *limbo = &thread->limbo[epoch % 3];
+  if (limbo->epoch != epoch) {
+    // It holds memory retired at epoch - 3 or before, which nobody can reach
+    free_limbo(limbo);
+    limbo->epoch = epoch;
+  }
+
+  if (limbo->count == limbo->capacity) {
+    size_t capacity = limbo->capacity ? limbo->capacity * 2 : EBR_ADVANCE_EVERY;
+    Retired *items = realloc(limbo->items, capacity * sizeof(Retired));
+    if (items == NULL) {
+      fprintf(stderr, "Failed to allocate memory for epoch reclamation\n");
+      return; // leak it rather than free memory a reader may use
+    }
+    limbo->items = items;
+    limbo->capacity = capacity;
+  }
+  limbo->items[limbo->count++] = (Retired){ptr, free_fn};
+
+  if (++thread->retired_since_advance >= EBR_ADVANCE_EVERY) {
+    thread->retired_since_advance = 0;
+    try_advance();
+    epoch = atomic_load(&global_epoch);
+    for (int i = 0; i < 3; i++) {
+      if (thread->limbo[i].count != 0 && thread->limbo[i].epoch + 2 <= epoch) {
+        free_limbo(&thread->limbo[i]);
+      }
+    }
+  }
+}
+
+void ebr_drain(void) {
+  for (EbrThread *thread = atomic_load(&registry); thread != NULL; thread = thread->next) {
+    for (int i = 0; i < 3; i++) {
+      free_limbo(&thread->limbo[i]);
+    }
+  }
+}
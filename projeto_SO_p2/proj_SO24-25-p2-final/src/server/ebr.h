@@ -0,0 +1,27 @@
+#ifndef KVS_EBR_H
+#define KVS_EBR_H
+
+// Epoch based reclamation, for memory that lock free readers may still be
+// looking at after a writer unlinked it.
+//
+// Readers wrap every access to shared nodes in ebr_enter()/ebr_exit(). Writers
+// hand unlinked memory to ebr_retire() instead of freeing it; it is freed only
+// after the global epoch advanced twice, which cannot happen while a reader
+// that entered before the memory was unlinked is still inside.
+
+/// Marks the calling thread as reading shared memory. Not reentrant.
+void ebr_enter(void);
+
+/// Ends the section started by ebr_enter.
+void ebr_exit(void);
+
+/// Frees memory once no reader can still be using it.
+/// @param ptr Memory that was already unlinked from every shared structure.
+/// @param free_fn Function that frees it.
+void ebr_retire(void *ptr, void (*free_fn)(void *ptr));
+
+/// Frees everything that was retired, without waiting for readers. Only safe
+/// when no other thread can be inside ebr_enter()/ebr_exit().
+void ebr_drain(void);
+
+#endif  // KVS_EBR_H
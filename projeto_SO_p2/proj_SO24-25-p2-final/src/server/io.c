@@ -1,23 +1,144 @@
+#include "io.h"
+
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void write_str(int fd, const char *str) {
-  size_t len = strlen(str);
-  const char *ptr = str;
+#define OUT_CHUNK 4096     // bytes per output buffer chunk
+#define OUT_INLINE_IOV 16  // chunks that need no allocated iovec array
 
+// Output of the command being run by a thread, kept as a list of chunks so
+// growing it never copies what was already appended. The first chunk lives
+// in the thread itself; the others are allocated and freed on every flush.
+typedef struct OutBuffer {
+  struct iovec inline_iov[OUT_INLINE_IOV];
+  struct iovec *iov;  // inline_iov or an allocated array
+  size_t count;       // chunks in use
+  size_t capacity;    // entries in iov
+  char first[OUT_CHUNK];
+} OutBuffer;
+
+static _Thread_local OutBuffer out = {0};
+
+// Writes len bytes, retrying partial writes.
+static int write_all(int fd, const char *ptr, size_t len) {
   while (len > 0) {
     ssize_t written = write(fd, ptr, len);
 
     if (written < 0) {
       perror("Error writing string");
-      break;
+      return 1;
     }
 
     ptr += written;
     len -= (size_t)written;
   }
+  return 0;
+}
+
+void write_str(int fd, const char *str) {
+  write_all(fd, str, strlen(str));
+}
+
+// Adds an empty chunk to the buffer.
+// @return 0 if the chunk was added, 1 otherwise.
+static int out_grow(void) {
+  if (out.count == out.capacity) {
+    size_t capacity = out.capacity * 2;
+    struct iovec *iov = malloc(capacity * sizeof(struct iovec));
+    if (iov == NULL) {
+      return 1;
+    }
+    memcpy(iov, out.iov, out.count * sizeof(struct iovec));
+    if (out.iov != out.inline_iov) {
+      free(out.iov);
+    }
+    out.iov = iov;
+    out.capacity = capacity;
+  }
+
+  char *chunk = out.count == 0 ? out.first : malloc(OUT_CHUNK);
+  if (chunk == NULL) {
+    return 1;
+  }
+  out.iov[out.count++] = (struct iovec){chunk, 0};
+  return 0;
+}
+
+void out_str(const char *str) {
+  if (out.iov == NULL) {
+    out.iov = out.inline_iov;
+    out.capacity = OUT_INLINE_IOV;
+  }
+
+  size_t len = strlen(str);
+  while (len > 0) {
+    if (out.count == 0 || out.iov[out.count - 1].iov_len == OUT_CHUNK) {
+      if (out_grow() != 0) {
+        perror("Error buffering output");
+        return;
+      }
+    }
+    struct iovec *last = &out.iov[out.count - 1];
+    size_t n = OUT_CHUNK - last->iov_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy((char *)last->iov_base + last->iov_len, str, n);
+    last->iov_len += n;
+    str += n;
+    len -= n;
+  }
+}
+
+void out_flush(int fd) {
+  long iov_max = sysconf(_SC_IOV_MAX);
+  if (iov_max <= 0) {
+    iov_max = OUT_INLINE_IOV;
+  }
+
+  struct iovec *iov = out.iov;
+  size_t left = out.count;
+  while (left > 0) {
+    int n = left < (size_t)iov_max ? (int)left : (int)iov_max;
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) {
+      perror("Error writing string");
+      break;
+    }
+    // Skips what was written, finishing a chunk left halfway with write
+    size_t done = (size_t)written;
+    while (left > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      left--;
+    }
+    if (left > 0 && done > 0) {
+      if (write_all(fd, (char *)iov->iov_base + done, iov->iov_len - done) != 0) {
+        break;
+      }
+      iov++;
+      left--;
+    }
+  }
+
+  out_discard();
+}
+
+void out_discard(void) {
+  for (size_t i = 1; i < out.count; i++) {
+    free(out.iov[i].iov_base);
+  }
+  if (out.iov != NULL && out.iov != out.inline_iov) {
+    free(out.iov);
+    out.iov = out.inline_iov;
+    out.capacity = OUT_INLINE_IOV;
+  }
+  out.count = 0;
 }
 
 void write_uint(int fd, int value) {
@@ -42,4 +163,27 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   size_t bytes_to_copy = strnlen(src, n);
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
-}
\ No newline at end of file
+}
+int sync_dir(const char *path) {
+  // The directory is named by hand, since snprintf is not async signal safe
+  char dir_path[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    strcpy(dir_path, ".");
+  } else {
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    if (len >= sizeof(dir_path)) {
+      return 1;
+    }
+    memcpy(dir_path, path, len);
+    dir_path[len] = '\0';
+  }
+
+  int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return 1;
+  }
+  int failed = fsync(fd) != 0;
+  close(fd);
+  return failed;
+}
@@ -8,6 +8,19 @@
 /// @param str The string to write.
 void write_str(int fd, const char *str);
 
+/// Appends a string to the calling thread's output buffer. Nothing is
+/// written until out_flush, so it can be called while holding locks.
+/// @param str The string to append.
+void out_str(const char *str);
+
+/// Writes the calling thread's output buffer with a single writev (more if
+/// the write is partial) and empties it.
+/// @param fd The file descriptor to write to.
+void out_flush(int fd);
+
+/// Empties the calling thread's output buffer without writing it.
+void out_discard(void);
+
 /// Writes an unsigned integer to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param value The value to write.
@@ -20,4 +33,10 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char* dest, const char* src, size_t n);
 
+/// Fsyncs the directory of a file, so the file renamed to that path is still
+/// there after a crash. Async signal safe.
+/// @param path Path of the file.
+/// @return 0 if successful, 1 otherwise.
+int sync_dir(const char *path);
+
 #endif  // KVS_IO_H
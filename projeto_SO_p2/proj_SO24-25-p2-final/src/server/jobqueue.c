@@ -0,0 +1,174 @@
+#include "jobqueue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// The jobs dealt to a thread, largest first.
+typedef struct JobList {
+  pthread_mutex_t lock;  // protects next and bytes_left
+  size_t *jobs;          // indexes in JobQueue.jobs
+  size_t num_jobs;
+  size_t next;           // first job not taken yet
+  uint64_t bytes_left;   // size of the jobs not taken yet
+} JobList;
+
+struct JobQueue {
+  Job *jobs;
+  size_t num_jobs;
+  JobList *lists;
+  size_t num_workers;
+};
+
+// Builds the paths of a job from its directory entry.
+// @return 0 if the entry is a job, 1 otherwise.
+static int entry_files(const char *dir, struct dirent *entry, char *in_path, char *out_path) {
+  const char *dot = strrchr(entry->d_name, '.');
+  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 || strcmp(dot, ".job")) {
+    return 1;
+  }
+
+  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+    return 1;
+  }
+
+  strcpy(in_path, dir);
+  strcat(in_path, "/");
+  strcat(in_path, entry->d_name);
+
+  strcpy(out_path, in_path);
+  strcpy(strrchr(out_path, '.'), ".out");
+
+  return 0;
+}
+
+// Largest first, then by name, so the order does not depend on the directory.
+static int compare_jobs(const void *a, const void *b) {
+  const Job *job_a = a;
+  const Job *job_b = b;
+  if (job_a->size != job_b->size) {
+    return job_a->size > job_b->size ? -1 : 1;
+  }
+  return strcmp(job_a->in_path, job_b->in_path);
+}
+
+// Reads the jobs of the directory into jobs->jobs, sorted.
+// @return 0 if successful, 1 if memory ran out.
+static int read_jobs(JobQueue *jobs, DIR *dir, const char *dir_name) {
+  size_t capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (jobs->num_jobs == capacity) {
+      size_t new_capacity = capacity == 0 ? 64 : 2 * capacity;
+      Job *bigger = realloc(jobs->jobs, new_capacity * sizeof(Job));
+      if (bigger == NULL) {
+        return 1;
+      }
+      jobs->jobs = bigger;
+      capacity = new_capacity;
+    }
+    Job *job = &jobs->jobs[jobs->num_jobs];
+    if (entry_files(dir_name, entry, job->in_path, job->out_path)) {
+      continue;
+    }
+    // A job that cannot be stat'ed is still run, last, and fails to open then
+    struct stat st;
+    job->size = stat(job->in_path, &st) == 0 ? st.st_size : 0;
+    jobs->num_jobs++;
+  }
+  if (jobs->num_jobs > 0) {
+    qsort(jobs->jobs, jobs->num_jobs, sizeof(Job), compare_jobs);
+  }
+  return 0;
+}
+
+JobQueue *create_job_queue(DIR *dir, const char *dir_name, size_t num_workers) {
+  JobQueue *jobs = calloc(1, sizeof(JobQueue));
+  if (jobs == NULL) {
+    return NULL;
+  }
+  jobs->num_workers = num_workers;
+  jobs->lists = calloc(num_workers, sizeof(JobList));
+  if (jobs->lists == NULL || read_jobs(jobs, dir, dir_name) != 0) {
+    fprintf(stderr, "Failed to allocate memory for the jobs\n");
+    free(jobs->lists);
+    free(jobs->jobs);
+    free(jobs);
+    return NULL;
+  }
+
+  // Thread w gets jobs w, w + num_workers, ..., so each list is sorted too
+  for (size_t w = 0; w < num_workers; w++) {
+    JobList *list = &jobs->lists[w];
+    pthread_mutex_init(&list->lock, NULL);
+    size_t num_jobs = jobs->num_jobs > w ? (jobs->num_jobs - w + num_workers - 1) / num_workers : 0;
+    list->jobs = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(size_t));
+    if (list->jobs == NULL) {
+      fprintf(stderr, "Failed to allocate memory for the jobs\n");
+      jobs->num_workers = w + 1;
+      free_job_queue(jobs);
+      return NULL;
+    }
+    for (size_t i = w; i < jobs->num_jobs; i += num_workers) {
+      list->jobs[list->num_jobs++] = i;
+      list->bytes_left += (uint64_t)jobs->jobs[i].size;
+    }
+  }
+  return jobs;
+}
+
+// Takes the next job of a list.
+// @return 0 if a job was taken, 1 if the list is empty.
+static int take_from(JobQueue *jobs, JobList *list, Job *job) {
+  pthread_mutex_lock(&list->lock);
+  if (list->next == list->num_jobs) {
+    pthread_mutex_unlock(&list->lock);
+    return 1;
+  }
+  *job = jobs->jobs[list->jobs[list->next++]];
+  list->bytes_left -= (uint64_t)job->size;
+  pthread_mutex_unlock(&list->lock);
+  return 0;
+}
+
+int job_take(JobQueue *jobs, size_t worker, Job *job) {
+  if (take_from(jobs, &jobs->lists[worker], job) == 0) {
+    return 0;
+  }
+
+  // Lists only shrink, so once every other one is empty no job is left
+  for (;;) {
+    JobList *victim = NULL;
+    uint64_t most_left = 0;
+    for (size_t w = 0; w < jobs->num_workers; w++) {
+      JobList *list = &jobs->lists[w];
+      pthread_mutex_lock(&list->lock);
+      if (list->next < list->num_jobs && (victim == NULL || list->bytes_left > most_left)) {
+        victim = list;
+        most_left = list->bytes_left;
+      }
+      pthread_mutex_unlock(&list->lock);
+    }
+    if (victim == NULL) {
+      return 1;
+    }
+    // Another thread may have emptied the list meanwhile, then look again
+    if (take_from(jobs, victim, job) == 0) {
+      return 0;
+    }
+  }
+}
+
+void free_job_queue(JobQueue *jobs) {
+  for (size_t w = 0; w < jobs->num_workers; w++) {
+    pthread_mutex_destroy(&jobs->lists[w].lock);
+    free(jobs->lists[w].jobs);
+  }
+  free(jobs->lists);
+  free(jobs->jobs);
+  free(jobs);
+}
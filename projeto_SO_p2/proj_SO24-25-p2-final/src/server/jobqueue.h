@@ -0,0 +1,47 @@
+#ifndef KVS_JOBQUEUE_H
+#define KVS_JOBQUEUE_H
+
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "constants.h"
+
+// Jobs of the jobs directory, handed to the threads that run them.
+//
+// The directory is read once, before the threads start: every ".job" file is
+// stat'ed, and the jobs, sorted largest first, are dealt in turn to one list
+// per thread. Each thread so starts with one of the largest jobs, and a huge
+// job is never the last one picked. A thread runs the jobs of its own list,
+// largest first; once it is empty, it steals the largest job left in the list
+// of the thread with the most bytes of jobs left, so the lists even out as
+// jobs turn out faster or slower than their size suggests. Each list has its
+// own lock, so threads only wait for each other when stealing.
+
+typedef struct Job {
+  char in_path[MAX_JOB_FILE_NAME_SIZE];
+  char out_path[MAX_JOB_FILE_NAME_SIZE];
+  off_t size;
+} Job;
+
+typedef struct JobQueue JobQueue;
+
+/// Reads the jobs of a directory and deals them to the threads.
+/// @param dir The directory, read to its end.
+/// @param dir_name Path of the directory.
+/// @param num_workers Number of threads running the jobs.
+/// @return The jobs, NULL on failure.
+JobQueue *create_job_queue(DIR *dir, const char *dir_name, size_t num_workers);
+
+/// Takes the next job of a thread, from its own list or stolen from another.
+/// @param jobs The jobs.
+/// @param worker Index of the thread, in [0, num_workers).
+/// @param job Where to store the job.
+/// @return 0 if a job was taken, 1 if there are none left.
+int job_take(JobQueue *jobs, size_t worker, Job *job);
+
+/// Frees the jobs.
+/// @param jobs The jobs.
+void free_job_queue(JobQueue *jobs);
+
+#endif  // KVS_JOBQUEUE_H
@@ -0,0 +1,62 @@
+#include "keycmp.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYCMP_X86 1
+#else
+#define KEYCMP_X86 0
+#endif
+
+// The vector versions compare the first 32 bytes in wide loads and the last 8
+// as one word.
+_Static_assert(MAX_STRING_SIZE == 40, "key blocks are compared as 32 + 8 bytes");
+
+static int tail_equal(const char *a, const char *b) {
+  uint64_t x, y;
+  memcpy(&x, a + 32, sizeof(x));
+  memcpy(&y, b + 32, sizeof(y));
+  return x == y;
+}
+
+static int equal_scalar(const char *a, const char *b) {
+  return memcmp(a, b, MAX_STRING_SIZE) == 0;
+}
+
+#if KEYCMP_X86
+__attribute__((target("sse2"))) static int equal_sse2(const char *a, const char *b) {
+  __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(const void *)a),
+                              _mm_loadu_si128((const __m128i *)(const void *)b));
+  __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(const void *)(a + 16)),
+                              _mm_loadu_si128((const __m128i *)(const void *)(b + 16)));
+  return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF && tail_equal(a, b);
+}
+
+__attribute__((target("avx2"))) static int equal_avx2(const char *a, const char *b) {
+  __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(const void *)a),
+                                 _mm256_loadu_si256((const __m256i *)(const void *)b));
+  return _mm256_movemask_epi8(eq) == -1 && tail_equal(a, b);
+}
+#endif
+
+int (*key_equal)(const char *a, const char *b) = equal_scalar;
+
+void keycmp_init(void) {
+#if KEYCMP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    key_equal = equal_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    key_equal = equal_sse2;
+  }
+#endif
+}
+
+size_t key_block(char block[MAX_STRING_SIZE], const char *key) {
+  size_t len = strnlen(key, MAX_STRING_SIZE - 1);
+  memcpy(block, key, len);
+  memset(block + len, 0, MAX_STRING_SIZE - len);
+  return len;
+}
@@ -0,0 +1,29 @@
+#ifndef KVS_KEYCMP_H
+#define KVS_KEYCMP_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+// Key comparison for the table engines. Stored keys (and the key being looked
+// up) are kept in fixed MAX_STRING_SIZE byte blocks padded with zeros, so two
+// keys are equal exactly when their blocks are, and the blocks can be compared
+// with a few vector compares instead of a byte by byte strcmp. The
+// implementation (AVX2, SSE2 or scalar) is chosen at runtime by keycmp_init.
+
+/// Picks the fastest comparison supported by the CPU. Must be called before
+/// any other thread uses key_equal; calling it again has no effect.
+void keycmp_init(void);
+
+/// Copies a key into a block, padding it with zeros and truncating it to
+/// MAX_STRING_SIZE - 1 characters.
+/// @param block Destination block.
+/// @param key The key.
+/// @return Length of the key stored in the block.
+size_t key_block(char block[MAX_STRING_SIZE], const char *key);
+
+/// Compares two key blocks built by key_block.
+/// @return 1 if they are equal, 0 otherwise.
+extern int (*key_equal)(const char *a, const char *b);
+
+#endif  // KVS_KEYCMP_H
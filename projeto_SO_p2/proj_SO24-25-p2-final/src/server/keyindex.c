@@ -0,0 +1,288 @@
+#include "keyindex.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LEVEL 20     // enough for ~4^20 keys
+#define RADIX_CUTOFF 32  // groups of keys this small are sorted by insertion
+
+// Only new and deleted keys change the index (overwriting a value does not),
+// so a single lock is enough: scans share it and only inserts and removals
+// take it exclusively.
+typedef struct IndexNode {
+  char key[MAX_STRING_SIZE];
+  int level;
+  struct IndexNode *next[];  // one per level
+} IndexNode;
+
+struct KeyIndex {
+  pthread_rwlock_t lock;
+  IndexNode *head[MAX_LEVEL];
+};
+
+static _Thread_local uint64_t random_state = 0;
+
+// Picks the level of a new node: level n + 1 with probability 1/4^n.
+static int random_level(void) {
+  if (random_state == 0) {
+    random_state = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&random_state;
+    random_state |= 1;
+  }
+  // xorshift64
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+
+  uint64_t bits = random_state;
+  int level = 1;
+  while (level < MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+// Finds, for every level, the link after which key would be placed.
+static void find_links(KeyIndex *index, const char *key, IndexNode **links[MAX_LEVEL]) {
+  IndexNode **current = index->head;
+  for (int l = MAX_LEVEL - 1; l >= 0; l--) {
+    while (current[l] != NULL && strcmp(current[l]->key, key) < 0) {
+      current = current[l]->next;
+    }
+    links[l] = &current[l];
+  }
+}
+
+KeyIndex *create_key_index(void) {
+  KeyIndex *index = calloc(1, sizeof(KeyIndex));
+  if (index == NULL) {
+    return NULL;
+  }
+  pthread_rwlock_init(&index->lock, NULL);
+  return index;
+}
+
+int key_index_insert(KeyIndex *index, const char *key) {
+  int level = random_level();
+  IndexNode *node = malloc(sizeof(IndexNode) + (size_t)level * sizeof(IndexNode *));
+  if (node == NULL) {
+    return 1;
+  }
+  strncpy(node->key, key, MAX_STRING_SIZE - 1);
+  node->key[MAX_STRING_SIZE - 1] = '\0';
+  node->level = level;
+
+  IndexNode **links[MAX_LEVEL];
+  pthread_rwlock_wrlock(&index->lock);
+  find_links(index, node->key, links);
+  for (int l = 0; l < level; l++) {
+    node->next[l] = *links[l];
+    *links[l] = node;
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return 0;
+}
+
+void key_index_remove(KeyIndex *index, const char *key) {
+  IndexNode **links[MAX_LEVEL];
+  pthread_rwlock_wrlock(&index->lock);
+  find_links(index, key, links);
+  IndexNode *node = *links[0];
+  if (node == NULL || strcmp(node->key, key) != 0) {
+    pthread_rwlock_unlock(&index->lock);
+    return;
+  }
+  for (int l = 0; l < node->level; l++) {
+    *links[l] = node->next[l];
+  }
+  pthread_rwlock_unlock(&index->lock);
+  free(node);
+}
+
+size_t key_index_scan(KeyIndex *index, const char *from, int skip_from, char keys[][MAX_STRING_SIZE],
+                      size_t max_keys) {
+  size_t num_keys = 0;
+  pthread_rwlock_rdlock(&index->lock);
+  IndexNode **links[MAX_LEVEL];
+  find_links(index, from, links);
+  IndexNode *node = *links[0];
+  if (skip_from && node != NULL && strcmp(node->key, from) == 0) {
+    node = node->next[0];
+  }
+  for (; node != NULL && num_keys < max_keys; node = node->next[0]) {
+    memcpy(keys[num_keys++], node->key, MAX_STRING_SIZE);
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return num_keys;
+}
+
+// Sorts keys whose first depth characters are equal with insertion sort.
+static void insertion_sort(char keys[][MAX_STRING_SIZE], size_t num_keys, size_t depth) {
+  for (size_t i = 1; i < num_keys; i++) {
+    char key[MAX_STRING_SIZE];
+    memcpy(key, keys[i], MAX_STRING_SIZE);
+    size_t j = i;
+    for (; j > 0 && strcmp(keys[j - 1] + depth, key + depth) > 0; j--) {
+      memcpy(keys[j], keys[j - 1], MAX_STRING_SIZE);
+    }
+    memcpy(keys[j], key, MAX_STRING_SIZE);
+  }
+}
+
+// MSD radix sort of keys whose first depth characters are equal: splits them
+// by their next character, in place (American flag sort), and sorts each group
+// on the following one.
+static void radix_sort(char keys[][MAX_STRING_SIZE], size_t num_keys, size_t depth) {
+  while (num_keys > RADIX_CUTOFF && depth < MAX_STRING_SIZE - 1) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < num_keys; i++) {
+      counts[(unsigned char)keys[i][depth]]++;
+    }
+    if (counts[(unsigned char)keys[0][depth]] == num_keys) {
+      if (keys[0][depth] == '\0') {
+        return;  // the keys are all equal
+      }
+      depth++;  // all have the same character here
+      continue;
+    }
+
+    size_t next[256];
+    size_t ends[256];
+    size_t start = 0;
+    for (size_t c = 0; c < 256; c++) {
+      next[c] = start;
+      start += counts[c];
+      ends[c] = start;
+    }
+    for (size_t c = 0; c < 256; c++) {
+      while (next[c] < ends[c]) {
+        unsigned char other = (unsigned char)keys[next[c]][depth];
+        if (other == c) {
+          next[c]++;
+        } else {
+          char aux[MAX_STRING_SIZE];
+          memcpy(aux, keys[next[c]], MAX_STRING_SIZE);
+          memcpy(keys[next[c]], keys[next[other]], MAX_STRING_SIZE);
+          memcpy(keys[next[other]++], aux, MAX_STRING_SIZE);
+        }
+      }
+    }
+
+    for (size_t c = 1; c < 256; c++) {
+      if (counts[c] > 1) {
+        radix_sort(keys + ends[c] - counts[c], counts[c], depth + 1);
+      }
+    }
+    return;
+  }
+  insertion_sort(keys, num_keys, depth);
+}
+
+void key_index_sort(char keys[][MAX_STRING_SIZE], size_t num_keys) {
+  radix_sort(keys, num_keys, 0);
+}
+
+// Moves a run of a heap of runs, ordered by their current key, down to its
+// place.
+static void sift_down(size_t *heap, size_t size, size_t i, char (*const runs[])[MAX_STRING_SIZE],
+                      const size_t positions[]) {
+  for (;;) {
+    size_t smallest = i;
+    for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++) {
+      const char *key = runs[heap[child]][positions[heap[child]]];
+      if (strcmp(key, runs[heap[smallest]][positions[heap[smallest]]]) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    size_t aux = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = aux;
+    i = smallest;
+  }
+}
+
+int key_index_load(KeyIndex *index, size_t num_runs, char (*const runs[])[MAX_STRING_SIZE],
+                   const size_t run_sizes[]) {
+  size_t *heap = malloc(num_runs * sizeof(size_t));
+  size_t *positions = calloc(num_runs, sizeof(size_t));
+  if (heap == NULL || positions == NULL) {
+    free(heap);
+    free(positions);
+    return 1;
+  }
+
+  pthread_rwlock_wrlock(&index->lock);
+  if (index->head[0] != NULL) {
+    pthread_rwlock_unlock(&index->lock);
+    free(heap);
+    free(positions);
+    return 1;
+  }
+
+  // Merges the runs, appending every key after the last one: the links to
+  // fill next are the last node of each level
+  IndexNode **links[MAX_LEVEL];
+  for (int l = 0; l < MAX_LEVEL; l++) {
+    links[l] = &index->head[l];
+  }
+  IndexNode *last = NULL;
+  size_t size = 0;
+  for (size_t r = 0; r < num_runs; r++) {
+    if (run_sizes[r] > 0) {
+      heap[size++] = r;
+    }
+  }
+  for (size_t i = size / 2; i-- > 0;) {
+    sift_down(heap, size, i, runs, positions);
+  }
+
+  int result = 0;
+  while (size > 0) {
+    size_t r = heap[0];
+    const char *key = runs[r][positions[r]];
+    if (last == NULL || strcmp(last->key, key) != 0) {
+      int level = random_level();
+      IndexNode *node = malloc(sizeof(IndexNode) + (size_t)level * sizeof(IndexNode *));
+      if (node == NULL) {
+        result = 1;
+        break;
+      }
+      memcpy(node->key, key, MAX_STRING_SIZE);
+      node->key[MAX_STRING_SIZE - 1] = '\0';
+      node->level = level;
+      for (int l = 0; l < level; l++) {
+        node->next[l] = NULL;
+        *links[l] = node;
+        links[l] = &node->next[l];
+      }
+      last = node;
+    }
+
+    if (++positions[r] == run_sizes[r]) {
+      heap[0] = heap[--size];
+    }
+    sift_down(heap, size, 0, runs, positions);
+  }
+  pthread_rwlock_unlock(&index->lock);
+
+  free(heap);
+  free(positions);
+  return result;
+}
+
+void free_key_index(KeyIndex *index) {
+  IndexNode *node = index->head[0];
+  while (node != NULL) {
+    IndexNode *next = node->next[0];
+    free(node);
+    node = next;
+  }
+  pthread_rwlock_destroy(&index->lock);
+  free(index);
+}
@@ -0,0 +1,62 @@
+#ifndef KVS_KEYINDEX_H
+#define KVS_KEYINDEX_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+// Ordered index of the keys in the table (a skip list), used by SCAN to visit
+// a key range without walking the whole table. It only holds keys: values are
+// read from the table. Keys are ordered by strcmp.
+
+typedef struct KeyIndex KeyIndex;
+
+/// Creates an empty index.
+/// @return The index, NULL on failure.
+KeyIndex *create_key_index(void);
+
+/// Adds a key that is not in the index.
+/// @param index The index.
+/// @param key The key.
+/// @return 0 if the key was added, 1 on failure.
+int key_index_insert(KeyIndex *index, const char *key);
+
+/// Removes a key from the index, if present.
+/// @param index The index.
+/// @param key The key.
+void key_index_remove(KeyIndex *index, const char *key);
+
+/// Copies the keys that follow a given one, in order.
+/// @param index The index.
+/// @param from Keys smaller than this one are skipped.
+/// @param skip_from If not 0, from itself is skipped too.
+/// @param keys Array to store the keys.
+/// @param max_keys Maximum number of keys to copy.
+/// @return Number of keys copied.
+size_t key_index_scan(KeyIndex *index, const char *from, int skip_from, char keys[][MAX_STRING_SIZE],
+                      size_t max_keys);
+
+/// Sorts keys in the order of the index, in place. A radix sort, much faster
+/// than qsort with strcmp for many keys.
+/// @param keys The keys.
+/// @param num_keys Number of keys.
+void key_index_sort(char keys[][MAX_STRING_SIZE], size_t num_keys);
+
+/// Fills an empty index with runs of keys sorted by strcmp, merging them, so
+/// nothing has to be searched for. Used to restore the index of a table
+/// loaded in bulk.
+/// @param index The index.
+/// @param num_runs Number of runs.
+/// @param runs The runs of keys, each in increasing order. A key may be in
+///             more than one run.
+/// @param run_sizes Number of keys of each run.
+/// @return 0 if the keys were added, 1 if the index is not empty or memory ran
+///         out (the keys added so far stay in the index).
+int key_index_load(KeyIndex *index, size_t num_runs, char (*const runs[])[MAX_STRING_SIZE],
+                   const size_t run_sizes[]);
+
+/// Frees the index.
+/// @param index The index.
+void free_key_index(KeyIndex *index);
+
+#endif  // KVS_KEYINDEX_H
@@ -1,319 +1,693 @@
 #include "kvs.h"
+#include "ebr.h"
+#include "keycmp.h"
+#include "kvs_common.h"
+#include "slab.h"
 #include "string.h"
-#include <ctype.h>
 
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+#define INITIAL_TABLE_SIZE 64   // must be a power of two >= NUM_STRIPES
+#define MAX_LOAD_FACTOR 1       // keys per bucket before the table grows
+#define REHASH_STEP 4           // buckets migrated per write/delete while resizing
+// Memory charged to the budget per pair: the node (key block included) and its
+// share of the bucket array (one head per pair at the maximum load factor).
+#define ENTRY_COST (sizeof(KeyNode) + sizeof(KeyNode *))
+
+// Nodes and bucket arrays are read without locks by read_pair, so they are
+// published with atomic stores and, once unlinked, only freed through
+// ebr_retire. The subscriber list is only used with the stripe locked.
+//
+// The hash and length of the key are kept in the node, so a lookup rejects
+// almost every other key in the chain without loading its bytes, and the key
+// itself is a zero padded block compared with key_equal. The block is kept in
+// the node, next to the hash, so a hit costs one cache miss per node instead
+// of two.
+//
+// The value is stored in the node and overwritten in place, guarded by seq
+// (see kvs_common.h): readers copy it optimistically, so a READ of a hot key
+// neither waits for its writers nor writes to memory they share.
+//
+// referenced is the CLOCK bit used for eviction: set when the pair is read or
+// overwritten (not when it is added, so pairs that are never used again go
+// first), cleared when the clock hand passes. Readers only store it when it
+// is not set yet, so a hot key stays read only.
+typedef struct KeyNode {
+    uint64_t hash;
+    uint16_t key_len;
+    atomic_uchar referenced;
+    atomic_uint seq;  // odd while the value is being overwritten
+    char key[MAX_STRING_SIZE];  // zero padded block (see keycmp.h)
+    _Atomic(uint64_t) value[BLOCK_WORDS];
+    ClientNode *clients;
+    _Atomic(struct KeyNode *) next;
+} KeyNode;
+
+typedef struct Buckets {
+    size_t size;
+    _Atomic(KeyNode *) heads[];
+} Buckets;
+
+// While a resize is in progress the pairs live in two bucket arrays: table[0]
+// (the old one) and table[1] (twice as big). Every write/delete migrates a few
+// buckets from table[0] to table[1], so the cost of a resize is spread across
+// the following operations instead of being paid by a single kvs_write.
+// Both arrays are published together, so a lock free reader always sees a
+// matching pair.
+typedef struct TableState {
+    Buckets *table[2]; // table[1] is NULL when not resizing
+} TableState;
+
+// Bucket i of either array is protected by stripes[i % NUM_STRIPES]. Since both
+// sizes are multiples of NUM_STRIPES, a key always maps to the same stripe
+// (hash % NUM_STRIPES) and migrating a bucket only needs that stripe. Write
+// operations only lock their stripes: starting or finishing a resize replaces
+// the TableState with every stripe locked, so the state seen by a thread
+// holding any stripe cannot change meanwhile. resize_lock only keeps two
+// threads from resizing at once, and nobody waits for it.
+//
+// Readers take no lock. Migrating a bucket relinks its nodes into the new
+// array, which can make a reader walking the old chain miss the rest of it, so
+// migrations bump migrate_seq of their stripe and a reader that did not find
+// its key retries if a migration ran meanwhile.
+//
+// With a memory limit every stripe gets an equal share of it (keys are spread
+// evenly by the hash), so the accounting and the eviction of a stripe only
+// touch memory protected by its lock.
+struct HashTable {
+    _Atomic(TableState *) state;
+    size_t rehash_idx[NUM_STRIPES];      // next bucket of table[0] to migrate, per stripe
+    atomic_uint migrate_seq[NUM_STRIPES]; // odd while a stripe is being migrated
+    atomic_size_t rehash_left;           // stripes that still have buckets to migrate
+    atomic_size_t helper_stripe;         // round robin stripe for idle migration
+    atomic_size_t count;                 // number of pairs
+    size_t stripe_budget;                // bytes per stripe, 0 for no limit
+    size_t memory[NUM_STRIPES];          // bytes used by the pairs of each stripe
+    size_t clock_hand[NUM_STRIPES];      // next bucket of the stripe to sweep
+    void (*on_evict)(const char *key, void *arg);
+    void *evict_arg;
+    SnapshotSet snapshots;               // used by snapshot_begin and snapshot_walk
+    pthread_mutex_t resize_lock;
+    pthread_rwlock_t stripes[NUM_STRIPES];
+};
+
+static Buckets *alloc_buckets(size_t size) {
+    Buckets *buckets = calloc(1, sizeof(Buckets) + size * sizeof(_Atomic(KeyNode *)));
+    if (buckets != NULL) {
+        buckets->size = size;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    return buckets;
+}
+
+static TableState *alloc_state(Buckets *old, Buckets *new) {
+    TableState *state = malloc(sizeof(TableState));
+    if (state != NULL) {
+        state->table[0] = old;
+        state->table[1] = new;
+    }
+    return state;
+}
+
+// State seen by a thread holding a stripe or resize_lock, which cannot change
+// meanwhile.
+static TableState *locked_state(HashTable *ht) {
+    return atomic_load_explicit(&ht->state, memory_order_relaxed);
+}
+
+static KeyNode *load_node(_Atomic(KeyNode *) *link) {
+    return atomic_load_explicit(link, memory_order_acquire);
+}
+
+static void free_node(void *ptr) {
+    KeyNode *keyNode = ptr;
+    slab_free(keyNode, sizeof(KeyNode));
 }
 
 struct HashTable* create_hash_table() {
 	HashTable *ht = malloc(sizeof(HashTable));
 	if (!ht) return NULL;
-	for (int i = 0; i < TABLE_SIZE; i++) {
-		ht->table[i] = NULL;
+	keycmp_init();
+	Buckets *buckets = alloc_buckets(INITIAL_TABLE_SIZE);
+	TableState *state = buckets ? alloc_state(buckets, NULL) : NULL;
+	if (!state) {
+		free(buckets);
+		free(ht);
+		return NULL;
+	}
+	atomic_init(&ht->state, state);
+	atomic_init(&ht->rehash_left, 0);
+	atomic_init(&ht->helper_stripe, 0);
+	atomic_init(&ht->count, 0);
+	ht->stripe_budget = 0;
+	ht->on_evict = NULL;
+	ht->evict_arg = NULL;
+	snapshot_init(&ht->snapshots);
+	pthread_mutex_init(&ht->resize_lock, NULL);
+	for (int i = 0; i < NUM_STRIPES; i++) {
+		atomic_init(&ht->migrate_seq[i], 0);
+		ht->memory[i] = 0;
+		ht->clock_hand[i] = 0;
+		pthread_rwlock_init(&ht->stripes[i], NULL);
 	}
-	pthread_rwlock_init(&ht->tablelock, NULL);
 	return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+// Migrates up to n non empty buckets of the given stripe from table[0] to
+// table[1]. Must be called with the stripe locked for writing.
+static void rehash_stripe(HashTable *ht, size_t stripe, size_t n) {
+    TableState *state = locked_state(ht);
+    Buckets *old = state->table[0];
+    Buckets *new = state->table[1];
+    size_t i = ht->rehash_idx[stripe];
+    if (i >= old->size) {
+        return; // this stripe is already migrated
+    }
 
-    // Search for the key node
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // overwrite value
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-
-            ClientNode *current_client = keyNode->clients;
-            while (current_client != NULL) {
-                char message[82];
-                char formatted_key[40];
-                char formatted_value[40];
-
-                strncpy(formatted_key, key, 39); 
-                strncpy(formatted_value, value, 39);
-
-                snprintf(message, sizeof(message), "(%s,%s)", formatted_key, formatted_value);
-
-                if (write(current_client->pipeNoti, message, strlen(message)) == -1) {
-                    perror("Failed to write notification to pipe");
-                }
-                current_client = current_client->next;
-            }
+    atomic_fetch_add_explicit(&ht->migrate_seq[stripe], 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
 
-            return 0;
+    size_t visits = n * 10; // bound the work done on sparse tables
+    while (i < old->size && n > 0 && visits-- > 0) {
+        KeyNode *keyNode = load_node(&old->heads[i]);
+        if (keyNode != NULL) {
+            n--;
+        }
+        while (keyNode != NULL) {
+            KeyNode *next = load_node(&keyNode->next);
+            size_t index = keyNode->hash & (new->size - 1);
+            atomic_store_explicit(&keyNode->next, load_node(&new->heads[index]), memory_order_release);
+            atomic_store_explicit(&new->heads[index], keyNode, memory_order_release);
+            keyNode = next;
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
+        atomic_store_explicit(&old->heads[i], NULL, memory_order_release);
+        i += NUM_STRIPES;
+    }
+
+    atomic_fetch_add_explicit(&ht->migrate_seq[stripe], 1, memory_order_release);
+
+    ht->rehash_idx[stripe] = i;
+    if (i >= old->size) {
+        atomic_fetch_sub(&ht->rehash_left, 1);
     }
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
-    return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+static void free_state(void *ptr) {
+    free(ptr);
+}
 
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-    char *value;
+static void lock_mask(HashTable *ht, uint64_t mask, int write);
+static void release_mask(HashTable *ht, uint64_t mask);
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return the value if found
+// Starts or finishes a resize. Only the new (empty) bucket array is allocated
+// here, the pairs are moved later by rehash_stripe. Must be called without
+// stripes locked. Never waits for resize_lock: if another thread holds it, the
+// next operation will try again.
+static void resize_if_needed(HashTable *ht) {
+    if (pthread_mutex_trylock(&ht->resize_lock) != 0) {
+        return;
+    }
+
+    // Only resizes replace the state, so it is stable while allocating
+    TableState *state = locked_state(ht);
+    TableState *next = NULL;
+    int finish = state->table[1] != NULL;
+    if (finish && atomic_load(&ht->rehash_left) == 0) {
+        next = alloc_state(state->table[1], NULL);
+    } else if (!finish && atomic_load(&ht->count) >= state->table[0]->size * MAX_LOAD_FACTOR) {
+        Buckets *buckets = alloc_buckets(state->table[0]->size * 2);
+        next = buckets ? alloc_state(state->table[0], buckets) : NULL;
+        if (next == NULL) { // on failure keep working with longer chains
+            free(buckets);
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
     }
 
-    return NULL; // Key not found
+    if (next != NULL) {
+        // Only swapping the bucket arrays needs every stripe
+        uint64_t all = ~(uint64_t)0 >> (64 - NUM_STRIPES);
+        lock_mask(ht, all, 1);
+        if (!finish) {
+            for (size_t i = 0; i < NUM_STRIPES; i++) {
+                ht->rehash_idx[i] = i;
+            }
+            atomic_store(&ht->rehash_left, NUM_STRIPES);
+        }
+        atomic_store_explicit(&ht->state, next, memory_order_release);
+        release_mask(ht, all);
+        if (finish) {
+            ebr_retire(state->table[0], free);
+        }
+        ebr_retire(state, free_state);
+    }
+    pthread_mutex_unlock(&ht->resize_lock);
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+// Called before the stripes of an operation are released. Migrates some
+// buckets of a stripe nobody is using, so a resize also finishes on stripes
+// that are never written, and reports whether the bucket arrays need to be
+// swapped.
+// @return 1 if resize_if_needed should be called, 0 otherwise.
+static int table_maintenance(HashTable *ht) {
+    TableState *state = locked_state(ht);
+    if (state->table[1] == NULL) {
+        return atomic_load(&ht->count) >= state->table[0]->size * MAX_LOAD_FACTOR;
+    }
+    if (atomic_load(&ht->rehash_left) == 0) {
+        return 1;
+    }
 
-    // Search for the key node
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    size_t stripe = atomic_fetch_add(&ht->helper_stripe, 1) & (NUM_STRIPES - 1);
+    if (pthread_rwlock_trywrlock(&ht->stripes[stripe]) == 0) {
+        rehash_stripe(ht, stripe, REHASH_STEP);
+        pthread_rwlock_unlock(&ht->stripes[stripe]);
+    }
+    return atomic_load(&ht->rehash_left) == 0;
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
+static void lock_mask(HashTable *ht, uint64_t mask, int write) {
+    for (size_t i = 0; i < NUM_STRIPES; i++) {
+        if (mask & ((uint64_t)1 << i)) {
+            if (write) {
+                pthread_rwlock_wrlock(&ht->stripes[i]);
+            } else {
+                pthread_rwlock_rdlock(&ht->stripes[i]);
+            }
+        }
+    }
+}
 
-            char formatted_key[40];
-            char formatted_value[40];
-            char message[82]; 
+static void release_mask(HashTable *ht, uint64_t mask) {
+    for (size_t i = NUM_STRIPES; i-- > 0;) {
+        if (mask & ((uint64_t)1 << i)) {
+            pthread_rwlock_unlock(&ht->stripes[i]);
+        }
+    }
+}
 
-            strncpy(formatted_key, key, 39);  
-            strncpy(formatted_value, "DELETED", 39); 
+static void unlock_mask(HashTable *ht, uint64_t mask) {
+    int resize = table_maintenance(ht);
+    release_mask(ht, mask);
+    if (resize) {
+        resize_if_needed(ht);
+    }
+}
 
-            snprintf(message, sizeof(message), "(%s,%s)", formatted_key, formatted_value);
+void lock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], int write) {
+    lock_mask(ht, stripe_mask(num_keys, keys), write);
+}
 
-            ClientNode *current_client = keyNode->clients;
-            while (current_client != NULL) {
-                if (write(current_client->pipeNoti, message, strlen(message)) == -1) {
-                    perror("Failed to write notification to pipe");
-                }
-                current_client = current_client->next;
-            }
+void unlock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE]) {
+    unlock_mask(ht, stripe_mask(num_keys, keys));
+}
 
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+void lock_table(HashTable *ht, int write) {
+    lock_mask(ht, ~(uint64_t)0 >> (64 - NUM_STRIPES), write);
+}
+
+void unlock_table(HashTable *ht) {
+    unlock_mask(ht, ~(uint64_t)0 >> (64 - NUM_STRIPES));
+}
+
+// Finds the node with the given key. Safe without locks inside ebr_enter(),
+// but may then miss a key whose bucket is being migrated.
+// @param state Bucket arrays to search.
+// @param block The key, as built by key_block.
+// @param len Length of the key.
+// @param h Hash of the key.
+// @param link If not NULL, set to the pointer that references the node.
+// @return The node if found, NULL otherwise.
+static KeyNode *find_node(TableState *state, const char *block, size_t len, uint64_t h,
+                          _Atomic(KeyNode *) **link) {
+    for (int i = 0; i < 2 && state->table[i] != NULL; i++) {
+        Buckets *buckets = state->table[i];
+        _Atomic(KeyNode *) *current = &buckets->heads[h & (buckets->size - 1)];
+        KeyNode *keyNode;
+        while ((keyNode = load_node(current)) != NULL) {
+            if (keyNode->hash == h && keyNode->key_len == len && key_equal(keyNode->key, block)) {
+                if (link) *link = current;
+                return keyNode;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-
-            while (keyNode->clients != NULL) {
-                ClientNode *temp = keyNode->clients;
-                keyNode->clients = keyNode->clients->next;
-                free(temp);
+            current = &keyNode->next;
+        }
+    }
+    return NULL;
+}
+
+// Copies the pairs of a stripe for the snapshots being taken that do not have
+// them yet. Must be called with the stripe locked for writing, before any
+// of its pairs changes.
+static void preserve_stripe(HashTable *ht, size_t stripe) {
+    unsigned int pending = ht->snapshots.pending[stripe];
+    if (!pending) {
+        return;
+    }
+    ht->snapshots.pending[stripe] = 0;
+    TableState *state = locked_state(ht);
+    for (int t = 0; t < 2 && state->table[t] != NULL; t++) {
+        Buckets *buckets = state->table[t];
+        for (size_t i = stripe; i < buckets->size; i += NUM_STRIPES) {
+            for (KeyNode *keyNode = load_node(&buckets->heads[i]); keyNode != NULL;
+                 keyNode = load_node(&keyNode->next)) {
+                char value[MAX_STRING_SIZE];
+                load_block(value, keyNode->value);
+                snapshot_add(&ht->snapshots, pending, stripe, keyNode->key, value);
             }
+        }
+    }
+}
 
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+// Sets the CLOCK bit of a node, without writing to it if it is already set.
+static void mark_referenced(KeyNode *keyNode) {
+    if (!atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+    }
+}
+
+// Unlinks a node and hands it to ebr_retire. Must be called with its stripe
+// locked for writing.
+// @param link Pointer that references the node.
+// @param reason Value sent to the subscribers ("DELETED" or "EVICTED").
+static void remove_node(HashTable *ht, _Atomic(KeyNode *) *link, KeyNode *keyNode, const char *reason) {
+    notify_clients(keyNode->clients, keyNode->key, reason);
+
+    // Link the previous node (or the bucket) to the next node
+    atomic_store_explicit(link, load_node(&keyNode->next), memory_order_release);
+    atomic_fetch_sub(&ht->count, 1);
+    ht->memory[stripe_of(keyNode->hash)] -= ENTRY_COST;
+
+    // Readers may still be looking at the node, so its memory is only freed
+    // once they are done
+    free_clients(&keyNode->clients);
+    ebr_retire(keyNode, free_node);
+}
+
+// Evicts pairs of a stripe until it is back within its budget, sweeping its
+// buckets with a CLOCK hand: a pair whose bit is set gets a second chance (the
+// bit is cleared), the first one found without it is evicted. Must be called
+// with the stripe locked for writing.
+// @param keep Pair that must not be evicted (the one just written).
+static void evict_stripe(HashTable *ht, size_t stripe, KeyNode *keep) {
+    TableState *state = locked_state(ht);
+    if (state->table[1] != NULL) {
+        // Finish migrating the stripe, so all its pairs are in table[1]
+        while (ht->rehash_idx[stripe] < state->table[0]->size) {
+            rehash_stripe(ht, stripe, REHASH_STEP);
+        }
+    }
+    Buckets *buckets = state->table[1] != NULL ? state->table[1] : state->table[0];
+    size_t stripe_buckets = buckets->size / NUM_STRIPES;
+
+    // Two full sweeps clear every bit, so they always find a victim
+    for (size_t visits = 2 * stripe_buckets + 1; visits > 0 && ht->memory[stripe] > ht->stripe_budget; visits--) {
+        size_t index = (ht->clock_hand[stripe]++ % stripe_buckets) * NUM_STRIPES + stripe;
+        _Atomic(KeyNode *) *link = &buckets->heads[index];
+        KeyNode *keyNode;
+        while ((keyNode = load_node(link)) != NULL && ht->memory[stripe] > ht->stripe_budget) {
+            if (keyNode == keep) {
+                link = &keyNode->next;
+                continue;
+            }
+            if (atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&keyNode->referenced, 0, memory_order_relaxed);
+                link = &keyNode->next;
+                continue;
+            }
+            if (ht->on_evict != NULL) {
+                ht->on_evict(keyNode->key, ht->evict_arg);
+            }
+            remove_node(ht, link, keyNode, "EVICTED");
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
+}
 
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    preserve_stripe(ht, stripe_of(h));
+    TableState *state = locked_state(ht);
+    if (state->table[1] != NULL) rehash_stripe(ht, stripe_of(h), REHASH_STEP);
+
+    char value_block[MAX_STRING_SIZE];
+    string_block(value_block, value);
+
+    KeyNode *keyNode = find_node(state, block, len, h, NULL);
+    if (keyNode != NULL) {
+        // overwrite value
+        seq_store_block(&keyNode->seq, keyNode->value, value_block);
+        mark_referenced(keyNode);
+        notify_clients(keyNode->clients, key, value);
+        return 0;
+    }
+
+    // Key not found, create a new key node
+    // New keys always go to the new bucket array while resizing
+    Buckets *buckets = state->table[1] != NULL ? state->table[1] : state->table[0];
+    size_t index = h & (buckets->size - 1);
+    keyNode = slab_alloc(sizeof(KeyNode));
+    if (keyNode == NULL) {
+        return -1;
+    }
+    memcpy(keyNode->key, block, MAX_STRING_SIZE);
+    keyNode->hash = h;
+    keyNode->key_len = (uint16_t)len;
+    atomic_init(&keyNode->referenced, 0);
+    atomic_init(&keyNode->seq, 0);
+    store_block(keyNode->value, value_block);
+    keyNode->clients = NULL;
+    atomic_init(&keyNode->next, load_node(&buckets->heads[index])); // Link to existing nodes
+    // Place new key node at the start of the list, only now visible to readers
+    atomic_store_explicit(&buckets->heads[index], keyNode, memory_order_release);
+    atomic_fetch_add(&ht->count, 1);
+
+    size_t stripe = stripe_of(h);
+    ht->memory[stripe] += ENTRY_COST;
+    if (ht->stripe_budget != 0 && ht->memory[stripe] > ht->stripe_budget) {
+        evict_stripe(ht, stripe, keyNode);
+    }
     return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+int read_pair(HashTable *ht, const char *key, char *value, size_t size) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    atomic_uint *seq = &ht->migrate_seq[stripe_of(h)];
+    int result = 1;
+
+    ebr_enter();
+    while (1) {
+        unsigned int before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield(); // a migration of this stripe is relinking nodes
+            continue;
+        }
+        KeyNode *keyNode = find_node(atomic_load_explicit(&ht->state, memory_order_acquire), block, len, h, NULL);
+        if (keyNode != NULL) {
+            char copy[MAX_STRING_SIZE];
+            seq_load_block(&keyNode->seq, keyNode->value, copy);
+            copy_value(value, copy, size);
+            mark_referenced(keyNode);
+            result = 0;
+            break;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before) {
+            break; // Key not found
         }
     }
-    pthread_rwlock_destroy(&ht->tablelock);
-    free(ht);
+    ebr_exit();
+    return result;
 }
 
-int subscribe(HashTable *ht, const char *key, int pipeNoti) {
-    // Indice da chave
-    int index = hash(key);
-    
-    // Obtem o no da lista
-    KeyNode *keyNode = ht->table[index];
-
-    // Percorre a lista
-    while (keyNode != NULL) {
-        // Compara a chave atual com a fornecida
-        if (strcmp(keyNode->key, key) == 0) {
-            // Se a chave for encontrada percorre a lista de clientes
-            ClientNode *current_client = keyNode->clients;
-            while (current_client != NULL) {
-                // Caso o cliente ja esteja subscrito
-                if (current_client->pipeNoti == pipeNoti) {
-                    return 0;
-                }
-                // Proximo cliente
-                current_client = current_client->next;
-            }
-            // Caso nao esteja inscrito
-            ClientNode *new_client = malloc(sizeof(ClientNode));
-            // Se falhar a alocacao de espaco
-            if (new_client == NULL) {
-                perror("Failed to allocate memory for new client");
-                return 1;
-            }
-            // Armazenar os dados do cliente
-            new_client->pipeNoti = pipeNoti;
-            new_client->next = keyNode->clients;
-            keyNode->clients = new_client;
+int delete_pair(HashTable *ht, const char *key) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    preserve_stripe(ht, stripe_of(h));
+    TableState *state = locked_state(ht);
+    if (state->table[1] != NULL) rehash_stripe(ht, stripe_of(h), REHASH_STEP);
 
-            return 0;// Cliente subscrito
-        }
-        keyNode = keyNode->next; 
+    // Search for the key node
+    _Atomic(KeyNode *) *link;
+    KeyNode *keyNode = find_node(state, block, len, h, &link);
+    if (keyNode == NULL) {
+        return 1;
     }
-    // Caso a chave nao seja encontrada
-    printf("Key '%s' not found in the hash table\n", key);
-    return 1;
+
+    // Key found; delete this node
+    remove_node(ht, link, keyNode, "DELETED");
+    return 0;
 }
 
-int unsubscribe(HashTable *ht, const char *key, int pipeNoti) {
-    // Indice da chave 
-    int index = hash(key);
-
-    // Obtem o no da lista
-    KeyNode *keyNode = ht->table[index];
-
-    // Percorre os nos da lista
-    while (keyNode != NULL) {
-        // Compara a chave atual com a fornecida
-        if (strcmp(keyNode->key, key) == 0) {
-            // Inicializacao de ponteiros para percorrer a lista
-            ClientNode *current_client = keyNode->clients;
-            ClientNode *prev_client = NULL;
-
-            // Percorre a lista de clientes 
-            while (current_client != NULL) {
-                if (current_client->pipeNoti == pipeNoti) {
-                    // Caso o cliente a ser removido seja o primeiro da lista
-                    if (prev_client == NULL) {
-                        keyNode->clients = current_client->next;
-                    }
-                    // Restantes posicoes
-                    else { 
-                        prev_client->next = current_client->next;
-                    }
-                    // Liberta memoria alocada para o cliente removido
-                    free(current_client);
-                    return 0;
-                }
-                // Avanca para o proximo cliente
-                prev_client = current_client;
-                current_client = current_client->next;
+void set_memory_limit(HashTable *ht, size_t max_bytes, void (*on_evict)(const char *key, void *arg), void *arg) {
+    ht->stripe_budget = max_bytes / NUM_STRIPES;
+    if (max_bytes != 0 && ht->stripe_budget < ENTRY_COST) {
+        ht->stripe_budget = ENTRY_COST; // keep at least one pair per stripe
+    }
+    ht->on_evict = on_evict;
+    ht->evict_arg = arg;
+}
+
+void reserve_pairs(HashTable *ht, size_t num_pairs) {
+    TableState *state = locked_state(ht);
+    if (atomic_load(&ht->count) != 0 || state->table[1] != NULL) {
+        return;
+    }
+    size_t size = state->table[0]->size;
+    while (size * MAX_LOAD_FACTOR <= num_pairs) {
+        size *= 2;
+    }
+    if (size == state->table[0]->size) {
+        return;
+    }
+    Buckets *buckets = alloc_buckets(size);
+    if (buckets == NULL) {
+        return; // the table grows as pairs are added instead
+    }
+    free(state->table[0]);
+    state->table[0] = buckets;
+}
+
+void iterate_part(HashTable *ht, size_t part, size_t num_parts,
+                  void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    TableState *state = locked_state(ht);
+    for (int t = 0; t < 2 && state->table[t] != NULL; t++) {
+        Buckets *buckets = state->table[t];
+        size_t end = buckets->size * (part + 1) / num_parts;
+        for (size_t i = buckets->size * part / num_parts; i < end; i++) {
+            for (KeyNode *keyNode = load_node(&buckets->heads[i]); keyNode != NULL;
+                 keyNode = load_node(&keyNode->next)) {
+                char value[MAX_STRING_SIZE]; // no writer can change it meanwhile
+                load_block(value, keyNode->value);
+                visit(keyNode->key, value, arg);
             }
-            // Caso nao seja encontrado na lista
-            printf("Client with pipeNoti %d not subscribed for key '%s'\n", pipeNoti, key);
-            return 1;
         }
-        keyNode = keyNode->next;
     }
-    // Caso a chave nao seja encontrada
-    printf("Key '%s' not found in the hash table\n", key);
-    return 1;
 }
 
+void iterate_pairs(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    iterate_part(ht, 0, 1, visit, arg);
+}
 
-void disconnect(HashTable *ht, int pipeNoti) {
-    // Percorre todas as posicoes da hash table
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
+void set_snapshot_expiry(HashTable *ht, uint64_t (*expiry_of)(const char *key, void *arg), void *arg) {
+    ht->snapshots.expiry_of = expiry_of;
+    ht->snapshots.expiry_arg = arg;
+}
 
-        // Percorre os nos da lista
-        while (keyNode != NULL) {
-            ClientNode *current_client = keyNode->clients;
-            ClientNode *prev_client = NULL;
-
-            // Percorre a lista de clientes 
-            while (current_client != NULL) {
-                // Se o pipeNoti do cliente atual corresponder ao da tabela
-                if (current_client->pipeNoti == pipeNoti) {
-                    // Remove o cliente atual da lista
-                    if (prev_client == NULL) {
-                        keyNode->clients = current_client->next;
-                    } else {
-                        prev_client->next = current_client->next;
-                    }
-
-                    // Liberta memoria alocada para o cliente removido
-                    free(current_client);
-
-                    // Atualiza o ponteiro para o proximo cliente
-                    if (prev_client == NULL) {
-                        current_client = keyNode->clients;
-                    } else {
-                        current_client = prev_client->next;
-                    }
-                    continue;
-                }
-                prev_client = current_client;
-                current_client = current_client->next;
+Snapshot *snapshot_reserve(HashTable *ht) {
+    return snapshot_acquire(&ht->snapshots);
+}
+
+void snapshot_cancel(HashTable *ht, Snapshot *snap) {
+    snapshot_release(&ht->snapshots, snap);
+}
+
+void snapshot_begin(HashTable *ht, Snapshot *snap) {
+    lock_table(ht, 1);
+    snapshot_start(&ht->snapshots, snap);
+    unlock_table(ht);
+}
+
+int snapshot_walk(HashTable *ht, Snapshot *snap,
+                  void (*visit)(const char *key, const char *value, uint64_t expiry, void *arg), void *arg) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        // Copy the stripe if no writer did, then write it out unlocked
+        uint64_t mask = (uint64_t)1 << s;
+        lock_mask(ht, mask, 1);
+        preserve_stripe(ht, s);
+        unlock_mask(ht, mask);
+        snapshot_visit(snap, s, visit, arg);
+    }
+
+    int failed = atomic_load(&snap->failed);
+    snapshot_release(&ht->snapshots, snap);
+    return failed;
+}
+
+void free_table(HashTable *ht) {
+    TableState *state = locked_state(ht);
+    for (int t = 0; t < 2 && state->table[t] != NULL; t++) {
+        Buckets *buckets = state->table[t];
+        for (size_t i = 0; i < buckets->size; i++) {
+            KeyNode *keyNode = load_node(&buckets->heads[i]);
+            while (keyNode != NULL) {
+                KeyNode *temp = keyNode;
+                keyNode = load_node(&keyNode->next);
+                free_clients(&temp->clients);
+                free_node(temp);
             }
+        }
+        free(buckets);
+    }
+    free(state);
+    ebr_drain();
+    snapshot_destroy(&ht->snapshots);
+    pthread_mutex_destroy(&ht->resize_lock);
+    for (int i = 0; i < NUM_STRIPES; i++) {
+        pthread_rwlock_destroy(&ht->stripes[i]);
+    }
+    free(ht);
+}
 
-            // Avanca para o proximo no
-            keyNode = keyNode->next;
+int subscribe(HashTable *ht, const char *key, int pipeNoti) {
+    // Procura o no da chave
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    KeyNode *keyNode = find_node(locked_state(ht), block, len, hash(key), NULL);
+    if (keyNode == NULL) {
+        // Caso a chave nao seja encontrada
+        printf("Key '%s' not found in the hash table\n", key);
+        return 1;
+    }
+    return add_client(&keyNode->clients, pipeNoti);
+}
+
+int unsubscribe(HashTable *ht, const char *key, int pipeNoti) {
+    // Procura o no da chave
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    KeyNode *keyNode = find_node(locked_state(ht), block, len, hash(key), NULL);
+    if (keyNode == NULL) {
+        // Caso a chave nao seja encontrada
+        printf("Key '%s' not found in the hash table\n", key);
+        return 1;
+    }
+    if (remove_client(&keyNode->clients, pipeNoti) != 0) {
+        // Caso nao seja encontrado na lista
+        printf("Client with pipeNoti %d not subscribed for key '%s'\n", pipeNoti, key);
+        return 1;
+    }
+    return 0;
+}
+
+void disconnect(HashTable *ht, int pipeNoti) {
+    // Percorre todas as posicoes das duas tabelas (a segunda so existe durante um resize)
+    TableState *state = locked_state(ht);
+    for (int t = 0; t < 2 && state->table[t] != NULL; t++) {
+        for (size_t i = 0; i < state->table[t]->size; i++) {
+            // Remove o cliente da lista de cada no
+            for (KeyNode *keyNode = load_node(&state->table[t]->heads[i]); keyNode != NULL;
+                 keyNode = load_node(&keyNode->next)) {
+                remove_client(&keyNode->clients, pipeNoti);
+            }
         }
     }
 }
 
 void clean_subscriptions(HashTable *ht) {
-
-    // Percorre todas as posicoes da tabela hash
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-
-        // Percorre os nos da lista
-        while (keyNode) {
-            ClientNode *clientNode = keyNode->clients;
-
-            // Percorre a lista de clientes 
-            while (clientNode) {
-                ClientNode *temp = clientNode;
-                // Avanca para o proximo cliente
-                clientNode = clientNode->next;
-                // Liberta memoria alocada para o cliente removido
-                free(temp);
+    // Percorre todas as posicoes das duas tabelas (a segunda so existe durante um resize)
+    TableState *state = locked_state(ht);
+    for (int t = 0; t < 2 && state->table[t] != NULL; t++) {
+        for (size_t i = 0; i < state->table[t]->size; i++) {
+            // Liberta todos os clientes de cada no
+            for (KeyNode *keyNode = load_node(&state->table[t]->heads[i]); keyNode != NULL;
+                 keyNode = load_node(&keyNode->next)) {
+                free_clients(&keyNode->clients);
             }
-            keyNode->clients = NULL;
-            // Avanca para o proximo no
-            keyNode = keyNode->next;
         }
     }
-}
\ No newline at end of file
+}
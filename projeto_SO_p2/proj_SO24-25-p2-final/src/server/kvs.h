@@ -1,45 +1,52 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+#define NUM_STRIPES 64          // lock stripes, must be a power of two
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "constants.h"
+
 typedef struct ClientNode {
     int pipeNoti;
     struct ClientNode *next;
 } ClientNode;
 
-typedef struct KeyNode {
-    char *key;
-    char *value;
-    ClientNode *clients;
-    struct KeyNode *next;
-} KeyNode;
+// The table layout depends on the engine the server was built with
+// (KVS_ENGINE=chain, the default, in kvs.c or KVS_ENGINE=robin in kvs_robin.c).
+// Both engines lock the table in NUM_STRIPES stripes, chosen by hash % NUM_STRIPES.
+typedef struct HashTable HashTable;
 
-typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t tablelock;
-} HashTable;
+// A point-in-time copy of a table (see kvs_common.h).
+typedef struct Snapshot Snapshot;
 
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-int hash(const char *key); 
+/// Hashes the whole key (FNV-1a followed by a final avalanche step).
+/// @param key Key to hash.
+/// @return 64 bit hash of the key.
+uint64_t hash(const char *key);
 
 // Writes a key value pair in the hash table.
 // @param ht The hash table.
 // @param key The key.
 // @param value The value.
-// @return 0 if successful.
+// @return 0 if the key already existed, 1 if it was added, -1 on failure.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-// Reads the value of a given key.
+// Reads the value of a given key into a buffer owned by the caller, so a read
+// allocates nothing. Unlike the other functions, does not need the key to be
+// locked: both engines read without taking any lock, copying the value
+// optimistically and retrying if a writer changed it meanwhile.
 // @param ht The hash table.
 // @param key The key.
-// return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+// @param value Buffer where the value is copied (truncated to size - 1 bytes).
+// @param size Size of the buffer.
+// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, char *value, size_t size);
 
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
@@ -47,6 +54,116 @@ char* read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Locks the stripes of the given keys, always in increasing stripe order, so a
+/// batch of keys can be locked atomically without deadlocking with another one.
+/// @param ht Hash table.
+/// @param num_keys Number of keys.
+/// @param keys Keys that will be accessed.
+/// @param write 1 to lock for writing, 0 to lock for reading.
+void lock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], int write);
+
+/// Unlocks the stripes locked by lock_keys.
+/// @param ht Hash table.
+/// @param num_keys Number of keys.
+/// @param keys Keys passed to lock_keys.
+void unlock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE]);
+
+/// Locks every stripe (in order), for operations that go through the whole table.
+/// @param ht Hash table.
+/// @param write 1 to lock for writing, 0 to lock for reading.
+void lock_table(HashTable *ht, int write);
+
+/// Unlocks the stripes locked by lock_table.
+/// @param ht Hash table.
+void unlock_table(HashTable *ht);
+
+/// Limits the memory used by the pairs. Each lock stripe gets an equal share
+/// of the budget; when a write takes a stripe over its share, pairs of that
+/// stripe are evicted following an approximate LRU (CLOCK) order and their
+/// subscribers get "(key,EVICTED)". Must be called before the table is shared.
+/// @param ht The hash table.
+/// @param max_bytes Budget in bytes, 0 for no limit.
+/// @param on_evict If not NULL, called with the key of every evicted pair,
+///                 while its stripe is locked.
+/// @param arg Passed to on_evict.
+void set_memory_limit(HashTable *ht, size_t max_bytes, void (*on_evict)(const char *key, void *arg), void *arg);
+
+/// Sizes an empty table for a number of pairs, so adding them does not make it
+/// grow on the way. Must be called before the table is shared; a table that is
+/// not empty is left as it is.
+/// @param ht The hash table.
+/// @param num_pairs Number of pairs about to be added.
+void reserve_pairs(HashTable *ht, size_t num_pairs);
+
+/// Calls visit for every pair stored in the table. The key and value are views
+/// into the table, only valid during the call, so nothing is copied or
+/// allocated; the table must be locked (lock_table). Only calls async signal
+/// safe code, so it can be used after fork.
+/// @param ht Hash table to iterate.
+/// @param visit Function called with the key and value of each pair.
+/// @param arg Argument passed to visit.
+void iterate_pairs(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Calls visit for the pairs in one of num_parts parts of the table, as
+/// iterate_pairs does. Every pair is in exactly one part, and the parts are
+/// about the same size, so they can be visited by several processes at once.
+/// @param ht Hash table to iterate.
+/// @param part The part, in [0, num_parts).
+/// @param num_parts Number of parts the table is split in.
+/// @param visit Function called with the key and value of each pair.
+/// @param arg Argument passed to visit.
+void iterate_part(HashTable *ht, size_t part, size_t num_parts,
+                  void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Calls visit for every pair the table held when the call started, without
+/// locking the table while visiting: writers keep running and only wait, once
+/// per snapshot, for the copy of the stripe they write to (see kvs_common.h).
+/// The table must not be locked by the caller.
+/// @param ht Hash table to iterate.
+/// @param visit Function called with the key and value of each pair.
+/// @param arg Argument passed to visit.
+/// @return 0 if every pair was visited, 1 if memory ran out for the copy.
+int snapshot_pairs(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Sets a function called for each pair copied by a snapshot, with the pair's
+/// stripe locked, whose result is passed along with the pair to snapshot_walk.
+/// Call before the table is used by several threads.
+/// @param ht The hash table.
+/// @param expiry_of Function returning, for instance, when the key expires.
+/// @param arg Argument passed to expiry_of.
+void set_snapshot_expiry(HashTable *ht, uint64_t (*expiry_of)(const char *key, void *arg), void *arg);
+
+/// Takes one of the table's snapshots, to be started with snapshot_begin.
+/// Several snapshots can be open at once, so this only waits when
+/// MAX_SNAPSHOTS of them (see kvs_common.h) are being walked.
+/// @param ht The hash table.
+/// @return The snapshot.
+Snapshot *snapshot_reserve(HashTable *ht);
+
+/// Gives back a snapshot taken with snapshot_reserve that was never started.
+/// @param ht The hash table.
+/// @param snap The snapshot.
+void snapshot_cancel(HashTable *ht, Snapshot *snap);
+
+/// Starts a snapshot, as snapshot_pairs does, to be walked later, possibly by
+/// another thread, with snapshot_walk. Only waits for the writers holding
+/// stripes. The table must not be locked by the caller.
+/// @param ht The hash table.
+/// @param snap Snapshot taken with snapshot_reserve.
+void snapshot_begin(HashTable *ht, Snapshot *snap);
+
+/// Calls visit for every pair the table held when snapshot_begin was called,
+/// and ends the snapshot. Writers keep running meanwhile, as with
+/// snapshot_pairs, and so do the other snapshots.
+/// @param ht The hash table.
+/// @param snap The snapshot.
+/// @param visit Function called with the key, the value and the result of the
+///              expiry_of given to set_snapshot_expiry (0 without one).
+/// @param arg Argument passed to visit.
+/// @return 0 if every pair was visited, 1 if memory ran out for the copy.
+int snapshot_walk(HashTable *ht, Snapshot *snap,
+                  void (*visit)(const char *key, const char *value, uint64_t expiry, void *arg), void *arg);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -0,0 +1,225 @@
+#include "kvs_common.h"
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+uint64_t hash(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a offset basis
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL; // FNV-1a prime
+    }
+    // FNV-1a leaves the low bits poorly mixed for keys sharing long prefixes,
+    // and the bucket index is taken from the low bits
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t stripe_mask(size_t num_keys, char keys[][MAX_STRING_SIZE]) {
+    _Static_assert(NUM_STRIPES <= 64, "stripe masks are 64 bits wide");
+    uint64_t mask = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        mask |= (uint64_t)1 << stripe_of(hash(keys[i]));
+    }
+    return mask;
+}
+
+void copy_value(char *dst, const char *src, size_t size) {
+    size_t len = strnlen(src, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+void snapshot_init(SnapshotSet *set) {
+    _Static_assert(MAX_SNAPSHOTS <= 32, "pending has a bit per snapshot");
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->idle, NULL);
+    set->taken = 0;
+    set->expiry_of = NULL;
+    set->expiry_arg = NULL;
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        set->pending[s] = 0;
+    }
+    for (unsigned int i = 0; i < MAX_SNAPSHOTS; i++) {
+        Snapshot *snap = &set->snapshots[i];
+        snap->bit = 1u << i;
+        for (size_t s = 0; s < NUM_STRIPES; s++) {
+            snap->pairs[s] = NULL;
+            snap->count[s] = 0;
+            snap->capacity[s] = 0;
+        }
+        atomic_init(&snap->failed, 0);
+    }
+}
+
+void snapshot_destroy(SnapshotSet *set) {
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        for (size_t s = 0; s < NUM_STRIPES; s++) {
+            free(set->snapshots[i].pairs[s]);
+        }
+    }
+    pthread_cond_destroy(&set->idle);
+    pthread_mutex_destroy(&set->lock);
+}
+
+Snapshot *snapshot_acquire(SnapshotSet *set) {
+    const unsigned int all = (unsigned int)((1ull << MAX_SNAPSHOTS) - 1);
+    pthread_mutex_lock(&set->lock);
+    while (set->taken == all) {
+        pthread_cond_wait(&set->idle, &set->lock);
+    }
+    Snapshot *snap = set->snapshots;
+    while (set->taken & snap->bit) {
+        snap++;
+    }
+    set->taken |= snap->bit;
+    pthread_mutex_unlock(&set->lock);
+    return snap;
+}
+
+void snapshot_release(SnapshotSet *set, Snapshot *snap) {
+    pthread_mutex_lock(&set->lock);
+    set->taken &= ~snap->bit;
+    pthread_cond_signal(&set->idle);
+    pthread_mutex_unlock(&set->lock);
+}
+
+void snapshot_start(SnapshotSet *set, Snapshot *snap) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        set->pending[s] |= snap->bit;
+    }
+    atomic_store(&snap->failed, 0);
+}
+
+// Appends a pair to the copy of a stripe.
+static void add_pair(Snapshot *snap, size_t stripe, const char *key, const char *value, uint64_t expiry) {
+    if (atomic_load_explicit(&snap->failed, memory_order_relaxed)) {
+        return; // the snapshot is incomplete anyway
+    }
+    if (snap->count[stripe] == snap->capacity[stripe]) {
+        size_t capacity = snap->capacity[stripe] ? snap->capacity[stripe] * 2 : 16;
+        SnapshotPair *pairs = realloc(snap->pairs[stripe], capacity * sizeof(SnapshotPair));
+        if (pairs == NULL) {
+            atomic_store(&snap->failed, 1);
+            return;
+        }
+        snap->pairs[stripe] = pairs;
+        snap->capacity[stripe] = capacity;
+    }
+    SnapshotPair *pair = &snap->pairs[stripe][snap->count[stripe]++];
+    memcpy(pair->key, key, MAX_STRING_SIZE);
+    memcpy(pair->value, value, MAX_STRING_SIZE);
+    pair->expiry = expiry;
+}
+
+void snapshot_add(SnapshotSet *set, unsigned int mask, size_t stripe, const char *key, const char *value) {
+    uint64_t expiry = set->expiry_of != NULL ? set->expiry_of(key, set->expiry_arg) : 0;
+    for (unsigned int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (mask & (1u << i)) {
+            add_pair(&set->snapshots[i], stripe, key, value, expiry);
+        }
+    }
+}
+
+void snapshot_visit(Snapshot *snap, size_t stripe,
+                    void (*visit)(const char *key, const char *value, uint64_t expiry, void *arg), void *arg) {
+    for (size_t i = 0; i < snap->count[stripe]; i++) {
+        SnapshotPair *pair = &snap->pairs[stripe][i];
+        visit(pair->key, pair->value, pair->expiry, arg);
+    }
+    free(snap->pairs[stripe]);
+    snap->pairs[stripe] = NULL;
+    snap->count[stripe] = 0;
+    snap->capacity[stripe] = 0;
+}
+
+// Visit function of snapshot_pairs, for snapshot_walk.
+typedef struct PairVisit {
+    void (*visit)(const char *key, const char *value, void *arg);
+    void *arg;
+} PairVisit;
+
+static void visit_pair(const char *key, const char *value, uint64_t expiry, void *arg) {
+    (void)expiry;
+    PairVisit *pair_visit = arg;
+    pair_visit->visit(key, value, pair_visit->arg);
+}
+
+int snapshot_pairs(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    PairVisit pair_visit = {visit, arg};
+    Snapshot *snap = snapshot_reserve(ht);
+    snapshot_begin(ht, snap);
+    return snapshot_walk(ht, snap, visit_pair, &pair_visit);
+}
+
+void notify_clients(ClientNode *clients, const char *key, const char *value) {
+    char message[82];
+    char formatted_key[40];
+    char formatted_value[40];
+
+    strncpy(formatted_key, key, 39);
+    formatted_key[39] = '\0';
+    strncpy(formatted_value, value, 39);
+    formatted_value[39] = '\0';
+
+    snprintf(message, sizeof(message), "(%s,%s)", formatted_key, formatted_value);
+
+    for (ClientNode *current_client = clients; current_client != NULL;
+         current_client = current_client->next) {
+        if (write(current_client->pipeNoti, message, strlen(message)) == -1) {
+            perror("Failed to write notification to pipe");
+        }
+    }
+}
+
+int add_client(ClientNode **clients, int pipeNoti) {
+    // Percorre a lista de clientes
+    for (ClientNode *current_client = *clients; current_client != NULL;
+         current_client = current_client->next) {
+        // Caso o cliente ja esteja subscrito
+        if (current_client->pipeNoti == pipeNoti) {
+            return 0;
+        }
+    }
+    // Caso nao esteja inscrito
+    ClientNode *new_client = slab_alloc(sizeof(ClientNode));
+    // Se falhar a alocacao de espaco
+    if (new_client == NULL) {
+        perror("Failed to allocate memory for new client");
+        return 1;
+    }
+    // Armazenar os dados do cliente
+    new_client->pipeNoti = pipeNoti;
+    new_client->next = *clients;
+    *clients = new_client;
+    return 0;
+}
+
+int remove_client(ClientNode **clients, int pipeNoti) {
+    // Percorre a lista de clientes a partir do ponteiro que referencia cada no
+    for (ClientNode **link = clients; *link != NULL; link = &(*link)->next) {
+        if ((*link)->pipeNoti == pipeNoti) {
+            ClientNode *current_client = *link;
+            *link = current_client->next;
+            // Liberta memoria alocada para o cliente removido
+            slab_free(current_client, sizeof(ClientNode));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void free_clients(ClientNode **clients) {
+    while (*clients != NULL) {
+        ClientNode *temp = *clients;
+        // Avanca para o proximo cliente
+        *clients = temp->next;
+        // Liberta memoria alocada para o cliente removido
+        slab_free(temp, sizeof(ClientNode));
+    }
+}
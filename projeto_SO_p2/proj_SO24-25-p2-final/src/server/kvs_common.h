@@ -0,0 +1,209 @@
+#ifndef KVS_COMMON_H
+#define KVS_COMMON_H
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+// Helpers shared by the table engines (kvs.c and kvs_robin.c).
+
+/// Returns the lock stripe of a hash.
+/// @param h Hash of the key.
+/// @return Stripe index, in [0, NUM_STRIPES).
+static inline size_t stripe_of(uint64_t h) {
+    return h & (NUM_STRIPES - 1);
+}
+
+// Values (and, in kvs_robin.c, keys) are stored as blocks of MAX_STRING_SIZE
+// bytes, padded with zeros, made of words that lock free readers load while a
+// writer may be storing them. Each block is guarded by a sequence counter that
+// is odd while the block is being written: a reader copies the block and
+// retries if the counter changed meanwhile, so reads never write to shared
+// memory.
+#define BLOCK_WORDS (MAX_STRING_SIZE / sizeof(uint64_t))
+_Static_assert(MAX_STRING_SIZE % sizeof(uint64_t) == 0, "blocks are stored as whole words");
+
+/// Copies a string into a block, padding it with zeros and truncating it to
+/// MAX_STRING_SIZE - 1 characters.
+/// @param block Destination block.
+/// @param str The string.
+static inline void string_block(char block[MAX_STRING_SIZE], const char *str) {
+    strncpy(block, str, MAX_STRING_SIZE - 1);
+    block[MAX_STRING_SIZE - 1] = '\0';
+}
+
+/// Stores a block in shared words. Only for words no reader can see yet, or
+/// inside a section where their sequence counter is odd.
+static inline void store_block(_Atomic(uint64_t) *dst, const char *src) {
+    for (size_t i = 0; i < BLOCK_WORDS; i++) {
+        uint64_t word;
+        memcpy(&word, src + i * sizeof(word), sizeof(word));
+        atomic_store_explicit(&dst[i], word, memory_order_relaxed);
+    }
+}
+
+/// Loads a block from shared words, with no consistency check.
+static inline void load_block(char *dst, _Atomic(uint64_t) *src) {
+    for (size_t i = 0; i < BLOCK_WORDS; i++) {
+        uint64_t word = atomic_load_explicit(&src[i], memory_order_relaxed);
+        memcpy(dst + i * sizeof(word), &word, sizeof(word));
+    }
+}
+
+/// Starts a write section of a sequence counter (makes it odd). Only one
+/// writer at a time: callers hold the stripe lock.
+static inline void seq_write_begin(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/// Ends a write section started by seq_write_begin.
+static inline void seq_write_end(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/// Overwrites a block guarded by a sequence counter.
+/// @param seq The counter.
+/// @param dst The shared block.
+/// @param src New contents (MAX_STRING_SIZE bytes).
+static inline void seq_store_block(atomic_uint *seq, _Atomic(uint64_t) *dst, const char *src) {
+    seq_write_begin(seq);
+    store_block(dst, src);
+    seq_write_end(seq);
+}
+
+/// Copies a block guarded by a sequence counter, retrying until the copy was
+/// not overlapped by a writer.
+/// @param seq The counter.
+/// @param src The shared block.
+/// @param dst Where to copy it (MAX_STRING_SIZE bytes).
+static inline void seq_load_block(atomic_uint *seq, _Atomic(uint64_t) *src, char *dst) {
+    while (1) {
+        unsigned int before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield(); // the writer holds the stripe lock and may be descheduled
+            continue;
+        }
+        load_block(dst, src);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+// Point-in-time copies of the table, taken one stripe at a time for
+// snapshot_begin and snapshot_walk (see kvs.h). Starting a snapshot marks every
+// stripe pending for it, and a pending stripe is copied by whoever next locks
+// it for writing: a writer, right before changing it (copy on write at stripe
+// granularity), or the iterator when it gets there. Each stripe is thus copied
+// as it was when the snapshot started, a writer waits at most for the copy of
+// its own stripe and a copy is only kept until the iterator writes it out.
+//
+// Up to MAX_SNAPSHOTS snapshots are open at once (a SHOW and the BACKUPs the
+// backup thread has yet to write, say), so one being walked slowly does not
+// hold up the others. pending has a bit per snapshot, and a stripe pending
+// for several of them is copied once for all. pending and the copies of a
+// stripe are protected by its lock. Snapshots are started and walked by
+// different threads, so they are held with flags rather than by locking a
+// mutex.
+#define MAX_SNAPSHOTS 8
+
+typedef struct SnapshotPair {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    uint64_t expiry;                   // from expiry_of, 0 without it
+} SnapshotPair;
+
+struct Snapshot {
+    unsigned int bit;                  // of the snapshot in pending
+    SnapshotPair *pairs[NUM_STRIPES];
+    size_t count[NUM_STRIPES];
+    size_t capacity[NUM_STRIPES];
+    atomic_int failed;                 // a copy ran out of memory
+};
+
+typedef struct SnapshotSet {
+    pthread_mutex_t lock;              // protects taken
+    pthread_cond_t idle;               // signalled when a snapshot is released
+    unsigned int taken;                // bit i set while snapshots[i] is in use
+    uint64_t (*expiry_of)(const char *key, void *arg);  // see set_snapshot_expiry
+    void *expiry_arg;
+    unsigned int pending[NUM_STRIPES]; // snapshots the stripe was not copied for yet
+    Snapshot snapshots[MAX_SNAPSHOTS];
+} SnapshotSet;
+
+/// Initializes a set of idle snapshots.
+void snapshot_init(SnapshotSet *set);
+
+/// Frees the memory of a set of snapshots.
+void snapshot_destroy(SnapshotSet *set);
+
+/// Waits until fewer than MAX_SNAPSHOTS snapshots are in use and takes one.
+/// @return The snapshot.
+Snapshot *snapshot_acquire(SnapshotSet *set);
+
+/// Gives a snapshot back once it was walked (or never started).
+void snapshot_release(SnapshotSet *set, Snapshot *snap);
+
+/// Marks every stripe pending for a snapshot. Must be called with every stripe
+/// locked for writing, so no batch of writes is halfway done.
+void snapshot_start(SnapshotSet *set, Snapshot *snap);
+
+/// Adds a pair to the copies of a stripe (with the stripe locked). Nothing
+/// more is added to a copy once it ran out of memory (failed is set).
+/// @param set The snapshots.
+/// @param mask Snapshots to add the pair to, as in pending.
+/// @param stripe Stripe of the pair.
+/// @param key The key.
+/// @param value The value.
+void snapshot_add(SnapshotSet *set, unsigned int mask, size_t stripe, const char *key, const char *value);
+
+/// Calls visit for every pair copied from a stripe, then frees the copy. Needs
+/// no lock once the stripe is no longer pending.
+/// @param snap The snapshot.
+/// @param stripe The stripe.
+/// @param visit Function called with the key, value and expiry of each pair.
+/// @param arg Argument passed to visit.
+void snapshot_visit(Snapshot *snap, size_t stripe,
+                    void (*visit)(const char *key, const char *value, uint64_t expiry, void *arg), void *arg);
+
+/// Builds the set of stripes used by the given keys, one bit per stripe.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @return Bit mask with bit i set if stripe i is used.
+uint64_t stripe_mask(size_t num_keys, char keys[][MAX_STRING_SIZE]);
+
+/// Copies a string into a buffer, truncating it to size - 1 bytes.
+/// @param dst Destination buffer.
+/// @param src String to copy.
+/// @param size Size of dst (must be at least 1).
+void copy_value(char *dst, const char *src, size_t size);
+
+/// Sends "(key,value)" to every subscriber in the list.
+/// @param clients Subscribers of the key.
+/// @param key The key.
+/// @param value New value, or "DELETED".
+void notify_clients(ClientNode *clients, const char *key, const char *value);
+
+/// Adds a subscriber to the list, unless it is already there.
+/// @param clients Pointer to the head of the list.
+/// @param pipeNoti fd do fifo de notificacoes do cliente.
+/// @return 0 if the client is subscribed, 1 if memory could not be allocated.
+int add_client(ClientNode **clients, int pipeNoti);
+
+/// Removes a subscriber from the list.
+/// @param clients Pointer to the head of the list.
+/// @param pipeNoti fd do fifo de notificacoes do cliente.
+/// @return 0 if the client was removed, 1 if it was not subscribed.
+int remove_client(ClientNode **clients, int pipeNoti);
+
+/// Frees every node of the list and leaves it empty.
+/// @param clients Pointer to the head of the list.
+void free_clients(ClientNode **clients);
+
+#endif  // KVS_COMMON_H
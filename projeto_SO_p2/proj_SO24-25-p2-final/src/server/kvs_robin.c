@@ -0,0 +1,602 @@
+#include "kvs.h"
+#include "ebr.h"
+#include "kvs_common.h"
+#include "keycmp.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SHARD_CAPACITY 16 // slots per shard, must be a power of two
+#define MAX_LOAD_PERCENT 85       // a shard doubles when it gets this full
+
+// Open addressing engine (built with KVS_ENGINE=robin).
+//
+// Keys and values are at most MAX_STRING_SIZE bytes, so they are stored inline
+// in the slots together with the hash of the key: a lookup walks contiguous
+// memory and only compares the key bytes of slots whose hash and length match
+// (as zero padded blocks, with key_equal), and writing a new key does not
+// allocate anything.
+//
+// The table is split in NUM_STRIPES independent Robin Hood tables (shards), one
+// per lock stripe, so displacing entries on insert or shifting them back on
+// delete never crosses into memory protected by another stripe. The low bits of
+// the hash choose the shard and the remaining bits the home slot. A shard that
+// gets too full is rebuilt with twice the slots, which only stalls the writers
+// of that shard.
+//
+// read_pair takes no lock. Every slot field a reader looks at is stored with
+// atomic stores, and two sequence counters (see kvs_common.h) tell a reader
+// that its copy may be torn: the seq of a shard changes when entries are
+// inserted, moved or removed, and the seq of a slot when its value is
+// overwritten, so readers of a hot key only retry on writes to that key. Slot
+// arrays replaced by a resize are freed through ebr_retire.
+//
+// With a memory limit, each shard may use an equal share of it. Since pairs
+// live inside the slot array, a shard that would have to grow past its share
+// evicts a pair instead, chosen by a CLOCK hand over its slots: referenced is
+// set when the pair is read or overwritten (not when it is added) and cleared
+// when the hand passes, and the first pair found without it is evicted.
+typedef struct Slot {
+    _Atomic(uint64_t) hash;    // hash of the key
+    _Atomic(uint32_t) dist;    // distance to the home slot + 1, 0 if the slot is empty
+    _Atomic(uint32_t) key_len;
+    atomic_uint seq;           // odd while the value is being overwritten
+    atomic_uchar referenced;   // CLOCK bit
+    _Atomic(uint64_t) key[BLOCK_WORDS];   // zero padded block (see keycmp.h)
+    _Atomic(uint64_t) value[BLOCK_WORDS];
+    ClientNode *clients;       // only used with the stripe locked
+} Slot;
+
+// Plain copy of the contents of a slot, carried around while inserting.
+typedef struct Entry {
+    uint64_t hash;
+    uint32_t dist;
+    uint32_t key_len;
+    unsigned char referenced;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    ClientNode *clients;
+} Entry;
+
+typedef struct SlotArray {
+    size_t capacity;
+    Slot slots[];
+} SlotArray;
+
+typedef struct Shard {
+    _Atomic(SlotArray *) array;
+    atomic_uint seq;           // odd while entries are being inserted, moved or removed
+    size_t count;
+    size_t clock_hand;         // next slot to sweep when evicting
+} Shard;
+
+struct HashTable {
+    Shard shards[NUM_STRIPES];
+    size_t shard_budget;       // bytes per shard, 0 for no limit
+    void (*on_evict)(const char *key, void *arg);
+    void *evict_arg;
+    SnapshotSet snapshots;     // used by snapshot_begin and snapshot_walk
+    pthread_rwlock_t stripes[NUM_STRIPES];
+};
+
+static SlotArray *alloc_array(size_t capacity) {
+    SlotArray *array = calloc(1, sizeof(SlotArray) + capacity * sizeof(Slot));
+    if (array != NULL) {
+        array->capacity = capacity;
+    }
+    return array;
+}
+
+// Array seen by a thread holding the stripe lock, which cannot change meanwhile.
+static SlotArray *locked_array(Shard *shard) {
+    return atomic_load_explicit(&shard->array, memory_order_relaxed);
+}
+
+static uint32_t slot_dist(Slot *slot) {
+    return atomic_load_explicit(&slot->dist, memory_order_relaxed);
+}
+
+static void load_entry(Slot *slot, Entry *entry) {
+    entry->hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+    entry->dist = slot_dist(slot);
+    entry->key_len = atomic_load_explicit(&slot->key_len, memory_order_relaxed);
+    entry->referenced = atomic_load_explicit(&slot->referenced, memory_order_relaxed);
+    load_block(entry->key, slot->key);
+    load_block(entry->value, slot->value);
+    entry->clients = slot->clients;
+}
+
+// Must be called with the stripe locked, inside a write section of the shard
+// seq (or on an array no reader can see yet).
+static void store_entry(Slot *slot, const Entry *entry) {
+    atomic_store_explicit(&slot->hash, entry->hash, memory_order_relaxed);
+    atomic_store_explicit(&slot->dist, entry->dist, memory_order_relaxed);
+    atomic_store_explicit(&slot->key_len, entry->key_len, memory_order_relaxed);
+    atomic_store_explicit(&slot->referenced, entry->referenced, memory_order_relaxed);
+    store_block(slot->key, entry->key);
+    store_block(slot->value, entry->value);
+    slot->clients = entry->clients;
+}
+
+// Sets the CLOCK bit of a slot, without writing to it if it is already set.
+static void mark_referenced(Slot *slot) {
+    if (!atomic_load_explicit(&slot->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&slot->referenced, 1, memory_order_relaxed);
+    }
+}
+
+// Copies the pairs of a shard for the snapshots being taken that do not have
+// them yet. Must be called with the stripe locked for writing, before any
+// of its pairs changes.
+static void preserve_stripe(HashTable *ht, size_t stripe) {
+    unsigned int pending = ht->snapshots.pending[stripe];
+    if (!pending) {
+        return;
+    }
+    ht->snapshots.pending[stripe] = 0;
+    SlotArray *array = locked_array(&ht->shards[stripe]);
+    for (size_t i = 0; i < array->capacity; i++) {
+        if (slot_dist(&array->slots[i]) != 0) {
+            char key[MAX_STRING_SIZE];
+            char value[MAX_STRING_SIZE];
+            load_block(key, array->slots[i].key);
+            load_block(value, array->slots[i].value);
+            snapshot_add(&ht->snapshots, pending, stripe, key, value);
+        }
+    }
+}
+
+static size_t home_slot(size_t capacity, uint64_t h) {
+    // the low bits already chose the shard
+    return (size_t)(h / NUM_STRIPES) & (capacity - 1);
+}
+
+static Shard *shard_of(HashTable *ht, uint64_t h) {
+    return &ht->shards[stripe_of(h)];
+}
+
+struct HashTable* create_hash_table() {
+    HashTable *ht = malloc(sizeof(HashTable));
+    if (!ht) return NULL;
+    keycmp_init();
+    ht->shard_budget = 0;
+    ht->on_evict = NULL;
+    ht->evict_arg = NULL;
+    snapshot_init(&ht->snapshots);
+    for (int i = 0; i < NUM_STRIPES; i++) {
+        SlotArray *array = alloc_array(INITIAL_SHARD_CAPACITY);
+        if (array == NULL) {
+            while (i-- > 0) {
+                free(locked_array(&ht->shards[i]));
+            }
+            free(ht);
+            return NULL;
+        }
+        atomic_init(&ht->shards[i].array, array);
+        atomic_init(&ht->shards[i].seq, 0);
+        ht->shards[i].count = 0;
+        ht->shards[i].clock_hand = 0;
+        pthread_rwlock_init(&ht->stripes[i], NULL);
+    }
+    return ht;
+}
+
+// Finds the slot of a key. Stops at the first slot whose entry is closer to its
+// home than the key would be, since Robin Hood insertion guarantees the key
+// cannot be further ahead. Safe without locks inside ebr_enter(), but the
+// result is then only valid if the shard seq did not change meanwhile.
+// @param array Slots of the shard.
+// @param block The key, as built by key_block.
+// @param len Length of the key.
+// @param h Hash of the key.
+// @return The slot if found, NULL otherwise.
+static Slot *find_slot(SlotArray *array, const char *block, size_t len, uint64_t h) {
+    size_t mask = array->capacity - 1;
+    size_t i = home_slot(array->capacity, h);
+    // A reader racing with a writer may see any distances, so never probe
+    // more than the whole array
+    for (uint32_t dist = 1; dist <= array->capacity; dist++) {
+        Slot *slot = &array->slots[i];
+        if (slot_dist(slot) < dist) {
+            return NULL;
+        }
+        if (atomic_load_explicit(&slot->hash, memory_order_relaxed) == h &&
+            atomic_load_explicit(&slot->key_len, memory_order_relaxed) == len) {
+            char key[MAX_STRING_SIZE];
+            load_block(key, slot->key);
+            if (key_equal(key, block)) {
+                return slot;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Inserts an entry that is not in the shard, taking the slot of any entry that
+// is closer to its home than the one being inserted and carrying that one on.
+static void insert_slot(SlotArray *array, Entry entry) {
+    size_t mask = array->capacity - 1;
+    size_t i = home_slot(array->capacity, entry.hash);
+    entry.dist = 1;
+    while (1) {
+        Slot *slot = &array->slots[i];
+        uint32_t dist = slot_dist(slot);
+        if (dist == 0) {
+            store_entry(slot, &entry);
+            return;
+        }
+        if (dist < entry.dist) {
+            Entry displaced;
+            load_entry(slot, &displaced);
+            store_entry(slot, &entry);
+            entry = displaced;
+        }
+        i = (i + 1) & mask;
+        entry.dist++;
+    }
+}
+
+// Rebuilds the shard with twice the slots, reusing the cached hashes. Readers
+// may still be walking the old array, which is left untouched until they are
+// done with it.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int grow_shard(Shard *shard) {
+    SlotArray *old = locked_array(shard);
+    SlotArray *bigger = alloc_array(old->capacity * 2);
+    if (bigger == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < old->capacity; i++) {
+        if (slot_dist(&old->slots[i]) != 0) {
+            Entry entry;
+            load_entry(&old->slots[i], &entry);
+            insert_slot(bigger, entry);
+        }
+    }
+    atomic_store_explicit(&shard->array, bigger, memory_order_release);
+    ebr_retire(old, free);
+    return 0;
+}
+
+// Removes the pair in a slot, shifting the following entries back one slot
+// until one is already at home. Must be called with the stripe locked.
+// @param reason Value sent to the subscribers ("DELETED" or "EVICTED").
+static void remove_slot(Shard *shard, size_t i, const char *reason) {
+    SlotArray *array = locked_array(shard);
+    Slot *slot = &array->slots[i];
+    char key[MAX_STRING_SIZE];
+    load_block(key, slot->key);
+    notify_clients(slot->clients, key, reason);
+    free_clients(&slot->clients);
+
+    seq_write_begin(&shard->seq);
+    size_t mask = array->capacity - 1;
+    while (1) {
+        size_t next = (i + 1) & mask;
+        if (slot_dist(&array->slots[next]) <= 1) {
+            atomic_store_explicit(&array->slots[i].dist, 0, memory_order_relaxed);
+            array->slots[i].clients = NULL;
+            break;
+        }
+        Entry moved;
+        load_entry(&array->slots[next], &moved);
+        moved.dist--;
+        store_entry(&array->slots[i], &moved);
+        i = next;
+    }
+    seq_write_end(&shard->seq);
+    shard->count--;
+}
+
+// Evicts one pair of the shard, giving pairs whose CLOCK bit is set a second
+// chance. Must be called with the stripe locked.
+// @return 0 if a pair was evicted, 1 if the shard is empty.
+static int evict_one(HashTable *ht, Shard *shard) {
+    SlotArray *array = locked_array(shard);
+    size_t mask = array->capacity - 1;
+    // Two full sweeps clear every bit, so they always find a victim
+    for (size_t visits = 2 * array->capacity; visits > 0; visits--) {
+        size_t i = shard->clock_hand++ & mask;
+        Slot *slot = &array->slots[i];
+        if (slot_dist(slot) == 0) {
+            continue;
+        }
+        if (atomic_load_explicit(&slot->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&slot->referenced, 0, memory_order_relaxed);
+            continue;
+        }
+        if (ht->on_evict != NULL) {
+            char key[MAX_STRING_SIZE];
+            load_block(key, slot->key);
+            ht->on_evict(key, ht->evict_arg);
+        }
+        remove_slot(shard, i, "EVICTED");
+        return 0;
+    }
+    return 1;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    Entry entry;
+    size_t len = key_block(entry.key, key);
+    string_block(entry.value, value);
+    uint64_t h = hash(key);
+    Shard *shard = shard_of(ht, h);
+    preserve_stripe(ht, stripe_of(h));
+
+    Slot *slot = find_slot(locked_array(shard), entry.key, len, h);
+    if (slot != NULL) {
+        // overwrite value
+        seq_store_block(&slot->seq, slot->value, entry.value);
+        mark_referenced(slot);
+        notify_clients(slot->clients, key, value);
+        return 0;
+    }
+
+    size_t capacity = locked_array(shard)->capacity;
+    if ((shard->count + 1) * 100 > capacity * MAX_LOAD_PERCENT) {
+        if (ht->shard_budget != 0 && 2 * capacity * sizeof(Slot) > ht->shard_budget) {
+            if (evict_one(ht, shard) != 0) {
+                return -1;
+            }
+        } else if (grow_shard(shard) != 0) {
+            return -1;
+        }
+    }
+
+    entry.hash = h;
+    entry.key_len = (uint32_t)len;
+    entry.referenced = 0;
+    entry.clients = NULL;
+    seq_write_begin(&shard->seq);
+    insert_slot(locked_array(shard), entry);
+    seq_write_end(&shard->seq);
+    shard->count++;
+    return 1;
+}
+
+int read_pair(HashTable *ht, const char *key, char *value, size_t size) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    Shard *shard = shard_of(ht, h);
+    int result;
+
+    ebr_enter();
+    while (1) {
+        unsigned int before = atomic_load_explicit(&shard->seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield(); // a writer is moving entries of this shard
+            continue;
+        }
+        Slot *slot = find_slot(atomic_load_explicit(&shard->array, memory_order_acquire), block, len, h);
+        char copy[MAX_STRING_SIZE];
+        if (slot != NULL) {
+            seq_load_block(&slot->seq, slot->value, copy);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shard->seq, memory_order_relaxed) == before) {
+            if (slot != NULL) {
+                copy_value(value, copy, size);
+                mark_referenced(slot);
+            }
+            result = slot == NULL;
+            break;
+        }
+    }
+    ebr_exit();
+    return result;
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    Shard *shard = shard_of(ht, h);
+    preserve_stripe(ht, stripe_of(h));
+    SlotArray *array = locked_array(shard);
+    Slot *slot = find_slot(array, block, len, h);
+    if (slot == NULL) {
+        return 1;
+    }
+
+    remove_slot(shard, (size_t)(slot - array->slots), "DELETED");
+    return 0;
+}
+
+static void lock_mask(HashTable *ht, uint64_t mask, int write) {
+    for (size_t i = 0; i < NUM_STRIPES; i++) {
+        if (mask & ((uint64_t)1 << i)) {
+            if (write) {
+                pthread_rwlock_wrlock(&ht->stripes[i]);
+            } else {
+                pthread_rwlock_rdlock(&ht->stripes[i]);
+            }
+        }
+    }
+}
+
+static void unlock_mask(HashTable *ht, uint64_t mask) {
+    for (size_t i = NUM_STRIPES; i-- > 0;) {
+        if (mask & ((uint64_t)1 << i)) {
+            pthread_rwlock_unlock(&ht->stripes[i]);
+        }
+    }
+}
+
+void lock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], int write) {
+    lock_mask(ht, stripe_mask(num_keys, keys), write);
+}
+
+void unlock_keys(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE]) {
+    unlock_mask(ht, stripe_mask(num_keys, keys));
+}
+
+void lock_table(HashTable *ht, int write) {
+    lock_mask(ht, ~(uint64_t)0 >> (64 - NUM_STRIPES), write);
+}
+
+void unlock_table(HashTable *ht) {
+    unlock_mask(ht, ~(uint64_t)0 >> (64 - NUM_STRIPES));
+}
+
+void set_memory_limit(HashTable *ht, size_t max_bytes, void (*on_evict)(const char *key, void *arg), void *arg) {
+    // Slot arrays never shrink, so a budget below the initial arrays only
+    // stops them from growing
+    ht->shard_budget = max_bytes / NUM_STRIPES;
+    if (max_bytes != 0 && ht->shard_budget == 0) {
+        ht->shard_budget = 1;
+    }
+    ht->on_evict = on_evict;
+    ht->evict_arg = arg;
+}
+
+void reserve_pairs(HashTable *ht, size_t num_pairs) {
+    // Keys are spread evenly by the hash, with some room for shards that get
+    // more than their share; those grow as usual
+    size_t per_shard = num_pairs / NUM_STRIPES;
+    per_shard += per_shard / 8 + 1;
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        Shard *shard = &ht->shards[s];
+        SlotArray *array = locked_array(shard);
+        size_t capacity = array->capacity;
+        while (per_shard * 100 > capacity * MAX_LOAD_PERCENT &&
+               (ht->shard_budget == 0 || 2 * capacity * sizeof(Slot) <= ht->shard_budget)) {
+            capacity *= 2;
+        }
+        if (shard->count != 0 || capacity == array->capacity) {
+            continue;
+        }
+        SlotArray *bigger = alloc_array(capacity);
+        if (bigger == NULL) {
+            return;
+        }
+        atomic_store_explicit(&shard->array, bigger, memory_order_relaxed);
+        free(array);
+    }
+}
+
+void iterate_part(HashTable *ht, size_t part, size_t num_parts,
+                  void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        SlotArray *array = locked_array(&ht->shards[s]);
+        size_t end = array->capacity * (part + 1) / num_parts;
+        for (size_t i = array->capacity * part / num_parts; i < end; i++) {
+            if (slot_dist(&array->slots[i]) != 0) {
+                // no writer can change them meanwhile
+                char key[MAX_STRING_SIZE];
+                char value[MAX_STRING_SIZE];
+                load_block(key, array->slots[i].key);
+                load_block(value, array->slots[i].value);
+                visit(key, value, arg);
+            }
+        }
+    }
+}
+
+void iterate_pairs(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    iterate_part(ht, 0, 1, visit, arg);
+}
+
+void set_snapshot_expiry(HashTable *ht, uint64_t (*expiry_of)(const char *key, void *arg), void *arg) {
+    ht->snapshots.expiry_of = expiry_of;
+    ht->snapshots.expiry_arg = arg;
+}
+
+Snapshot *snapshot_reserve(HashTable *ht) {
+    return snapshot_acquire(&ht->snapshots);
+}
+
+void snapshot_cancel(HashTable *ht, Snapshot *snap) {
+    snapshot_release(&ht->snapshots, snap);
+}
+
+void snapshot_begin(HashTable *ht, Snapshot *snap) {
+    lock_table(ht, 1);
+    snapshot_start(&ht->snapshots, snap);
+    unlock_table(ht);
+}
+
+int snapshot_walk(HashTable *ht, Snapshot *snap,
+                  void (*visit)(const char *key, const char *value, uint64_t expiry, void *arg), void *arg) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        // Copy the shard if no writer did, then write it out unlocked
+        uint64_t mask = (uint64_t)1 << s;
+        lock_mask(ht, mask, 1);
+        preserve_stripe(ht, s);
+        unlock_mask(ht, mask);
+        snapshot_visit(snap, s, visit, arg);
+    }
+
+    int failed = atomic_load(&snap->failed);
+    snapshot_release(&ht->snapshots, snap);
+    return failed;
+}
+
+void free_table(HashTable *ht) {
+    clean_subscriptions(ht);
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        free(locked_array(&ht->shards[s]));
+        pthread_rwlock_destroy(&ht->stripes[s]);
+    }
+    ebr_drain();
+    snapshot_destroy(&ht->snapshots);
+    free(ht);
+}
+
+int subscribe(HashTable *ht, const char *key, int pipeNoti) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    Slot *slot = find_slot(locked_array(shard_of(ht, h)), block, len, h);
+    if (slot == NULL) {
+        // Caso a chave nao seja encontrada
+        printf("Key '%s' not found in the hash table\n", key);
+        return 1;
+    }
+    return add_client(&slot->clients, pipeNoti);
+}
+
+int unsubscribe(HashTable *ht, const char *key, int pipeNoti) {
+    char block[MAX_STRING_SIZE];
+    size_t len = key_block(block, key);
+    uint64_t h = hash(key);
+    Slot *slot = find_slot(locked_array(shard_of(ht, h)), block, len, h);
+    if (slot == NULL) {
+        // Caso a chave nao seja encontrada
+        printf("Key '%s' not found in the hash table\n", key);
+        return 1;
+    }
+    if (remove_client(&slot->clients, pipeNoti) != 0) {
+        // Caso nao seja encontrado na lista
+        printf("Client with pipeNoti %d not subscribed for key '%s'\n", pipeNoti, key);
+        return 1;
+    }
+    return 0;
+}
+
+void disconnect(HashTable *ht, int pipeNoti) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        SlotArray *array = locked_array(&ht->shards[s]);
+        for (size_t i = 0; i < array->capacity; i++) {
+            if (slot_dist(&array->slots[i]) != 0) {
+                remove_client(&array->slots[i].clients, pipeNoti);
+            }
+        }
+    }
+}
+
+void clean_subscriptions(HashTable *ht) {
+    for (size_t s = 0; s < NUM_STRIPES; s++) {
+        SlotArray *array = locked_array(&ht->shards[s]);
+        for (size_t i = 0; i < array->capacity; i++) {
+            if (slot_dist(&array->slots[i]) != 0) {
+                free_clients(&array->slots[i].clients);
+            }
+        }
+    }
+}
@@ -0,0 +1,159 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define RUN_MASK 15     // literal or match length that needs more length bytes
+#define SKIP_SHIFT 6    // the search speeds up by one byte per 64 bytes without a match
+#define LAST_MATCH 5    // matches never start in the last bytes, left as literals
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static size_t hash4(uint32_t value) {
+  return (size_t)((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+// Writes the part of a length past RUN_MASK.
+// @return Position after it, 0 if it does not fit.
+static size_t put_length(unsigned char *dst, size_t pos, size_t capacity, size_t length) {
+  for (; length >= 255; length -= 255) {
+    if (pos == capacity) {
+      return 0;
+    }
+    dst[pos++] = 255;
+  }
+  if (pos == capacity) {
+    return 0;
+  }
+  dst[pos++] = (unsigned char)length;
+  return pos;
+}
+
+// Writes a sequence: the literals, then the match unless match_length is 0.
+// @return Position after it, 0 if it does not fit.
+static size_t put_sequence(unsigned char *dst, size_t pos, size_t capacity,
+                           const unsigned char *literals, size_t num_literals, size_t offset,
+                           size_t match_length) {
+  if (pos == capacity) {
+    return 0;
+  }
+  size_t token = pos++;
+  dst[token] = (unsigned char)((num_literals < RUN_MASK ? num_literals : RUN_MASK) << 4);
+  if (num_literals >= RUN_MASK && (pos = put_length(dst, pos, capacity, num_literals - RUN_MASK)) == 0) {
+    return 0;
+  }
+  if (num_literals > capacity - pos) {
+    return 0;
+  }
+  memcpy(dst + pos, literals, num_literals);
+  pos += num_literals;
+  if (match_length == 0) {
+    return pos;
+  }
+
+  if (capacity - pos < 2) {
+    return 0;
+  }
+  dst[pos++] = (unsigned char)(offset & 0xFF);
+  dst[pos++] = (unsigned char)(offset >> 8);
+  size_t length = match_length - LZ_MIN_MATCH;
+  dst[token] |= (unsigned char)(length < RUN_MASK ? length : RUN_MASK);
+  if (length >= RUN_MASK) {
+    pos = put_length(dst, pos, capacity, length - RUN_MASK);
+  }
+  return pos;
+}
+
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity,
+                   uint16_t *table) {
+  memset(table, 0, sizeof(uint16_t) << LZ_HASH_BITS);
+  size_t pos = 0;
+  size_t anchor = 0;  // first byte not written yet
+  size_t out = 0;
+
+  while (size >= LAST_MATCH && pos <= size - LAST_MATCH) {
+    uint32_t prefix = read32(src + pos);
+    size_t h = hash4(prefix);
+    size_t candidate = table[h];
+    table[h] = (uint16_t)pos;
+    if (candidate >= pos || read32(src + candidate) != prefix) {
+      pos += 1 + ((pos - anchor) >> SKIP_SHIFT);
+      continue;
+    }
+
+    size_t length = LZ_MIN_MATCH;
+    while (pos + length < size && src[candidate + length] == src[pos + length]) {
+      length++;
+    }
+    out = put_sequence(dst, out, capacity, src + anchor, pos - anchor, pos - candidate, length);
+    if (out == 0) {
+      return 0;
+    }
+    pos += length;
+    anchor = pos;
+  }
+  return put_sequence(dst, out, capacity, src + anchor, size - anchor, 0, 0);
+}
+
+// Reads the part of a length past RUN_MASK.
+// @return 0 if successful, 1 if the block ends first.
+static int get_length(const unsigned char *src, size_t size, size_t *pos, size_t *length) {
+  unsigned char byte;
+  do {
+    if (*pos == size) {
+      return 1;
+    }
+    byte = src[(*pos)++];
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_size) {
+  size_t pos = 0;
+  size_t out = 0;
+  while (pos < size) {
+    unsigned char token = src[pos++];
+    size_t num_literals = token >> 4;
+    if (num_literals == RUN_MASK && get_length(src, size, &pos, &num_literals) != 0) {
+      return 1;
+    }
+    if (num_literals > size - pos || num_literals > dst_size - out) {
+      return 1;
+    }
+    memcpy(dst + out, src + pos, num_literals);
+    pos += num_literals;
+    out += num_literals;
+    if (pos == size) {
+      break;  // the last sequence
+    }
+
+    if (size - pos < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)src[pos] | (size_t)src[pos + 1] << 8;
+    pos += 2;
+    size_t length = token & RUN_MASK;
+    if (length == RUN_MASK && get_length(src, size, &pos, &length) != 0) {
+      return 1;
+    }
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out || length > dst_size - out) {
+      return 1;
+    }
+    // The match may overlap the bytes it produces, repeating them
+    const unsigned char *match = dst + out - offset;
+    if (offset >= length) {
+      memcpy(dst + out, match, length);
+    } else {
+      for (size_t i = 0; i < length; i++) {
+        dst[out + i] = match[i];
+      }
+    }
+    out += length;
+  }
+  return out == dst_size ? 0 : 1;
+}
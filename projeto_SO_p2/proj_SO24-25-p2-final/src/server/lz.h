@@ -0,0 +1,46 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Block compressor of the compressed backups, in the manner of LZ4: the
+// output is a list of sequences, each a token byte (the number of literals in
+// the high 4 bits and the length of the match, minus LZ_MIN_MATCH, in the low
+// 4 bits; 15 means more length bytes follow, each added until one is below
+// 255), the literals, and the distance back to the match (2 bytes, little
+// endian). The last sequence only has literals. Matches are found through a
+// hash table of the last position of each 4 byte prefix, so compressing is a
+// single pass and decompressing only copies bytes.
+//
+// Blocks are at most LZ_MAX_BLOCK bytes, so distances fit in 2 bytes. Both
+// functions are async signal safe.
+
+#define LZ_MAX_BLOCK (64 * 1024)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+// Size of the output buffer that always fits the compression of size bytes.
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+/// Compresses a block.
+/// @param src The block.
+/// @param size Size of the block, at most LZ_MAX_BLOCK.
+/// @param dst Where to store the compressed block.
+/// @param capacity Size of dst.
+/// @param table Hash table of 1 << LZ_HASH_BITS entries, used as scratch.
+/// @return Size of the compressed block, 0 if it does not fit in capacity.
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity,
+                   uint16_t *table);
+
+/// Decompresses a block, checking it cannot write out of dst or read out of
+/// src, whatever it holds.
+/// @param src The compressed block.
+/// @param size Size of the compressed block.
+/// @param dst Where to store the block.
+/// @param dst_size Size of the block.
+/// @return 0 if the block was decompressed to exactly dst_size bytes, 1 if it
+///         is damaged.
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_size);
+
+#endif  // KVS_LZ_H
@@ -2,6 +2,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -17,19 +18,34 @@
 #include "parser.h"
 #include "operations.h"
 #include "io.h"
+#include "jobqueue.h"
+#include "reader.h"
 #include "pthread.h"
+#include "slab.h"
 
 
 #define BUFFER_SIZE 8
+#define MAX_PARSE_AHEAD 1024  // each command parsed ahead takes about 21 KiB
+#define PARSE_AHEAD_AUTO SIZE_MAX
+#define BACKUP_QUEUE_DEFAULT 64  // BACKUPs waiting for a forked child, unless --backup-queue is given
 
-struct SharedData {
-  DIR* dir;
-  char* dir_name;
-  pthread_mutex_t directory_mutex;
-};
+// Optional settings, given after the positional arguments as --name=value.
+typedef struct {
+  size_t max_memory;         // bytes used by the KVS pairs, 0 for no limit
+  const char* wal_path;      // write-ahead log, NULL for none
+  unsigned int wal_sync_ms;  // fsync interval of the log, 0 to fsync every change
+  const char* snapshot_path; // binary snapshot loaded on startup and written by BACKUP, NULL for none
+  unsigned int max_deltas;   // delta BACKUPs allowed after each full one, 0 for none
+  int backup_thread;         // 1 to write full BACKUPs from a thread instead of a forked child
+  size_t backup_queue;       // BACKUPs allowed to wait for a forked child, 0 for BACKUP_QUEUE_DEFAULT
+  int compress_backups;      // 1 to write compressed backups (.bckz) instead of text
+  unsigned int backup_writers; // processes writing each forked BACKUP
+  size_t parse_ahead;        // commands of a job parsed ahead of the one run, 0 for none,
+                             // PARSE_AHEAD_AUTO to parse ahead only if there are CPUs to spare
+  int slab_stats;            // 1 to print the slab allocator counters on stderr after the jobs
+} ServerOptions;
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
   char *pedi_path;
@@ -88,10 +104,10 @@ ClientInfo* consume() {
   return client; // Retorna o cliente consumido do buffer 
 }
 
-size_t active_backups = 0;     // Number of active backups
 size_t max_backups;            // Maximum allowed simultaneous backups
 size_t max_threads;            // Maximum allowed simultaneous threads
 char* jobs_directory = NULL;
+size_t parse_ahead;            // Commands of a job parsed ahead of the one run
 
 int filter_job_files(const struct dirent* entry) {
     const char* dot = strrchr(entry->d_name, '.');
@@ -101,105 +117,172 @@ int filter_job_files(const struct dirent* entry) {
     return 0;
 }
 
-static int entry_files(const char* dir, struct dirent* entry, char* in_path, char* out_path) {
-  const char* dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 || strcmp(dot, ".job")) {
-    return 1;
-  }
-
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
-    return 1;
+// Tells that a command cannot be used inside a BEGIN ... COMMIT block or
+// after MULTI.
+static int outside_group(KvsBlock *block, int queuing) {
+  if (block != NULL || queuing) {
+    write_str(STDERR_FILENO, "Command not allowed inside BEGIN ... COMMIT or MULTI ... EXEC\n");
+    return 0;
   }
-
-  strcpy(in_path, dir);
-  strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
-
-  strcpy(out_path, in_path);
-  strcpy(strrchr(out_path, '.'), ".out");
-
-  return 0;
+  return 1;
 }
 
 static int run_job(int in_fd, int out_fd, char* filename) {
   size_t file_backups = 0;
+  KvsBlock *block = NULL;  // open BEGIN ... COMMIT block, if any
+  KvsMulti *multi = NULL;  // transaction started by WATCH or MULTI, if any
+  int queuing = 0;         // 1 after MULTI, until EXEC
+  // The next commands are parsed while this thread runs the ones before
+  CommandReader *reader = start_command_reader(in_fd, parse_ahead);
+  if (reader == NULL) {
+    fprintf(stderr, "Failed to start reading the job %s\n", filename);
+    return 0;
+  }
   while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+    ParsedCommand *command = next_command(reader);
+    char (*keys)[MAX_STRING_SIZE] = command->keys;
+    size_t num_pairs = command->num_pairs;
 
-    switch (get_next(in_fd)) {
+    switch (command->cmd) {
       case CMD_WRITE:
-        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
+        if (!command->valid) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_write(num_pairs, keys, values)) {
+        if (queuing           ? kvs_multi_write(multi, num_pairs, keys, command->values, command->ttls)
+            : block != NULL ? kvs_block_write(block, num_pairs, keys, command->values, command->ttls)
+                            : kvs_write(num_pairs, keys, command->values, command->ttls)) {
           write_str(STDERR_FILENO, "Failed to write pair\n");
         }
         break;
 
       case CMD_READ:
-        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
+        if (!command->valid) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_read(num_pairs, keys, out_fd)) {
+        if (queuing           ? kvs_multi_read(multi, num_pairs, keys)
+            : block != NULL ? kvs_block_read(block, num_pairs, keys, out_fd)
+                            : kvs_read(num_pairs, keys, out_fd)) {
           write_str(STDERR_FILENO, "Failed to read pair\n");
         }
         break;
 
       case CMD_DELETE:
-        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
+        if (!command->valid) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_delete(num_pairs, keys, out_fd)) {
+        if (queuing           ? kvs_multi_delete(multi, num_pairs, keys)
+            : block != NULL ? kvs_block_delete(block, num_pairs, keys, out_fd)
+                            : kvs_delete(num_pairs, keys, out_fd)) {
           write_str(STDERR_FILENO, "Failed to delete pair\n");
         }
         break;
 
       case CMD_SHOW:
-        kvs_show(out_fd);
+        if (outside_group(block, queuing)) {
+          kvs_show(out_fd);
+        }
+        break;
+
+      case CMD_SCAN:
+        if (!command->valid) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (outside_group(block, queuing) &&
+            kvs_scan(command->start, command->prefix ? NULL : command->end, out_fd)) {
+          write_str(STDERR_FILENO, "Failed to scan pairs\n");
+        }
         break;
 
       case CMD_WAIT:
-        if (parse_wait(in_fd, &delay, NULL) == -1) {
+        if (!command->valid) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (delay > 0) {
-          printf("Waiting %d seconds\n", delay / 1000);
-          kvs_wait(delay);
+        if (command->delay > 0) {
+          printf("Waiting %d seconds\n", command->delay / 1000);
+          kvs_wait(command->delay);
         }
         break;
 
       case CMD_BACKUP:
-        pthread_mutex_lock(&n_current_backups_lock);
-        if (active_backups >= max_backups) {
-          wait(NULL);
-        } else {
-          active_backups++;
+        if (!outside_group(block, queuing)) {
+          break;
+        }
+        // Returns once the backup is handed off, unless the backup queue is full
+        if (kvs_backup(++file_backups, filename, jobs_directory) != 0) {
+          write_str(STDERR_FILENO, "Failed to do backup\n");
+        }
+        break;
+
+      case CMD_BEGIN:
+        if (!outside_group(block, queuing)) {
+          break;
+        }
+        block = kvs_begin();
+        if (block == NULL) {
+          write_str(STDERR_FILENO, "Failed to begin block\n");
+        }
+        break;
+
+      case CMD_COMMIT:
+        if (block == NULL) {
+          write_str(STDERR_FILENO, "COMMIT without BEGIN\n");
+          break;
+        }
+        if (kvs_commit(block, out_fd)) {
+          write_str(STDERR_FILENO, "Failed to commit block\n");
         }
-        pthread_mutex_unlock(&n_current_backups_lock);
-        int aux = kvs_backup(++file_backups, filename, jobs_directory);
+        block = NULL;
+        break;
+
+      case CMD_WATCH:
+        if (!command->valid) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (!outside_group(block, queuing)) {
+          break;
+        }
+        if (multi == NULL && (multi = kvs_multi()) == NULL) {
+          write_str(STDERR_FILENO, "Failed to watch keys\n");
+          break;
+        }
+        if (kvs_watch(multi, num_pairs, keys)) {
+          write_str(STDERR_FILENO, "Failed to watch keys\n");
+        }
+        break;
+
+      case CMD_MULTI:
+        if (!outside_group(block, queuing)) {
+          break;
+        }
+        if (multi == NULL && (multi = kvs_multi()) == NULL) {
+          write_str(STDERR_FILENO, "Failed to start transaction\n");
+          break;
+        }
+        queuing = 1;
+        break;
 
-        if (aux < 0) {
-            write_str(STDERR_FILENO, "Failed to do backup\n");
-        } else if (aux == 1) {
-          return 1;
+      case CMD_EXEC:
+        if (!queuing) {
+          write_str(STDERR_FILENO, "EXEC without MULTI\n");
+          break;
+        }
+        if (kvs_exec(multi, out_fd)) {
+          write_str(STDERR_FILENO, "Failed to run transaction\n");
         }
+        multi = NULL;
+        queuing = 0;
         break;
 
       case CMD_INVALID:
@@ -209,12 +292,16 @@ static int run_job(int in_fd, int out_fd, char* filename) {
       case CMD_HELP:
         write_str(STDOUT_FILENO,
             "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
+            "  WRITE [(key,value)(key2,value2,ttl_ms),...]\n"
             "  READ [key,key2,...]\n"
             "  DELETE [key,key2,...]\n"
             "  SHOW\n"
+            "  SCAN [start,end] | SCAN prefix*\n"
             "  WAIT <delay_ms>\n"
             "  BACKUP\n" // Not implemented
+            "  BEGIN ... COMMIT\n"
+            "  WATCH [key,key2,...]\n"
+            "  MULTI ... EXEC\n"
             "  HELP\n");
 
         break;
@@ -223,74 +310,58 @@ static int run_job(int in_fd, int out_fd, char* filename) {
         break;
 
       case EOC:
+        if (block != NULL) {
+          write_str(STDERR_FILENO, "Block without COMMIT dropped\n");
+          kvs_abort(block);
+        }
+        if (multi != NULL) {
+          write_str(STDERR_FILENO, "Transaction without EXEC dropped\n");
+          kvs_discard(multi);
+        }
+        stop_command_reader(reader);
         printf("EOF\n");
         return 0;
     }
   }
 }
 
-//frees arguments
+// Work of a thread running jobs.
+struct SharedData {
+  JobQueue* jobs;
+  size_t worker;  // index of the thread, for job_take
+  const char* dir_name;
+};
+
 static void* get_file(void* arguments) {
   struct SharedData* thread_data = (struct SharedData*) arguments;
-  DIR* dir = thread_data->dir;
-  char* dir_name = thread_data->dir_name;
-
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
-    return NULL;
-  }
-
-  struct dirent* entry;
-  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
-      continue;
-    }
-
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-      return NULL;
-    }
+  const char* dir_name = thread_data->dir_name;
 
-    int in_fd = open(in_path, O_RDONLY);
+  Job job;
+  while (job_take(thread_data->jobs, thread_data->worker, &job) == 0) {
+    int in_fd = open(job.in_path, O_RDONLY);
     if (in_fd == -1) {
       write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
+      write_str(STDERR_FILENO, job.in_path);
       write_str(STDERR_FILENO, "\n");
       pthread_exit(NULL);
     }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int out_fd = open(job.out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (out_fd == -1) {
       write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
+      write_str(STDERR_FILENO, job.out_path);
       write_str(STDERR_FILENO, "\n");
       pthread_exit(NULL);
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
+    int out = run_job(in_fd, out_fd, job.in_path + strlen(dir_name) + 1);
 
     close(in_fd);
     close(out_fd);
 
     if (out) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
-
       exit(0);
     }
-
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
-    }
-  }
-
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-    return NULL;
   }
 
   pthread_exit(NULL);
@@ -298,38 +369,41 @@ static void* get_file(void* arguments) {
 
 static void dispatch_threads(DIR* dir) {
   pthread_t* threads = malloc(max_threads * sizeof(pthread_t));
+  struct SharedData* thread_data = malloc(max_threads * sizeof(struct SharedData));
 
-  if (threads == NULL) {
+  if (threads == NULL || thread_data == NULL) {
     fprintf(stderr, "Failed to allocate memory for threads\n");
+    free(threads);
+    free(thread_data);
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory, PTHREAD_MUTEX_INITIALIZER};
-
+  // The jobs are all known, and sized, before the first one starts
+  JobQueue* jobs = create_job_queue(dir, jobs_directory, max_threads);
+  if (jobs == NULL) {
+    free(threads);
+    free(thread_data);
+    return;
+  }
 
-  for (size_t i = 0; i < max_threads; i++) {
-    if (pthread_create(&threads[i], NULL, get_file, (void*)&thread_data) != 0) {
-      fprintf(stderr, "Failed to create thread %zu\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
-      free(threads);
-      return;
+  size_t num_threads = 0;
+  for (; num_threads < max_threads; num_threads++) {
+    thread_data[num_threads] = (struct SharedData){jobs, num_threads, jobs_directory};
+    if (pthread_create(&threads[num_threads], NULL, get_file, (void*)&thread_data[num_threads]) != 0) {
+      // The threads already created steal the jobs of the others
+      fprintf(stderr, "Failed to create thread %zu\n", num_threads);
+      break;
     }
   }
 
-
-  for (unsigned int i = 0; i < max_threads; i++) {
+  for (size_t i = 0; i < num_threads; i++) {
     if (pthread_join(threads[i], NULL) != 0) {
-      fprintf(stderr, "Failed to join thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
-      free(threads);
-      return;
+      fprintf(stderr, "Failed to join thread %zu\n", i);
     }
   }
 
-  if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0) {
-    fprintf(stderr, "Failed to destroy directory_mutex\n");
-  }
-
+  free_job_queue(jobs);
+  free(thread_data);
   free(threads);
 }
 
@@ -620,13 +694,183 @@ void* fifo_reader(void* arg) {
 }
 
 
+// Parses a size in bytes, optionally followed by K, M or G.
+// @param str String to parse.
+// @param size Where to store the size.
+// @return 0 if successful, 1 otherwise.
+static int parse_size(const char* str, size_t* size) {
+  char* endptr;
+  errno = 0;
+  unsigned long long value = strtoull(str, &endptr, 10);
+  if (endptr == str || errno != 0) {
+    return 1;
+  }
+
+  unsigned long long unit = 1;
+  switch (*endptr) {
+    case 'K': case 'k': unit = 1ULL << 10; endptr++; break;
+    case 'M': case 'm': unit = 1ULL << 20; endptr++; break;
+    case 'G': case 'g': unit = 1ULL << 30; endptr++; break;
+    default: break;
+  }
+  if (*endptr != '\0' || value > SIZE_MAX / unit) {
+    return 1;
+  }
+
+  *size = (size_t)(value * unit);
+  return 0;
+}
+
+// Parses the options that follow the positional arguments.
+// @param argc Number of options.
+// @param argv The options.
+// @param options Where to store them (fields not given keep their value).
+// @return 0 if successful, 1 if an option is unknown or invalid.
+static int parse_options(int argc, char** argv, ServerOptions* options) {
+  for (int i = 0; i < argc; i++) {
+    const char* value = strchr(argv[i], '=');
+    if (value == NULL) {
+      fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      return 1;
+    }
+    size_t name_len = (size_t)(value - argv[i]);
+    value++;
+
+    if (name_len == strlen("--max-memory") && strncmp(argv[i], "--max-memory", name_len) == 0) {
+      if (parse_size(value, &options->max_memory) != 0) {
+        fprintf(stderr, "Invalid --max-memory value: %s\n", value);
+        return 1;
+      }
+    } else if (name_len == strlen("--wal") && strncmp(argv[i], "--wal", name_len) == 0) {
+      if (*value == '\0') {
+        fprintf(stderr, "Invalid --wal value: %s\n", value);
+        return 1;
+      }
+      options->wal_path = value;
+    } else if (name_len == strlen("--wal-sync") && strncmp(argv[i], "--wal-sync", name_len) == 0) {
+      char* endptr;
+      errno = 0;
+      unsigned long ms = strtoul(value, &endptr, 10);
+      if (endptr == value || *endptr != '\0' || errno != 0 || ms > UINT_MAX) {
+        fprintf(stderr, "Invalid --wal-sync value: %s\n", value);
+        return 1;
+      }
+      options->wal_sync_ms = (unsigned int)ms;
+    } else if (name_len == strlen("--snapshot") && strncmp(argv[i], "--snapshot", name_len) == 0) {
+      if (*value == '\0') {
+        fprintf(stderr, "Invalid --snapshot value: %s\n", value);
+        return 1;
+      }
+      options->snapshot_path = value;
+    } else if (name_len == strlen("--delta-backups") &&
+               strncmp(argv[i], "--delta-backups", name_len) == 0) {
+      char* endptr;
+      errno = 0;
+      unsigned long deltas = strtoul(value, &endptr, 10);
+      if (endptr == value || *endptr != '\0' || errno != 0 || deltas > UINT_MAX) {
+        fprintf(stderr, "Invalid --delta-backups value: %s\n", value);
+        return 1;
+      }
+      options->max_deltas = (unsigned int)deltas;
+    } else if (name_len == strlen("--backup-engine") &&
+               strncmp(argv[i], "--backup-engine", name_len) == 0) {
+      if (strcmp(value, "fork") == 0) {
+        options->backup_thread = 0;
+      } else if (strcmp(value, "thread") == 0) {
+        options->backup_thread = 1;
+      } else {
+        fprintf(stderr, "Invalid --backup-engine value: %s\n", value);
+        return 1;
+      }
+    } else if (name_len == strlen("--backup-format") &&
+               strncmp(argv[i], "--backup-format", name_len) == 0) {
+      if (strcmp(value, "text") == 0) {
+        options->compress_backups = 0;
+      } else if (strcmp(value, "lz") == 0) {
+        options->compress_backups = 1;
+      } else {
+        fprintf(stderr, "Invalid --backup-format value: %s\n", value);
+        return 1;
+      }
+    } else if (name_len == strlen("--backup-queue") &&
+               strncmp(argv[i], "--backup-queue", name_len) == 0) {
+      char* endptr;
+      errno = 0;
+      unsigned long queue = strtoul(value, &endptr, 10);
+      if (endptr == value || *endptr != '\0' || errno != 0 || queue == 0) {
+        fprintf(stderr, "Invalid --backup-queue value: %s\n", value);
+        return 1;
+      }
+      options->backup_queue = (size_t)queue;
+    } else if (name_len == strlen("--backup-writers") &&
+               strncmp(argv[i], "--backup-writers", name_len) == 0) {
+      char* endptr;
+      errno = 0;
+      unsigned long writers = strtoul(value, &endptr, 10);
+      if (endptr == value || *endptr != '\0' || errno != 0 || writers == 0 ||
+          writers > MAX_BACKUP_WRITERS) {
+        fprintf(stderr, "Invalid --backup-writers value: %s\n", value);
+        return 1;
+      }
+      options->backup_writers = (unsigned int)writers;
+    } else if (name_len == strlen("--parse-ahead") &&
+               strncmp(argv[i], "--parse-ahead", name_len) == 0) {
+      char* endptr;
+      errno = 0;
+      unsigned long ahead = strtoul(value, &endptr, 10);
+      if (endptr == value || *endptr != '\0' || errno != 0 || ahead > MAX_PARSE_AHEAD) {
+        fprintf(stderr, "Invalid --parse-ahead value: %s\n", value);
+        return 1;
+      }
+      options->parse_ahead = (size_t)ahead;
+    } else if (name_len == strlen("--slab-stats") &&
+               strncmp(argv[i], "--slab-stats", name_len) == 0) {
+      if (strcmp(value, "on") == 0) {
+        options->slab_stats = 1;
+      } else if (strcmp(value, "off") == 0) {
+        options->slab_stats = 0;
+      } else {
+        fprintf(stderr, "Invalid --slab-stats value: %s\n", value);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
-  if (argc < 4) {
+  if (argc < 5) {
     write_str(STDERR_FILENO, "Usage: ");
     write_str(STDERR_FILENO, argv[0]);
     write_str(STDERR_FILENO, " <jobs_dir>");
 		write_str(STDERR_FILENO, " <max_threads>");
-		write_str(STDERR_FILENO, " <max_backups> \n");
+		write_str(STDERR_FILENO, " <max_backups>");
+		write_str(STDERR_FILENO, " <fifo_name>");
+		write_str(STDERR_FILENO, " [--max-memory=<bytes>[K|M|G]]");
+		write_str(STDERR_FILENO, " [--wal=<file> [--wal-sync=<ms>]]");
+		write_str(STDERR_FILENO, " [--snapshot=<file>]");
+		write_str(STDERR_FILENO, " [--delta-backups=<n>]");
+		write_str(STDERR_FILENO, " [--backup-engine=fork|thread]");
+		write_str(STDERR_FILENO, " [--backup-queue=<n>]");
+		write_str(STDERR_FILENO, " [--backup-format=text|lz]");
+		write_str(STDERR_FILENO, " [--backup-writers=<n>]");
+		write_str(STDERR_FILENO, " [--parse-ahead=<n>]");
+		write_str(STDERR_FILENO, " [--slab-stats=on|off]\n");
+    return 1;
+  }
+
+  ServerOptions options = {.max_memory = 0, .wal_path = NULL, .wal_sync_ms = 0, .snapshot_path = NULL,
+                           .max_deltas = 0, .backup_thread = 0, .backup_queue = 0,
+                           .compress_backups = 0, .backup_writers = 1,
+                           .parse_ahead = PARSE_AHEAD_AUTO, .slab_stats = 0};
+  if (parse_options(argc - 5, argv + 5, &options) != 0) {
+    return 1;
+  }
+  if (options.backup_thread && options.backup_writers > 1) {
+    fprintf(stderr, "--backup-writers only applies to --backup-engine=fork\n");
     return 1;
   }
 
@@ -669,11 +913,61 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+  // A parser thread per job only pays off on CPUs the job threads leave idle;
+  // otherwise the two threads of a job just take turns on the same CPU
+  parse_ahead = options.parse_ahead;
+  if (parse_ahead == PARSE_AHEAD_AUTO) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    parse_ahead = num_cpus > 0 && (size_t)num_cpus > max_threads ? 8 : 0;
+  }
+
+  // Children are reaped through a signalfd, so SIGCHLD stays blocked in every
+  // thread, starting with the ones kvs_init creates
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &sigchld, NULL);
+
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
 
+  if (options.max_memory != 0 && kvs_set_memory_limit(options.max_memory)) {
+    write_str(STDERR_FILENO, "Failed to set the memory limit\n");
+    return 1;
+  }
+
+  if (options.max_deltas != 0 && kvs_set_delta_backups(options.max_deltas)) {
+    write_str(STDERR_FILENO, "Failed to enable delta backups\n");
+    return 1;
+  }
+
+  if (options.backup_thread && kvs_start_backup_thread()) {
+    write_str(STDERR_FILENO, "Failed to start the backup thread\n");
+    return 1;
+  }
+
+  kvs_set_backup_compression(options.compress_backups);
+  kvs_set_backup_writers(options.backup_writers);
+
+  if (kvs_start_backup_scheduler(max_backups,
+                                 options.backup_queue != 0 ? options.backup_queue : BACKUP_QUEUE_DEFAULT)) {
+    write_str(STDERR_FILENO, "Failed to start the backup scheduler\n");
+    return 1;
+  }
+
+  // The log has the changes made after the snapshot, so it is replayed on top
+  if (options.snapshot_path != NULL && kvs_open_snapshot(options.snapshot_path)) {
+    write_str(STDERR_FILENO, "Failed to load the snapshot\n");
+    return 1;
+  }
+
+  if (options.wal_path != NULL && kvs_open_wal(options.wal_path, options.wal_sync_ms)) {
+    write_str(STDERR_FILENO, "Failed to open the write-ahead log\n");
+    return 1;
+  }
+
   DIR* dir = opendir(argv[1]);
   if (dir == NULL) {
     fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
@@ -718,11 +1012,16 @@ int main(int argc, char** argv) {
     return 0;
   }
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
+  if (options.slab_stats) {
+    SlabStats slab_stats;
+    slab_get_stats(&slab_stats);
+    fprintf(stderr, "Slab allocator: %zu allocs, %zu frees, %zu pool refills, %zu chunks, %zu large allocs\n",
+            slab_stats.allocs, slab_stats.frees, slab_stats.refills, slab_stats.chunks,
+            slab_stats.large_allocs);
   }
 
+  kvs_wait_backup();
+
   // Espera que todas as threads gestoras acabem
   for (size_t i = 0; i < s; i++) {
     pthread_join(threads[i], NULL);
@@ -0,0 +1,190 @@
+#include "mvcc.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+
+#define HISTORY_BUCKETS 1024  // must be a power of two
+#define HISTORY_LOCKS 64      // bucket i is protected by locks[i % HISTORY_LOCKS]
+
+// A value replaced by a commit. Records of a bucket are kept newest first.
+typedef struct Version {
+  uint64_t version;  // commit that replaced the value
+  int existed;       // 0 if the key did not exist before that commit
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  struct Version *next;
+} Version;
+
+struct VersionStore {
+  atomic_uint_fast64_t clock;  // last version given to a commit
+  atomic_size_t open;          // number of open snapshots
+
+  pthread_mutex_t snapshot_lock;  // protects the list of open snapshots
+  uint64_t *snapshots;
+  size_t num_snapshots;
+  size_t snapshots_capacity;
+
+  pthread_mutex_t locks[HISTORY_LOCKS];
+  Version *buckets[HISTORY_BUCKETS];
+};
+
+static size_t bucket_of(const char *key) {
+  return hash(key) & (HISTORY_BUCKETS - 1);
+}
+
+VersionStore *create_version_store(void) {
+  VersionStore *store = calloc(1, sizeof(VersionStore));
+  if (store == NULL) {
+    return NULL;
+  }
+  atomic_init(&store->clock, 0);
+  atomic_init(&store->open, 0);
+  pthread_mutex_init(&store->snapshot_lock, NULL);
+  for (size_t i = 0; i < HISTORY_LOCKS; i++) {
+    pthread_mutex_init(&store->locks[i], NULL);
+  }
+  return store;
+}
+
+int mvcc_begin(VersionStore *store, uint64_t *snapshot) {
+  pthread_mutex_lock(&store->snapshot_lock);
+  if (store->num_snapshots == store->snapshots_capacity) {
+    size_t capacity = store->snapshots_capacity ? store->snapshots_capacity * 2 : 8;
+    uint64_t *snapshots = realloc(store->snapshots, capacity * sizeof(uint64_t));
+    if (snapshots == NULL) {
+      pthread_mutex_unlock(&store->snapshot_lock);
+      return 1;
+    }
+    store->snapshots = snapshots;
+    store->snapshots_capacity = capacity;
+  }
+  *snapshot = atomic_load(&store->clock);
+  store->snapshots[store->num_snapshots++] = *snapshot;
+  atomic_fetch_add(&store->open, 1);
+  pthread_mutex_unlock(&store->snapshot_lock);
+  return 0;
+}
+
+void mvcc_end(VersionStore *store, uint64_t snapshot) {
+  pthread_mutex_lock(&store->snapshot_lock);
+  for (size_t i = 0; i < store->num_snapshots; i++) {
+    if (store->snapshots[i] == snapshot) {
+      store->snapshots[i] = store->snapshots[--store->num_snapshots];
+      break;
+    }
+  }
+  // Snapshots opened from now on get at least the current clock
+  uint64_t oldest = atomic_load(&store->clock);
+  for (size_t i = 0; i < store->num_snapshots; i++) {
+    if (store->snapshots[i] < oldest) {
+      oldest = store->snapshots[i];
+    }
+  }
+  atomic_fetch_sub(&store->open, 1);
+  pthread_mutex_unlock(&store->snapshot_lock);
+
+  // Records of commits up to the oldest open snapshot are visible to all of
+  // them in the table already
+  for (size_t i = 0; i < HISTORY_BUCKETS; i++) {
+    pthread_mutex_lock(&store->locks[i % HISTORY_LOCKS]);
+    for (Version **link = &store->buckets[i]; *link != NULL;) {
+      Version *record = *link;
+      if (record->version <= oldest) {
+        *link = record->next;
+        free(record);
+      } else {
+        link = &record->next;
+      }
+    }
+    pthread_mutex_unlock(&store->locks[i % HISTORY_LOCKS]);
+  }
+}
+
+int mvcc_recording(VersionStore *store) {
+  return atomic_load(&store->open) > 0;
+}
+
+uint64_t mvcc_next_version(VersionStore *store) {
+  return atomic_fetch_add(&store->clock, 1) + 1;
+}
+
+int mvcc_record(VersionStore *store, const char *key, uint64_t version, const char *old_value) {
+  Version *record = malloc(sizeof(Version));
+  if (record == NULL) {
+    return 1;
+  }
+  record->version = version;
+  record->existed = old_value != NULL;
+  strncpy(record->key, key, MAX_STRING_SIZE - 1);
+  record->key[MAX_STRING_SIZE - 1] = '\0';
+  if (old_value != NULL) {
+    strncpy(record->value, old_value, MAX_STRING_SIZE - 1);
+    record->value[MAX_STRING_SIZE - 1] = '\0';
+  }
+
+  size_t bucket = bucket_of(key);
+  pthread_mutex_lock(&store->locks[bucket % HISTORY_LOCKS]);
+  record->next = store->buckets[bucket];
+  store->buckets[bucket] = record;
+  pthread_mutex_unlock(&store->locks[bucket % HISTORY_LOCKS]);
+  return 0;
+}
+
+// Finds the record of the first commit after a snapshot that changed a key.
+// Must be called with the bucket locked.
+static Version *first_change(VersionStore *store, size_t bucket, const char *key, uint64_t snapshot) {
+  Version *first = NULL;
+  for (Version *record = store->buckets[bucket]; record != NULL; record = record->next) {
+    // Records are newest first, so on a tie (a key written twice by the same
+    // commit) the last one found holds the older value
+    if (record->version > snapshot && (first == NULL || record->version <= first->version) &&
+        strcmp(record->key, key) == 0) {
+      first = record;
+    }
+  }
+  return first;
+}
+
+int mvcc_lookup(VersionStore *store, const char *key, uint64_t snapshot, char value[MAX_STRING_SIZE]) {
+  size_t bucket = bucket_of(key);
+  int result = -1;
+  pthread_mutex_lock(&store->locks[bucket % HISTORY_LOCKS]);
+  Version *record = first_change(store, bucket, key, snapshot);
+  if (record != NULL) {
+    result = !record->existed;
+    if (record->existed) {
+      memcpy(value, record->value, MAX_STRING_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&store->locks[bucket % HISTORY_LOCKS]);
+  return result;
+}
+
+int mvcc_changed_since(VersionStore *store, const char *key, uint64_t snapshot) {
+  size_t bucket = bucket_of(key);
+  pthread_mutex_lock(&store->locks[bucket % HISTORY_LOCKS]);
+  int changed = first_change(store, bucket, key, snapshot) != NULL;
+  pthread_mutex_unlock(&store->locks[bucket % HISTORY_LOCKS]);
+  return changed;
+}
+
+void free_version_store(VersionStore *store) {
+  for (size_t i = 0; i < HISTORY_BUCKETS; i++) {
+    Version *record = store->buckets[i];
+    while (record != NULL) {
+      Version *next = record->next;
+      free(record);
+      record = next;
+    }
+  }
+  for (size_t i = 0; i < HISTORY_LOCKS; i++) {
+    pthread_mutex_destroy(&store->locks[i]);
+  }
+  pthread_mutex_destroy(&store->snapshot_lock);
+  free(store->snapshots);
+  free(store);
+}
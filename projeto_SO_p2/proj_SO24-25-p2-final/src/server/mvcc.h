@@ -0,0 +1,80 @@
+#ifndef KVS_MVCC_H
+#define KVS_MVCC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Old versions of the pairs, kept so BEGIN ... COMMIT blocks can read the
+// table as it was when they started (snapshot isolation) while other jobs keep
+// writing to it.
+//
+// The table itself only holds the latest values. While at least one snapshot
+// is open, every commit takes a new version number and, before changing a key,
+// records the value it replaces (or that the key did not exist) tagged with
+// that version. The value of a key at snapshot T is then the one replaced by
+// the first commit after T, or the one in the table if no commit after T
+// changed it. Records no open snapshot can need are dropped when a snapshot
+// ends, so with no blocks running nothing is recorded at all.
+//
+// Pairs removed by eviction are not recorded: a snapshot may miss them.
+
+typedef struct VersionStore VersionStore;
+
+/// Creates an empty store.
+/// @return The store, NULL on failure.
+VersionStore *create_version_store(void);
+
+/// Opens a snapshot. No commit may be halfway done: callers hold every stripe.
+/// @param store The store.
+/// @param snapshot Set to the version of the snapshot, used by the other functions.
+/// @return 0 if the snapshot was opened, 1 if memory ran out.
+int mvcc_begin(VersionStore *store, uint64_t *snapshot);
+
+/// Closes a snapshot and drops the records no other snapshot needs.
+/// @param store The store.
+/// @param snapshot Version returned by mvcc_begin.
+void mvcc_end(VersionStore *store, uint64_t snapshot);
+
+/// Tells whether commits must record what they replace, that is, whether a
+/// snapshot is open. Called with the stripes of the commit locked.
+/// @param store The store.
+/// @return 1 if a snapshot is open, 0 otherwise.
+int mvcc_recording(VersionStore *store);
+
+/// Gives a new version to a commit, greater than any open snapshot.
+/// @param store The store.
+/// @return The version.
+uint64_t mvcc_next_version(VersionStore *store);
+
+/// Records the value a commit is about to replace. Must be called before the
+/// table is changed, with the key's stripe locked.
+/// @param store The store.
+/// @param key The key.
+/// @param version Version of the commit.
+/// @param old_value Value being replaced, NULL if the key did not exist.
+/// @return 0 if the value was recorded, 1 if memory ran out.
+int mvcc_record(VersionStore *store, const char *key, uint64_t version, const char *old_value);
+
+/// Finds the value a key had at a snapshot, if a later commit replaced it.
+/// @param store The store.
+/// @param key The key.
+/// @param snapshot Version of the snapshot.
+/// @param value Buffer of MAX_STRING_SIZE bytes for the value.
+/// @return -1 if no commit after the snapshot changed the key (the table has
+///         its value), 0 if the key existed (value is set), 1 if it did not.
+int mvcc_lookup(VersionStore *store, const char *key, uint64_t snapshot, char value[MAX_STRING_SIZE]);
+
+/// Tells whether a commit after a snapshot changed a key.
+/// @param store The store.
+/// @param key The key.
+/// @param snapshot Version of the snapshot.
+/// @return 1 if the key was changed, 0 otherwise.
+int mvcc_changed_since(VersionStore *store, const char *key, uint64_t snapshot);
+
+/// Frees the store.
+/// @param store The store.
+void free_version_store(VersionStore *store);
+
+#endif  // KVS_MVCC_H
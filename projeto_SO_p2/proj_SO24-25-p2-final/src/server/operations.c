@@ -1,4 +1,11 @@
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,12 +13,136 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bckfile.h"
 #include "constants.h"
+#include "dirty.h"
 #include "io.h"
+#include "keyindex.h"
 #include "kvs.h"
+#include "mvcc.h"
 #include "operations.h"
+#include "scheduler.h"
+#include "snapfile.h"
+#include "ttl.h"
+#include "wal.h"
+
+#define SCAN_BATCH 32  // keys copied from the index at a time by SCAN
+#define BACKUP_LINE (2 * MAX_STRING_SIZE + 6)  // "(key, value)\n" and the '\0'
+#define CHANGE_SLOTS 4096  // change counters for WATCH, a multiple of NUM_STRIPES
 
 static struct HashTable *kvs_table = NULL;
+// Keys of kvs_table in order, for SCAN. Changed together with the table while
+// the key's stripe is locked.
+static KeyIndex *kvs_index = NULL;
+// Values replaced while BEGIN ... COMMIT blocks are open.
+static VersionStore *kvs_versions = NULL;
+// Deadlines of the keys written with a TTL.
+static TimerWheel *kvs_timers = NULL;
+// Log of the changes, NULL if the server runs without one.
+static Wal *kvs_wal = NULL;
+// Binary snapshot rewritten by every BACKUP, NULL if the server runs without one.
+static char *kvs_snapshot_path = NULL;
+// 1 if a memory limit is set, so pairs may be evicted.
+static int kvs_memory_limited = 0;
+// Numbers the temporary files of the snapshots, which may be written at once.
+static atomic_uint snapshot_count;
+// Keys changed since the last BACKUP, NULL if every BACKUP is full.
+static DirtyKeys *kvs_dirty = NULL;
+// Delta BACKUPs allowed after each full one.
+static unsigned int kvs_max_deltas = 0;
+// 1 if BACKUP writes compressed backups (".bckz") instead of text.
+static int kvs_compress_backups = 0;
+// Processes writing the backup file of each forked BACKUP.
+static unsigned int kvs_backup_writers = 1;
+// Forks the children writing full BACKUPs and reaps them.
+static BackupScheduler *kvs_backups = NULL;
+
+// Numbers the BACKUPs, in the order they copy the table. Protects the fields
+// below.
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t backup_generation = 0;  // of the last BACKUP, or of the snapshot loaded
+static int have_full_backup = 0;        // 1 once a full BACKUP was made
+static unsigned int deltas_since_full = 0;
+static size_t forks_waiting = 0;        // full BACKUPs queued whose child is not forked yet
+static size_t fulls_pending = 0;        // full BACKUPs not written yet (see full_backup_done)
+
+// Position of the log the snapshot and deltas loaded hold every change up to,
+// 0 if none was, from which the log is replayed.
+static uint64_t replay_from = 0;
+
+// A full BACKUP handed to the backup thread, or queued in the scheduler for a
+// forked child. Tasks are queued in the order of their generations, and the
+// backup thread only walks one once its snapshot of the table is started.
+typedef struct BackupTask {
+  struct BackupTask *next;
+  Snapshot *snapshot;
+  int started;              // 1 once snapshot_begin returned, under backup_thread.lock
+  char bck_name[PATH_MAX];
+  uint64_t generation;
+  uint64_t wal_position;    // of the log, when the table is copied
+  uint64_t real_ms;         // wall clock when BACKUP ran, which TTLs count from
+  uint64_t mono_ms;         // CLOCK_MONOTONIC at the same time
+  char tmp_name[PATH_MAX];  // for the binary snapshot, if there is one
+  char **obsolete;          // deltas to remove once the binary snapshot is written
+  size_t num_obsolete;
+} BackupTask;
+
+// Thread writing the full BACKUPs, if they are not written by forked children.
+static struct {
+  pthread_mutex_t lock;  // protects the queue, pending and stop
+  pthread_cond_t wake;
+  pthread_cond_t done;   // signalled when a BACKUP is written
+  BackupTask *head;
+  BackupTask *tail;
+  size_t pending;        // BACKUPs queued or being written
+  int stop;
+  int running;
+  pthread_t thread;
+} backup_thread = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                   .done = PTHREAD_COND_INITIALIZER};
+
+// A pair written or deleted by a block, only applied to the table on COMMIT.
+typedef struct BlockWrite {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  unsigned int ttl;
+  int deleted;
+} BlockWrite;
+
+// Counts the changes of the keys, for WATCH. Keys share a counter when their
+// hashes match modulo CHANGE_SLOTS, which can only make EXEC give up for
+// nothing, never miss a change. Since CHANGE_SLOTS is a multiple of
+// NUM_STRIPES, a counter only changes with the stripe of its keys locked.
+static atomic_uint change_count[CHANGE_SLOTS];
+
+// A WATCH ... MULTI ... EXEC transaction of a job.
+typedef struct QueuedCommand {
+  enum { QUEUED_WRITE, QUEUED_READ, QUEUED_DELETE } type;
+  size_t num_pairs;
+  size_t first;  // index of its first key in the keys of the transaction
+} QueuedCommand;
+
+struct KvsMulti {
+  size_t num_watched;  // the first keys are the watched ones
+  unsigned int *watched_counts;
+  QueuedCommand *commands;
+  size_t num_commands;
+  size_t commands_capacity;
+  char (*keys)[MAX_STRING_SIZE];    // watched keys, then those of the commands
+  char (*values)[MAX_STRING_SIZE];  // values of queued WRITEs, by key index
+  unsigned int *ttls;               // TTLs of queued WRITEs, by key index
+  size_t num_keys;
+  size_t keys_capacity;
+  int failed;                       // a command could not be queued, EXEC drops it
+};
+
+struct KvsBlock {
+  uint64_t snapshot;   // version of the table the block reads
+  BlockWrite *writes;  // one per key, in the order they were first written
+  size_t num_writes;
+  size_t capacity;
+  int failed;          // a write could not be recorded, COMMIT drops the block
+};
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -20,6 +151,20 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void expire_key(const char *key, void *arg);
+
 int kvs_init() {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
@@ -27,7 +172,95 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  kvs_index = create_key_index();
+  kvs_versions = create_version_store();
+  if (kvs_index != NULL && kvs_versions != NULL) {
+    kvs_timers = create_timer_wheel(expire_key, NULL);
+  }
+  if (kvs_index == NULL || kvs_versions == NULL || kvs_timers == NULL) {
+    if (kvs_index != NULL) {
+      free_key_index(kvs_index);
+    }
+    if (kvs_versions != NULL) {
+      free_version_store(kvs_versions);
+    }
+    free_table(kvs_table);
+    kvs_table = NULL;
+    kvs_index = NULL;
+    kvs_versions = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+// Marks a key as changed for WATCH and for the next delta BACKUP. Called with
+// its stripe locked.
+static void count_change(const char *key) {
+  atomic_fetch_add(&change_count[hash(key) % CHANGE_SLOTS], 1);
+  if (kvs_dirty != NULL) {
+    dirty_mark(kvs_dirty, key);
+  }
+}
+
+// Keeps the index, WATCH and the log in sync with the table when a pair is
+// evicted. Called from the write that evicts it, so the delete goes in the
+// same commit, before the write.
+static void unindex_key(const char *key, void *arg) {
+  (void)arg;
+  key_index_remove(kvs_index, key);
+  timer_cancel(kvs_timers, key);
+  count_change(key);
+  if (kvs_wal != NULL) {
+    wal_put_delete(key);
+  }
+}
+
+int kvs_set_memory_limit(size_t max_bytes) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  set_memory_limit(kvs_table, max_bytes, unindex_key, NULL);
+  kvs_memory_limited = max_bytes != 0;
+  return 0;
+}
+
+int kvs_set_delta_backups(unsigned int max_deltas) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  if (kvs_dirty == NULL && (kvs_dirty = create_dirty_keys()) == NULL) {
+    return 1;
+  }
+  kvs_max_deltas = max_deltas;
+  return 0;
+}
+
+void kvs_set_backup_compression(int compress) {
+  kvs_compress_backups = compress;
+}
+
+void kvs_set_backup_writers(unsigned int num_writers) {
+  kvs_backup_writers = num_writers;
+}
+
+static pid_t spawn_backup(void *request, const sigset_t *child_mask);
+static void end_backup(void *request, int failed);
+
+int kvs_start_backup_scheduler(size_t max_running, size_t max_queued) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  kvs_backups = create_backup_scheduler(max_running, max_queued, spawn_backup, end_backup);
+  return kvs_backups == NULL;
 }
 
 int kvs_terminate() {
@@ -36,52 +269,572 @@ int kvs_terminate() {
     return 1;
   }
 
+  // The children and the backup thread finish the BACKUPs they were given first
+  if (kvs_backups != NULL) {
+    free_backup_scheduler(kvs_backups);
+    kvs_backups = NULL;
+  }
+  if (backup_thread.running) {
+    pthread_mutex_lock(&backup_thread.lock);
+    backup_thread.stop = 1;
+    pthread_cond_signal(&backup_thread.wake);
+    pthread_mutex_unlock(&backup_thread.lock);
+    pthread_join(backup_thread.thread, NULL);
+    backup_thread.running = 0;
+  }
+  // The expiry thread is stopped first, since it uses the table
+  free_timer_wheel(kvs_timers);
+  if (kvs_wal != NULL) {
+    wal_close(kvs_wal);
+    kvs_wal = NULL;
+  }
   free_table(kvs_table);
+  free_key_index(kvs_index);
+  free_version_store(kvs_versions);
+  free(kvs_snapshot_path);
+  kvs_snapshot_path = NULL;
+  if (kvs_dirty != NULL) {
+    free_dirty_keys(kvs_dirty);
+    kvs_dirty = NULL;
+  }
   kvs_table = NULL;
+  kvs_index = NULL;
+  kvs_versions = NULL;
+  kvs_timers = NULL;
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+// Records, for the open snapshots, the values a commit is about to replace.
+// Must be called with the stripes of the keys locked for writing.
+// @param version Version of the commit, from mvcc_next_version.
+// @param only_existing If not 0, keys that do not exist are left out (a
+//                      DELETE of a missing key changes nothing).
+static void record_versions(uint64_t version, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                            int only_existing) {
+  for (size_t i = 0; i < num_keys; i++) {
+    char value[MAX_STRING_SIZE];
+    int found = read_pair(kvs_table, keys[i], value, sizeof(value)) == 0;
+    if ((found || !only_existing) &&
+        mvcc_record(kvs_versions, keys[i], version, found ? value : NULL) != 0) {
+      fprintf(stderr, "Failed to record the old value of key %s\n", keys[i]);
+    }
+  }
+}
+
+// Writes a pair and indexes its key if it is new. Must be called with the
+// key's stripe locked for writing.
+// @param ttl Milliseconds until the pair expires, 0 if it never does (a
+//            write without a TTL also drops the one the key had).
+static void apply_write(const char *key, const char *value, unsigned int ttl) {
+  int result = write_pair(kvs_table, key, value);
+  if (result >= 0) {
+    count_change(key);
+  }
+  if (result < 0) {
+    fprintf(stderr, "Failed to write key pair (%s,%s)\n", key, value);
+    return;
+  }
+  if (result == 1 && key_index_insert(kvs_index, key) != 0) {
+    fprintf(stderr, "Failed to index key %s\n", key);
+  }
+  if (kvs_wal != NULL) {
+    wal_put_write(key, value, ttl);
+  }
+  if (ttl == 0) {
+    timer_cancel(kvs_timers, key);
+  } else if (timer_arm(kvs_timers, key, ttl) != 0) {
+    fprintf(stderr, "Failed to set the TTL of key %s\n", key);
+  }
+}
+
+// Deletes a pair and its key from the index. Must be called with the key's
+// stripe locked for writing.
+// @return 0 if the pair was deleted, 1 if it did not exist.
+static int apply_delete(const char *key) {
+  if (delete_pair(kvs_table, key) != 0) {
+    return 1;
+  }
+  key_index_remove(kvs_index, key);
+  timer_cancel(kvs_timers, key);
+  count_change(key);
+  if (kvs_wal != NULL) {
+    wal_put_delete(key);
+  }
+  return 0;
+}
+
+// Appends the changes made by the calling thread since the last call to the
+// log, as one commit. Must be called with their stripes still locked.
+// @return Position to pass to wait_logged.
+static uint64_t log_changes(void) {
+  return kvs_wal != NULL ? wal_commit(kvs_wal) : 0;
+}
+
+// Waits until changes appended by log_changes are in the log. Called with the
+// stripes unlocked, so threads waiting for the disk hold no locks.
+// @return 0 if successful, 1 if the log could not be written.
+static int wait_logged(uint64_t lsn) {
+  if (kvs_wal != NULL && wal_sync(kvs_wal, lsn) != 0) {
+    fprintf(stderr, "Failed to write the log\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Removes a pair whose TTL ran out, unless it was written again meanwhile.
+// Its subscribers get "(key,DELETED)", as with DELETE.
+static void expire_key(const char *key, void *arg) {
+  (void)arg;
+  char keys[1][MAX_STRING_SIZE];
+  memcpy(keys[0], key, MAX_STRING_SIZE);
+
+  lock_keys(kvs_table, 1, keys, 1);
+  if (timer_expired(kvs_timers, key)) {
+    if (mvcc_recording(kvs_versions)) {
+      record_versions(mvcc_next_version(kvs_versions), 1, keys, 1);
+    }
+    apply_delete(key);
+  }
+  // Nothing waits for it: replaying a log drops the pairs that ran out anyway
+  log_changes();
+  unlock_keys(kvs_table, 1, keys);
+}
+
+// Applies a change read back from the log or from a delta.
+static void replay_change(const char *key, const char *value, unsigned int ttl_ms, void *arg) {
+  (void)arg;
+  char keys[1][MAX_STRING_SIZE];
+  strncpy(keys[0], key, MAX_STRING_SIZE - 1);
+  keys[0][MAX_STRING_SIZE - 1] = '\0';
+
+  // The expiry thread may already be removing replayed pairs
+  lock_keys(kvs_table, 1, keys, 1);
+  if (value != NULL) {
+    apply_write(key, value, ttl_ms);
+  } else {
+    apply_delete(key);
+  }
+  unlock_keys(kvs_table, 1, keys);
+}
+
+int kvs_open_wal(const char *path, unsigned int sync_ms) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  // kvs_wal is only set after the replay, so replayed changes are not logged again
+  Wal *wal = wal_open(path, replay_from, sync_ms, replay_change, NULL);
+  if (wal == NULL) {
+    return 1;
+  }
+  kvs_wal = wal;
+  // The snapshot loaded is on disk, so the records it holds are not needed
+  if (replay_from != 0 && wal_checkpoint(wal, replay_from) != 0) {
+    fprintf(stderr, "Failed to checkpoint the WAL\n");
+  }
+  return 0;
+}
+
+// Position of the log a snapshot of the table taken now holds every change up
+// to, 0 if there is no log. Must be called with the table locked.
+static uint64_t log_position(void) {
+  return kvs_wal != NULL ? wal_end(kvs_wal) : 0;
+}
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+// Parts of a snapshot being loaded, shared by the threads loading it.
+typedef struct SnapshotLoad {
+  const Snapfile *file;
+  atomic_size_t next_part;  // next part for a thread to claim
+  atomic_int failed;
+} SnapshotLoad;
+
+// A loaded pair with a TTL, whose timer is only set once the index is built.
+typedef struct TimedKey {
+  char key[MAX_STRING_SIZE];
+  unsigned int ttl;
+} TimedKey;
+
+// Keys loaded by one of the threads, sorted at the end to build the index.
+typedef struct LoadedKeys {
+  SnapshotLoad *load;
+  char (*keys)[MAX_STRING_SIZE];
+  size_t num_keys;
+  size_t capacity;
+  TimedKey *timed;
+  size_t num_timed;
+  size_t timed_capacity;
+  size_t part;                      // part being loaded
+  int holding;                      // 1 once the stripe of the part is locked
+  char locked[1][MAX_STRING_SIZE];  // key used to lock it
+} LoadedKeys;
+
+// Keeps a loaded pair with a TTL. Its timer is set after the index is built,
+// so the pair cannot expire before its key is in the index.
+// @return 0 if successful, 1 if memory ran out.
+static int keep_timed(LoadedKeys *loaded, const char *key, unsigned int ttl) {
+  if (loaded->num_timed == loaded->timed_capacity) {
+    size_t capacity = loaded->timed_capacity ? 2 * loaded->timed_capacity : 64;
+    TimedKey *timed = realloc(loaded->timed, capacity * sizeof(TimedKey));
+    if (timed == NULL) {
+      return 1;
     }
+    loaded->timed = timed;
+    loaded->timed_capacity = capacity;
   }
+  strncpy(loaded->timed[loaded->num_timed].key, key, MAX_STRING_SIZE);
+  loaded->timed[loaded->num_timed++].ttl = ttl;
+  return 0;
+}
+
+// Adds a pair of the snapshot to the table. Nothing else uses the table yet,
+// so the index (built at the end), the timers and the log are left alone. The
+// pairs of a part are all in the same stripe, which is locked once for the
+// whole part.
+static void load_pair(const char *key, const char *value, unsigned int ttl, void *arg) {
+  LoadedKeys *loaded = arg;
+  if ((hash(key) & (NUM_STRIPES - 1)) != loaded->part) {
+    atomic_store(&loaded->load->failed, 1);
+    return;
+  }
+  if (!loaded->holding) {
+    strncpy(loaded->locked[0], key, MAX_STRING_SIZE);
+    lock_keys(kvs_table, 1, loaded->locked, 1);
+    loaded->holding = 1;
+  }
+
+  int added = write_pair(kvs_table, key, value);
+  if (added == -1 || (ttl != 0 && keep_timed(loaded, key, ttl) != 0)) {
+    atomic_store(&loaded->load->failed, 1);
+  } else if (added == 1) {
+    strncpy(loaded->keys[loaded->num_keys++], key, MAX_STRING_SIZE);
+  }
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Loads parts of a snapshot until none is left, then sorts the keys loaded.
+static void *load_parts(void *arg) {
+  LoadedKeys *loaded = arg;
+  SnapshotLoad *load = loaded->load;
+  for (;;) {
+    size_t part = atomic_fetch_add(&load->next_part, 1);
+    if (part >= NUM_STRIPES || atomic_load(&load->failed)) {
+      break;
+    }
+
+    size_t needed = loaded->num_keys + snapfile_part_pairs(load->file, part);
+    if (needed > loaded->capacity) {
+      size_t capacity = needed > 2 * loaded->capacity ? needed : 2 * loaded->capacity;
+      char(*keys)[MAX_STRING_SIZE] = realloc(loaded->keys, capacity * MAX_STRING_SIZE);
+      if (keys == NULL) {
+        atomic_store(&load->failed, 1);
+        break;
+      }
+      loaded->keys = keys;
+      loaded->capacity = capacity;
+    }
+    loaded->part = part;
+    loaded->holding = 0;
+    if (snapfile_read_part(load->file, part, load_pair, loaded) != 0) {
+      atomic_store(&load->failed, 1);
+    }
+    if (loaded->holding) {
+      unlock_keys(kvs_table, 1, loaded->locked);
+    }
+  }
+
+  // A memory limit may have evicted some of the pairs. Evictions only remove
+  // pairs of the stripe being written, and each part is one stripe, loaded by
+  // a single thread, so the pairs of these keys cannot change any more
+  if (kvs_memory_limited) {
+    size_t kept = 0;
+    for (size_t i = 0; i < loaded->num_keys; i++) {
+      char value[MAX_STRING_SIZE];
+      if (read_pair(kvs_table, loaded->keys[i], value, sizeof(value)) == 0) {
+        memcpy(loaded->keys[kept++], loaded->keys[i], MAX_STRING_SIZE);
+      }
+    }
+    loaded->num_keys = kept;
+  }
+  key_index_sort(loaded->keys, loaded->num_keys);
+  return NULL;
+}
+
+// Loads every part of a snapshot, in parallel, and builds the index of the
+// keys loaded.
+static int load_snapshot(const Snapfile *file) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_threads = cpus < 1 ? 1 : cpus > NUM_STRIPES ? NUM_STRIPES : (size_t)cpus;
+
+  reserve_pairs(kvs_table, snapfile_pairs(file));
+  SnapshotLoad load = {.file = file};
+  atomic_init(&load.next_part, 0);
+  atomic_init(&load.failed, 0);
+  LoadedKeys loaded[NUM_STRIPES];
+  pthread_t threads[NUM_STRIPES];
+  size_t started = 0;
+  for (size_t i = 0; i < num_threads; i++) {
+    loaded[i] = (LoadedKeys){.load = &load, .keys = NULL, .num_keys = 0, .capacity = 0,
+                             .timed = NULL, .num_timed = 0, .timed_capacity = 0, .holding = 0};
+  }
+  // The first thread is the calling one
+  for (size_t i = 1; i < num_threads; i++, started++) {
+    if (pthread_create(&threads[i], NULL, load_parts, &loaded[i]) != 0) {
+      break;
+    }
+  }
+  load_parts(&loaded[0]);
+  for (size_t i = 1; i <= started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  int result = atomic_load(&load.failed);
+  char(*runs[NUM_STRIPES])[MAX_STRING_SIZE];
+  size_t run_sizes[NUM_STRIPES];
+  for (size_t i = 0; i <= started; i++) {
+    runs[i] = loaded[i].keys;
+    run_sizes[i] = loaded[i].num_keys;
+  }
+  if (result == 0 && key_index_load(kvs_index, started + 1, runs, run_sizes) != 0) {
+    result = 1;
+  }
+
+  for (size_t i = 0; i <= started; i++) {
+    for (size_t j = 0; result == 0 && j < loaded[i].num_timed; j++) {
+      char keys[1][MAX_STRING_SIZE];
+      memcpy(keys[0], loaded[i].timed[j].key, MAX_STRING_SIZE);
+      char value[MAX_STRING_SIZE];
+      lock_keys(kvs_table, 1, keys, 1);
+      // The pair may have been evicted
+      if (read_pair(kvs_table, keys[0], value, sizeof(value)) == 0 &&
+          timer_arm(kvs_timers, keys[0], loaded[i].timed[j].ttl) != 0) {
+        result = 1;
+      }
+      unlock_keys(kvs_table, 1, keys);
+    }
+    free(loaded[i].keys);
+    free(loaded[i].timed);
+  }
+  return result;
+}
+
+// Names the delta of a generation of the snapshot.
+// @return The name, to be freed, NULL if memory ran out.
+static char *delta_name(uint64_t generation) {
+  int len = snprintf(NULL, 0, "%s.%" PRIu64 ".delta", kvs_snapshot_path, generation);
+  char *name = malloc((size_t)len + 1);
+  if (name != NULL) {
+    snprintf(name, (size_t)len + 1, "%s.%" PRIu64 ".delta", kvs_snapshot_path, generation);
+  }
+  return name;
+}
+
+// Applies the deltas that follow the snapshot loaded, in order, until one is
+// missing. Later ones, after a gap, were made on top of changes that are lost.
+// @param applied Incremented for each delta applied.
+// @return 0 if successful, 1 if a delta could not be loaded.
+static int load_deltas(size_t *applied) {
+  for (;;) {
+    char *name = delta_name(backup_generation + 1);
+    if (name == NULL) {
+      return 1;
+    }
+    Snapfile *delta = snapfile_open(name);
+    if (delta == NULL) {
+      free(name);
+      return errno == ENOENT ? 0 : 1;
+    }
+
+    int result = 0;
+    if (!snapfile_is_delta(delta) || snapfile_generation(delta) != backup_generation + 1) {
+      fprintf(stderr, "%s does not follow the snapshot\n", name);
+      result = 1;
+    }
+    for (size_t part = 0; result == 0 && part < NUM_STRIPES; part++) {
+      result = snapfile_read_part(delta, part, replay_change, NULL);
+    }
+    uint64_t wal_position = snapfile_wal_position(delta);
+    snapfile_close(delta);
+    free(name);
+    if (result != 0) {
+      return 1;
+    }
+    backup_generation++;
+    replay_from = wal_position;
+    (*applied)++;
+  }
+}
+
+// Removes the deltas of the snapshot: those that followed it are in it once
+// merged, and any others (older, or after a gap) can never be applied.
+static void remove_deltas(void) {
+  const char *slash = strrchr(kvs_snapshot_path, '/');
+  const char *base = slash != NULL ? slash + 1 : kvs_snapshot_path;
+  size_t base_len = strlen(base);
+  char dir_path[PATH_MAX];
+  if (slash == NULL) {
+    strcpy(dir_path, ".");
+  } else {
+    int dir_len = slash == kvs_snapshot_path ? 1 : (int)(slash - kvs_snapshot_path);
+    snprintf(dir_path, sizeof(dir_path), "%.*s", dir_len, kvs_snapshot_path);
+  }
+
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    // "<snapshot>.<generation>.delta"
+    const char *name = entry->d_name;
+    if (strncmp(name, base, base_len) != 0 || name[base_len] != '.') {
+      continue;
+    }
+    const char *digits = name + base_len + 1;
+    const char *end = digits;
+    while (*end >= '0' && *end <= '9') {
+      end++;
+    }
+    if (end == digits || strcmp(end, ".delta") != 0) {
+      continue;
+    }
+    char delta_path[PATH_MAX];
+    if (snprintf(delta_path, sizeof(delta_path), "%s/%s", dir_path, name) < (int)sizeof(delta_path)) {
+      unlink(delta_path);
+    }
+  }
+  closedir(dir);
+}
+
+int kvs_open_snapshot(const char *path) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  kvs_snapshot_path = strdup(path);
+  if (kvs_snapshot_path == NULL) {
+    return 1;
+  }
+  Snapfile *file = snapfile_open(path);
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      return 1;
+    }
+    // No snapshot yet: the first BACKUP writes it. Deltas are useless without it
+    remove_deltas();
+    return 0;
+  }
+  if (snapfile_is_delta(file)) {
+    fprintf(stderr, "The snapshot is a delta\n");
+    snapfile_close(file);
+    return 1;
+  }
+  int result = load_snapshot(file);
+  backup_generation = snapfile_generation(file);
+  replay_from = snapfile_wal_position(file);
+  snapfile_close(file);
+  size_t applied = 0;
+  if (result != 0 || load_deltas(&applied) != 0) {
+    return 1;
+  }
+
+  // Merges the deltas into a new snapshot, so they are not loaded again
+  if (applied > 0) {
+    char tmp_name[PATH_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%u.tmp", path, atomic_fetch_add(&snapshot_count, 1));
+    lock_table(kvs_table, 0);
+    result = snapfile_write(kvs_table, kvs_timers, backup_generation, replay_from, realtime_ms(),
+                            monotonic_ms(), path, tmp_name);
+    unlock_table(kvs_table);
+    if (result != 0) {
+      // The deltas are still needed
+      fprintf(stderr, "Failed to merge the deltas into the snapshot\n");
+      return 0;
+    }
+  }
+  remove_deltas();
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+              unsigned int ttls[]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
 
-  write_str(fd, "[");
+  lock_keys(kvs_table, num_pairs, keys, 1);
+
+  if (mvcc_recording(kvs_versions)) {
+    record_versions(mvcc_next_version(kvs_versions), num_pairs, keys, 0);
+  }
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+    apply_write(keys[i], values[i], ttls[i]);
+  }
+  uint64_t lsn = log_changes();
+
+  unlock_keys(kvs_table, num_pairs, keys);
+  return wait_logged(lsn);
+}
+
+// Buffers a pair in the format used by READ and SCAN.
+// @param key The key.
+// @param value The value, or KVSERROR.
+static void out_pair(const char *key, const char *value) {
+  char aux[MAX_STRING_SIZE];
+  // Long pairs are cut to MAX_STRING_SIZE - 1 characters, as they always were
+  if (snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", key, value) >= 0) {
+    out_str(aux);
+  }
+}
+
+// Buffers the output of a READ.
+static void read_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+  out_str("[");
+  for (size_t i = 0; i < num_pairs; i++) {
+    char value[MAX_STRING_SIZE];
+    const char *result = "KVSERROR";
+    if (read_pair(kvs_table, keys[i], value, sizeof(value)) == 0) {
+      result = value;
     }
-    write_str(fd, aux);
-    free(result);
+    out_pair(keys[i], result);
+  }
+  out_str("]\n");
+}
+
+// Deletes pairs and buffers the output of a DELETE. Must be called with the
+// stripes of the keys locked for writing.
+// @param version Version of the commit, 0 if no snapshot is open.
+static void delete_pairs(uint64_t version, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+  if (version != 0) {
+    record_versions(version, num_pairs, keys, 1);
+  }
+  int aux = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (apply_delete(keys[i]) != 0) {
+      if (!aux) {
+        out_str("[");
+        aux = 1;
+      }
+      char str[MAX_STRING_SIZE];
+      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
+      out_str(str);
+    }
+  }
+  if (aux) {
+    out_str("]\n");
+  }
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
-  write_str(fd, "]\n");
   
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  // read_pair needs no lock, so READ never waits for writers
+  read_pairs(num_pairs, keys);
+  out_flush(fd);
   return 0;
 }
 
@@ -91,89 +844,1028 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  lock_keys(kvs_table, num_pairs, keys, 1);
+  delete_pairs(mvcc_recording(kvs_versions) ? mvcc_next_version(kvs_versions) : 0, num_pairs, keys);
+  uint64_t lsn = log_changes();
+  unlock_keys(kvs_table, num_pairs, keys);
+  // The output is only written once the stripes are unlocked, and the
+  // changes are in the log
+  int result = wait_logged(lsn);
+  out_flush(fd);
+  return result;
+}
+
+KvsBlock *kvs_begin(void) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return NULL;
+  }
+
+  KvsBlock *block = calloc(1, sizeof(KvsBlock));
+  if (block == NULL) {
+    return NULL;
+  }
+  // With every stripe locked no commit is halfway done, so the snapshot holds
+  // either all the pairs of a commit or none of them
+  lock_table(kvs_table, 1);
+  int failed = mvcc_begin(kvs_versions, &block->snapshot);
+  unlock_table(kvs_table);
+  if (failed) {
+    free(block);
+    return NULL;
+  }
+  return block;
+}
+
+// Finds the pending write of a key in a block.
+// @return The write, NULL if the block did not write the key.
+static BlockWrite *find_block_write(KvsBlock *block, const char *key) {
+  for (size_t i = 0; i < block->num_writes; i++) {
+    if (strcmp(block->writes[i].key, key) == 0) {
+      return &block->writes[i];
+    }
+  }
+  return NULL;
+}
 
+// Reads a key as a block sees it: its own writes, then the table as it was
+// at the snapshot.
+// @param value Buffer of MAX_STRING_SIZE bytes for the value.
+// @return 0 if the key exists, 1 otherwise.
+static int block_lookup(KvsBlock *block, const char *key, char value[MAX_STRING_SIZE]) {
+  BlockWrite *write = find_block_write(block, key);
+  if (write != NULL) {
+    if (!write->deleted) {
+      memcpy(value, write->value, MAX_STRING_SIZE);
+    }
+    return write->deleted;
+  }
+
+  // The table is read first: a commit records the old value before changing
+  // the table, so if this read sees the new value the record is already there
+  int missing = read_pair(kvs_table, key, value, MAX_STRING_SIZE) != 0;
+  int old = mvcc_lookup(kvs_versions, key, block->snapshot, value);
+  return old == -1 ? missing : old;
+}
+
+// Adds or replaces the pending write of a key in a block.
+// @param value The value, NULL to delete the key.
+// @param ttl TTL of the pair in milliseconds, 0 for none.
+// @return 0 if successful, 1 if memory ran out.
+static int block_set(KvsBlock *block, const char *key, const char *value, unsigned int ttl) {
+  BlockWrite *write = find_block_write(block, key);
+  if (write == NULL) {
+    if (block->num_writes == block->capacity) {
+      size_t capacity = block->capacity ? block->capacity * 2 : 8;
+      BlockWrite *writes = realloc(block->writes, capacity * sizeof(BlockWrite));
+      if (writes == NULL) {
+        return 1;
+      }
+      block->writes = writes;
+      block->capacity = capacity;
+    }
+    write = &block->writes[block->num_writes++];
+    strncpy(write->key, key, MAX_STRING_SIZE - 1);
+    write->key[MAX_STRING_SIZE - 1] = '\0';
+  }
+  write->deleted = value == NULL;
+  write->ttl = ttl;
+  if (value != NULL) {
+    strncpy(write->value, value, MAX_STRING_SIZE - 1);
+    write->value[MAX_STRING_SIZE - 1] = '\0';
+  }
+  return 0;
+}
+
+int kvs_block_write(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], unsigned int ttls[]) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (block_set(block, keys[i], values[i], ttls[i]) != 0) {
+      block->failed = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int kvs_block_read(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  out_str("[");
+  for (size_t i = 0; i < num_pairs; i++) {
+    char value[MAX_STRING_SIZE];
+    const char *result = "KVSERROR";
+    if (block_lookup(block, keys[i], value) == 0) {
+      result = value;
+    }
+    out_pair(keys[i], result);
+  }
+  out_str("]\n");
+  out_flush(fd);
+  return 0;
+}
+
+int kvs_block_delete(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   int aux = 0;
+  int failed = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    char value[MAX_STRING_SIZE];
+    if (block_lookup(block, keys[i], value) == 0) {
+      failed |= block_set(block, keys[i], NULL, 0);
+    } else {
       if (!aux) {
-        write_str(fd, "[");
+        out_str("[");
         aux = 1;
       }
       char str[MAX_STRING_SIZE];
       snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      out_str(str);
     }
   }
   if (aux) {
-    write_str(fd, "]\n");
+    out_str("]\n");
+  }
+  out_flush(fd);
+  block->failed |= failed;
+  return failed;
+}
+
+// Closes the snapshot of a block and frees it.
+static void end_block(KvsBlock *block) {
+  mvcc_end(kvs_versions, block->snapshot);
+  free(block->writes);
+  free(block);
+}
+
+int kvs_commit(KvsBlock *block, int fd) {
+  // Committing the writes that were recorded would apply part of the block
+  if (block->failed) {
+    end_block(block);
+    return 1;
+  }
+
+  size_t num_keys = block->num_writes;
+  char (*keys)[MAX_STRING_SIZE] = malloc((num_keys ? num_keys : 1) * MAX_STRING_SIZE);
+  if (keys == NULL) {
+    end_block(block);
+    return 1;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    memcpy(keys[i], block->writes[i].key, MAX_STRING_SIZE);
+  }
+
+  lock_keys(kvs_table, num_keys, keys, 1);
+
+  // First committer wins: if another commit changed a key this block wrote
+  // after the block started, applying it would lose that update
+  int conflict = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    if (mvcc_changed_since(kvs_versions, keys[i], block->snapshot)) {
+      char str[MAX_STRING_SIZE];
+      snprintf(str, MAX_STRING_SIZE, "(%s,KVSCONFLICT)", keys[i]);
+      if (!conflict) {
+        out_str("[");
+        conflict = 1;
+      }
+      out_str(str);
+    }
+  }
+
+  if (!conflict) {
+    // This block's snapshot is still open, so other blocks may need the old values
+    record_versions(mvcc_next_version(kvs_versions), num_keys, keys, 0);
+    for (size_t i = 0; i < num_keys; i++) {
+      if (block->writes[i].deleted) {
+        apply_delete(keys[i]);
+      } else {
+        apply_write(keys[i], block->writes[i].value, block->writes[i].ttl);
+      }
+    }
+  }
+  uint64_t lsn = log_changes();
+
+  unlock_keys(kvs_table, num_keys, keys);
+  free(keys);
+  end_block(block);
+
+  if (conflict) {
+    out_str("]\n");
+  }
+  int result = wait_logged(lsn);
+  out_flush(fd);
+  return result;
+}
+
+void kvs_abort(KvsBlock *block) {
+  end_block(block);
+}
+
+KvsMulti *kvs_multi(void) {
+  return calloc(1, sizeof(KvsMulti));
+}
+
+// Makes room for more keys in a transaction.
+// @return 0 if successful, 1 if memory ran out.
+static int multi_reserve(KvsMulti *multi, size_t num_keys) {
+  if (multi->num_keys + num_keys <= multi->keys_capacity) {
+    return 0;
+  }
+  size_t capacity = multi->keys_capacity ? multi->keys_capacity : 16;
+  while (capacity < multi->num_keys + num_keys) {
+    capacity *= 2;
+  }
+  char (*keys)[MAX_STRING_SIZE] = realloc(multi->keys, capacity * MAX_STRING_SIZE);
+  if (keys == NULL) {
+    return 1;
+  }
+  multi->keys = keys;
+  char (*values)[MAX_STRING_SIZE] = realloc(multi->values, capacity * MAX_STRING_SIZE);
+  if (values == NULL) {
+    return 1;
+  }
+  multi->values = values;
+  unsigned int *ttls = realloc(multi->ttls, capacity * sizeof(unsigned int));
+  if (ttls == NULL) {
+    return 1;
+  }
+  multi->ttls = ttls;
+  multi->keys_capacity = capacity;
+  return 0;
+}
+
+int kvs_watch(KvsMulti *multi, size_t num_keys, char keys[][MAX_STRING_SIZE]) {
+  if (multi->num_commands > 0) {
+    return 1;
+  }
+  if (multi_reserve(multi, num_keys) != 0) {
+    multi->failed = 1;
+    return 1;
+  }
+  unsigned int *counts = realloc(multi->watched_counts, (multi->num_watched + num_keys) * sizeof(unsigned int));
+  if (counts == NULL) {
+    multi->failed = 1;
+    return 1;
+  }
+  multi->watched_counts = counts;
+
+  for (size_t i = 0; i < num_keys; i++) {
+    memcpy(multi->keys[multi->num_watched], keys[i], MAX_STRING_SIZE);
+    multi->watched_counts[multi->num_watched++] = atomic_load(&change_count[hash(keys[i]) % CHANGE_SLOTS]);
+  }
+  multi->num_keys = multi->num_watched;
+  return 0;
+}
+
+// Adds a command to the queue of a transaction.
+// @param values Values of a WRITE, NULL for the other commands.
+// @param ttls TTLs of a WRITE, NULL for the other commands.
+// @return 0 if successful, 1 if memory ran out.
+static int multi_queue(KvsMulti *multi, int type, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE], unsigned int ttls[]) {
+  if (multi_reserve(multi, num_pairs) != 0) {
+    multi->failed = 1;
+    return 1;
+  }
+  if (multi->num_commands == multi->commands_capacity) {
+    size_t capacity = multi->commands_capacity ? multi->commands_capacity * 2 : 8;
+    QueuedCommand *commands = realloc(multi->commands, capacity * sizeof(QueuedCommand));
+    if (commands == NULL) {
+      multi->failed = 1;
+      return 1;
+    }
+    multi->commands = commands;
+    multi->commands_capacity = capacity;
+  }
+
+  QueuedCommand *command = &multi->commands[multi->num_commands++];
+  command->type = type;
+  command->num_pairs = num_pairs;
+  command->first = multi->num_keys;
+  for (size_t i = 0; i < num_pairs; i++) {
+    memcpy(multi->keys[multi->num_keys], keys[i], MAX_STRING_SIZE);
+    if (values != NULL) {
+      memcpy(multi->values[multi->num_keys], values[i], MAX_STRING_SIZE);
+      multi->ttls[multi->num_keys] = ttls[i];
+    }
+    multi->num_keys++;
+  }
+  return 0;
+}
+
+int kvs_multi_write(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], unsigned int ttls[]) {
+  return multi_queue(multi, QUEUED_WRITE, num_pairs, keys, values, ttls);
+}
+
+int kvs_multi_read(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+  return multi_queue(multi, QUEUED_READ, num_pairs, keys, NULL, NULL);
+}
+
+int kvs_multi_delete(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+  return multi_queue(multi, QUEUED_DELETE, num_pairs, keys, NULL, NULL);
+}
+
+int kvs_exec(KvsMulti *multi, int fd) {
+  // Running the commands that were queued would apply part of the transaction
+  if (multi->failed) {
+    kvs_discard(multi);
+    return 1;
+  }
+
+  // Only the stripes of the keys involved are locked, so transactions on
+  // disjoint keys commit in parallel
+  lock_keys(kvs_table, multi->num_keys, multi->keys, 1);
+
+  // The counters only change with their stripe locked, so they cannot change
+  // between this check and the commands
+  int changed = 0;
+  for (size_t i = 0; i < multi->num_watched; i++) {
+    if (atomic_load(&change_count[hash(multi->keys[i]) % CHANGE_SLOTS]) != multi->watched_counts[i]) {
+      char str[MAX_STRING_SIZE];
+      snprintf(str, MAX_STRING_SIZE, "(%s,KVSCONFLICT)", multi->keys[i]);
+      if (!changed) {
+        out_str("[");
+        changed = 1;
+      }
+      out_str(str);
+    }
+  }
+
+  if (changed) {
+    out_str("]\n");
+  } else {
+    // The whole transaction is one commit for the open snapshots
+    uint64_t version = mvcc_recording(kvs_versions) ? mvcc_next_version(kvs_versions) : 0;
+    for (size_t c = 0; c < multi->num_commands; c++) {
+      QueuedCommand *command = &multi->commands[c];
+      char (*keys)[MAX_STRING_SIZE] = &multi->keys[command->first];
+      switch (command->type) {
+        case QUEUED_WRITE:
+          if (version != 0) {
+            record_versions(version, command->num_pairs, keys, 0);
+          }
+          for (size_t i = 0; i < command->num_pairs; i++) {
+            apply_write(keys[i], multi->values[command->first + i], multi->ttls[command->first + i]);
+          }
+          break;
+        case QUEUED_READ:
+          read_pairs(command->num_pairs, keys);
+          break;
+        case QUEUED_DELETE:
+          delete_pairs(version, command->num_pairs, keys);
+          break;
+      }
+    }
+  }
+
+  uint64_t lsn = log_changes();
+  unlock_keys(kvs_table, multi->num_keys, multi->keys);
+  kvs_discard(multi);
+  int result = wait_logged(lsn);
+  out_flush(fd);
+  return result;
+}
+
+void kvs_discard(KvsMulti *multi) {
+  free(multi->watched_counts);
+  free(multi->commands);
+  free(multi->keys);
+  free(multi->values);
+  free(multi->ttls);
+  free(multi);
+}
+
+int kvs_scan(const char *start, const char *end, int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  // The index lock is only held while copying a batch of keys, the values are
+  // then read like READ does (a key deleted meanwhile is left out)
+  size_t prefix_len = strlen(start);
+  char from[MAX_STRING_SIZE];
+  strcpy(from, start);
+  int skip_from = 0;
+  int done = 0;
+  out_str("[");
+  while (!done) {
+    char keys[SCAN_BATCH][MAX_STRING_SIZE];
+    size_t num_keys = key_index_scan(kvs_index, from, skip_from, keys, SCAN_BATCH);
+    done = num_keys < SCAN_BATCH;
+    for (size_t i = 0; i < num_keys; i++) {
+      if (end != NULL ? strcmp(keys[i], end) > 0 : strncmp(keys[i], start, prefix_len) != 0) {
+        done = 1;
+        break;
+      }
+      char value[MAX_STRING_SIZE];
+      if (read_pair(kvs_table, keys[i], value, sizeof(value)) == 0) {
+        out_pair(keys[i], value);
+      }
+    }
+    if (num_keys > 0) {
+      strcpy(from, keys[num_keys - 1]);
+      skip_from = 1;
+    }
+  }
+  out_str("]\n");
+  out_flush(fd);
   return 0;
 }
 
+// Buffers a pair in the format used by SHOW.
+// @param key The key.
+// @param value The value.
+// @param arg Unused.
+static void show_pair(const char *key, const char *value, void *arg) {
+  (void)arg;
+  char aux[MAX_STRING_SIZE];
+  snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", key, value);
+  out_str(aux);
+}
+
 void kvs_show(int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
   
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
-  
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+  // Writers keep running: SHOW lists the pairs as they were when it started
+  if (snapshot_pairs(kvs_table, show_pair, NULL) != 0) {
+    // Some pairs could not be copied, so the listing would be incomplete
+    fprintf(stderr, "Failed to copy the KVS state\n");
+    out_discard();
+    out_str("KVSERROR\n");
+  }
+  out_flush(fd);
+}
+
+// Formats a pair as a line of a backup file. Only uses async signal safe
+// functions, so it can run in the forked child.
+// @param line Buffer of BACKUP_LINE bytes.
+// @param key The key.
+// @param value The value.
+// @return Length of the line.
+static size_t format_backup_line(char line[BACKUP_LINE], const char *key, const char *value) {
+  line[0] = '(';
+  size_t num_bytes_copied = 1; // the "("
+  // the - 1 are all to leave space for the '/0'
+  num_bytes_copied += strn_memcpy(line + num_bytes_copied,
+                                  key, BACKUP_LINE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(line + num_bytes_copied,
+                                  ", ", BACKUP_LINE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(line + num_bytes_copied,
+                                  value, BACKUP_LINE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(line + num_bytes_copied,
+                                  ")\n", BACKUP_LINE - num_bytes_copied - 1);
+  line[num_bytes_copied] = '\0';
+  return num_bytes_copied;
+}
+
+// Adds a pair to a backup. Runs in the forked child, so it only uses async
+// signal safe functions.
+// @param key The key.
+// @param value The value.
+// @param arg The BackupStream of the backup.
+static void backup_pair(const char *key, const char *value, void *arg) {
+  char line[BACKUP_LINE];
+  bck_put(arg, line, format_backup_line(line, key, value));
+}
+
+// Written by the child forked by BACKUP only, so it is static rather than
+// allocated.
+static BackupStream child_stream;
+
+// Starts the writers of the backup file of the child forked by BACKUP, the
+// stream of which is already created. Each writes a part of the table through
+// its copy of the stream. Runs in the child, so it only uses async signal safe
+// functions.
+// @param writers Where to store the pids of the writers.
+// @return Number of writers started, kvs_backup_writers unless fork failed.
+static unsigned int start_backup_writers(pid_t writers[MAX_BACKUP_WRITERS]) {
+  for (unsigned int i = 0; i < kvs_backup_writers; i++) {
+    writers[i] = fork();
+    if (writers[i] == 0) {
+      iterate_part(kvs_table, i, kvs_backup_writers, backup_pair, &child_stream);
+      _exit(bck_flush(&child_stream));
+    }
+    if (writers[i] < 0) {
+      write_str(STDERR_FILENO, "Failed to fork a backup writer\n");
+      return i;
+    }
+  }
+  return kvs_backup_writers;
+}
+
+// Waits for the writers started by start_backup_writers.
+// @return 0 if all of them wrote their part, 1 otherwise.
+static int wait_backup_writers(const pid_t *writers, unsigned int num_writers) {
+  int failed = 0;
+  for (unsigned int i = 0; i < num_writers; i++) {
+    int status;
+    while (waitpid(writers[i], &status, 0) < 0) {
+      if (errno != EINTR) {
+        return 1;
+      }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+// A pair changed since the last BACKUP, copied for a delta.
+typedef struct ChangedPair {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  unsigned int ttl;  // 0 for none
+  int deleted;       // 1 if the pair was deleted, in which case value is unused
+} ChangedPair;
+
+// Changes copied for a delta BACKUP.
+typedef struct ChangeCopy {
+  ChangedPair *changes;
+  size_t num_changes;
+} ChangeCopy;
+
+static void copy_change(const char *key, void *arg) {
+  ChangeCopy *copy = arg;
+  ChangedPair *change = &copy->changes[copy->num_changes++];
+  strncpy(change->key, key, MAX_STRING_SIZE);
+  change->deleted = read_pair(kvs_table, key, change->value, sizeof(change->value)) != 0;
+  change->ttl = change->deleted ? 0 : timer_remaining(kvs_timers, key);
+}
+
+// Must be called with the table and backup_lock locked. A full BACKUP whose
+// child is not forked yet will hold the changes made until then, so a delta
+// taken now could go on top of a newer table and undo them.
+// @return 1 if the next BACKUP can be a delta.
+static int next_is_delta(void) {
+  return kvs_dirty != NULL && have_full_backup && deltas_since_full < kvs_max_deltas &&
+         forks_waiting == 0 && !dirty_lost(kvs_dirty);
+}
+
+// Copies the pairs changed since the last BACKUP, if this one can be a delta,
+// and starts tracking the changes for the next one. Must be called with the
+// table and backup_lock locked.
+// @param num_changes Where to store the number of pairs copied.
+// @return The pairs, in stripe order, to be freed, NULL if the BACKUP must be
+//         full.
+static ChangedPair *take_changes(size_t *num_changes) {
+  if (kvs_dirty == NULL) {
+    return NULL;
+  }
+  if (next_is_delta()) {
+    size_t count = dirty_count(kvs_dirty);
+    ChangeCopy copy = {malloc((count > 0 ? count : 1) * sizeof(ChangedPair)), 0};
+    if (copy.changes != NULL) {
+      dirty_take(kvs_dirty, copy_change, &copy);
+      *num_changes = copy.num_changes;
+      deltas_since_full++;
+      return copy.changes;
+    }
+  }
+  dirty_take(kvs_dirty, NULL, NULL);
+  return NULL;
+}
+
+// Writes a delta BACKUP, in the calling thread.
+// @return 0 if successful, -1 otherwise.
+static int write_delta(const char *bck_name, uint64_t generation, uint64_t wal_position,
+                       const ChangedPair *changes, size_t num_changes) {
+  BackupStream *stream = malloc(sizeof(BackupStream));
+  if (stream == NULL || bck_create(stream, bck_name, kvs_compress_backups) != 0) {
+    perror("Failed to open the backup file");
+    free(stream);
+    return -1;
+  }
+  for (size_t i = 0; i < num_changes; i++) {
+    backup_pair(changes[i].key, changes[i].deleted ? "DELETED" : changes[i].value, stream);
+  }
+  int failed = bck_close(stream);
+  free(stream);
+  if (failed) {
+    fprintf(stderr, "Failed to write the backup file\n");
+    return -1;
+  }
+
+  if (kvs_snapshot_path == NULL) {
+    return 0;
+  }
+  char *name = delta_name(generation);
+  char tmp_name[PATH_MAX];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%u.tmp", kvs_snapshot_path,
+           atomic_fetch_add(&snapshot_count, 1));
+  SnapfileWriter *writer = name != NULL ? snapfile_create(SNAPFILE_DELTA, generation, wal_position, tmp_name) : NULL;
+  int result = 1;
+  if (writer != NULL) {
+    for (size_t i = 0; i < num_changes; i++) {
+      snapfile_add(writer, changes[i].key, changes[i].deleted ? NULL : changes[i].value,
+                   changes[i].ttl);
+    }
+    result = snapfile_commit(writer, name);
+  }
+  free(name);
+  if (result != 0) {
+    fprintf(stderr, "Failed to write the delta snapshot\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Tags the pairs copied by a snapshot with when they expire, so the backup
+// thread writes the TTLs they had when the BACKUP was made.
+static uint64_t snapshot_expiry(const char *key, void *arg) {
+  (void)arg;
+  return timer_deadline(kvs_timers, key);
+}
+
+// A full BACKUP being written by the backup thread.
+typedef struct FullBackup {
+  BackupStream *stream;      // NULL if the backup file could not be created
+  SnapfileWriter *snapshot;  // NULL if there is no binary snapshot
+  uint64_t now_ms;           // CLOCK_MONOTONIC, for the TTLs
+} FullBackup;
+
+static void write_backup_pair(const char *key, const char *value, uint64_t expiry, void *arg) {
+  FullBackup *backup = arg;
+  if (backup->stream != NULL) {
+    backup_pair(key, value, backup->stream);
+  }
+
+  if (backup->snapshot != NULL) {
+    if (expiry == 0) {
+      snapfile_add(backup->snapshot, key, value, 0);
+    } else if (expiry > backup->now_ms) {
+      uint64_t ttl = expiry - backup->now_ms;
+      snapfile_add(backup->snapshot, key, value, ttl < UINT_MAX ? (unsigned int)ttl : UINT_MAX);
+    }
+    // Pairs that ran out since the BACKUP are left out of the binary snapshot
+  }
+}
+
+// Walks the snapshot of a full BACKUP, writing its backup file and its binary
+// snapshot.
+static void write_full_backup(BackupTask *task) {
+  FullBackup backup = {.stream = malloc(sizeof(BackupStream)), .snapshot = NULL,
+                       .now_ms = monotonic_ms()};
+  if (backup.stream == NULL || bck_create(backup.stream, task->bck_name, kvs_compress_backups) != 0) {
+    perror("Failed to open the backup file");
+    free(backup.stream);
+    backup.stream = NULL;
+  }
+  if (kvs_snapshot_path != NULL) {
+    backup.snapshot = snapfile_create(SNAPFILE_FULL, task->generation, task->wal_position,
+                                      task->tmp_name);
+    if (backup.snapshot == NULL) {
+      fprintf(stderr, "Failed to write the snapshot\n");
+    }
+  }
+
+  // The snapshot must be walked to its end even if nothing can be written
+  if (snapshot_walk(kvs_table, task->snapshot, write_backup_pair, &backup) != 0) {
+    fprintf(stderr, "Failed to copy the KVS state\n");
+  }
+  if (backup.stream != NULL) {
+    if (bck_close(backup.stream) != 0) {
+      fprintf(stderr, "Failed to write the backup file\n");
+    }
+    free(backup.stream);
+  }
+  if (backup.snapshot != NULL) {
+    if (snapfile_commit(backup.snapshot, kvs_snapshot_path) != 0) {
+      fprintf(stderr, "Failed to write the snapshot\n");
+    } else {
+      for (size_t i = 0; i < task->num_obsolete; i++) {
+        unlink(task->obsolete[i]);
+      }
     }
   }
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Drops the log records held by the snapshot on disk.
+static void checkpoint_wal(void) {
+  SnapfileHeader header;
+  if (snapfile_read_header(kvs_snapshot_path, &header) != 0 || header.wal_position == 0) {
+    return;
+  }
+  if (wal_checkpoint(kvs_wal, header.wal_position) != 0) {
+    fprintf(stderr, "Failed to checkpoint the WAL\n");
+  }
+}
+
+// Called once a full BACKUP is written (or failed). While others are being
+// written, one that holds fewer changes may still replace the snapshot on
+// disk, so the log is only checkpointed once none is left. Only called by
+// the thread that ends the full BACKUPs, so checkpoints never overlap.
+static void full_backup_done(void) {
+  pthread_mutex_lock(&backup_lock);
+  int last = --fulls_pending == 0;
+  pthread_mutex_unlock(&backup_lock);
+  if (last && kvs_wal != NULL && kvs_snapshot_path != NULL) {
+    checkpoint_wal();
+  }
+}
+
+static void free_backup_task(BackupTask *task) {
+  for (size_t i = 0; i < task->num_obsolete; i++) {
+    free(task->obsolete[i]);
+  }
+  free(task->obsolete);
+  free(task);
+}
+
+static void *run_backup_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&backup_thread.lock);
+    while ((backup_thread.head == NULL || !backup_thread.head->started) && !backup_thread.stop) {
+      pthread_cond_wait(&backup_thread.wake, &backup_thread.lock);
+    }
+    BackupTask *task = backup_thread.head;
+    if (task != NULL && !task->started) {
+      task = NULL;
+    }
+    if (task != NULL) {
+      backup_thread.head = task->next;
+      if (backup_thread.head == NULL) {
+        backup_thread.tail = NULL;
+      }
+    }
+    pthread_mutex_unlock(&backup_thread.lock);
+    if (task == NULL) {
+      return NULL;
+    }
+    write_full_backup(task);
+    free_backup_task(task);
+    full_backup_done();
+    pthread_mutex_lock(&backup_thread.lock);
+    backup_thread.pending--;
+    pthread_cond_broadcast(&backup_thread.done);
+    pthread_mutex_unlock(&backup_thread.lock);
+  }
 }
 
-int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory, strtok(job_filename, "."),
-           num_backup);
+int kvs_start_backup_thread(void) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  set_snapshot_expiry(kvs_table, snapshot_expiry, NULL);
+  if (pthread_create(&backup_thread.thread, NULL, run_backup_thread, NULL) != 0) {
+    return 1;
+  }
+  backup_thread.running = 1;
+  return 0;
+}
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Forks the child of a full BACKUP, which writes the table as it is now and
+// the TTLs from when BACKUP ran. Must be called with backup_lock held and the
+// table locked, so no writer is halfway through changing it when it is copied.
+// The child sets child_mask as its signal mask, unless it is NULL.
+static pid_t fork_backup(BackupTask *task, const sigset_t *child_mask) {
+  task->wal_position = log_position();
+  pid_t pid = fork();
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->key, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ", ", MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->value, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
-      }
-    }
-    exit(1);
-  } else if (pid < 0) {
+    if (child_mask != NULL) {
+      sigprocmask(SIG_SETMASK, child_mask, NULL);
+    }
+    int failed = 0;
+    int created = bck_create(&child_stream, task->bck_name, kvs_compress_backups) == 0;
+    pid_t writers[MAX_BACKUP_WRITERS];
+    unsigned int num_writers = 0;
+    int parts_failed = 0;
+    if (!created) {
+      write_str(STDERR_FILENO, "Failed to open the backup file\n");
+      failed = 1;
+    } else if (kvs_backup_writers > 1) {
+      // The binary snapshot is written while the writers write the backup
+      num_writers = start_backup_writers(writers);
+      parts_failed = num_writers < kvs_backup_writers;
+    } else {
+      iterate_pairs(kvs_table, backup_pair, &child_stream);
+    }
+    if (kvs_snapshot_path != NULL) {
+      if (snapfile_write(kvs_table, kvs_timers, task->generation, task->wal_position,
+                         task->real_ms, task->mono_ms, kvs_snapshot_path, task->tmp_name) != 0) {
+        write_str(STDERR_FILENO, "Failed to write the snapshot\n");
+        failed = 1;
+      } else {
+        for (size_t i = 0; i < task->num_obsolete; i++) {
+          unlink(task->obsolete[i]);
+        }
+      }
+    }
+    if (created) {
+      // The backup is only ended once every part of it is in the file, so a
+      // part missing leaves it cut short
+      if (wait_backup_writers(writers, num_writers) != 0 || parts_failed) {
+        child_stream.failed = 1;
+      }
+      if (bck_close(&child_stream) != 0) {
+        write_str(STDERR_FILENO, "Failed to write the backup file\n");
+        failed = 1;
+      }
+    }
+    // _exit, so the stdio buffers copied from the parent are not flushed twice
+    _exit(failed);
+  }
+  if (pid < 0) {
+    // The deltas after it would have no full BACKUP to go on top of
+    have_full_backup = 0;
+    perror("Failed to fork");
+  }
+  return pid;
+}
+
+// Forks the child of a queued full BACKUP, once the scheduler gives it its
+// turn, so it holds the table as it is then.
+static pid_t spawn_backup(void *request, const sigset_t *child_mask) {
+  pthread_mutex_lock(&backup_lock);
+  lock_table(kvs_table, 0);
+  pid_t pid = fork_backup(request, child_mask);
+  forks_waiting--;
+  unlock_table(kvs_table);
+  pthread_mutex_unlock(&backup_lock);
+  return pid;
+}
+// Reports a full BACKUP whose child failed, once it ended, and frees it.
+static void end_backup(void *request, int failed) {
+  BackupTask *task = request;
+  if (failed) {
+    fprintf(stderr, "Failed to write backup %s\n", task->bck_name);
+  }
+  free_backup_task(task);
+  full_backup_done();
+}
+
+int kvs_backup(size_t num_backup, const char *job_filename, const char *directory) {
+  if (kvs_backups == NULL && !backup_thread.running) {
+    fprintf(stderr, "The backup scheduler must be started\n");
     return -1;
   }
+
+  BackupTask *task = malloc(sizeof(BackupTask));
+  if (task == NULL) {
+    return -1;
+  }
+  task->next = NULL;
+  task->snapshot = NULL;
+  task->started = 0;
+  task->obsolete = NULL;
+  task->num_obsolete = 0;
+  // A queued child only copies the table later, but its TTLs count from now
+  task->real_ms = realtime_ms();
+  task->mono_ms = monotonic_ms();
+  // The job name is shared with the job's thread, so it is only read
+  int stem_len = (int)strcspn(job_filename, ".");
+  snprintf(task->bck_name, sizeof(task->bck_name), "%s/%.*s-%zu.%s", directory, stem_len,
+           job_filename, num_backup, kvs_compress_backups ? "bckz" : "bck");
+  // Named before the fork, since snprintf is not async signal safe
+  if (kvs_snapshot_path != NULL) {
+    snprintf(task->tmp_name, sizeof(task->tmp_name), "%s.%u.tmp", kvs_snapshot_path,
+             atomic_fetch_add(&snapshot_count, 1));
+  }
+
+  // A full BACKUP written by a child needs a place among the running children
+  // or in the scheduler's queue, and one written by the backup thread a
+  // snapshot, both waited for with nothing locked. A child is only forked
+  // right away when no other full BACKUP waits for its fork, so they are
+  // forked in the order of their generations.
+  if (backup_thread.running) {
+    task->snapshot = snapshot_reserve(kvs_table);
+  }
+  int start_now = 0;
+  int reserved = 0;
+  for (;;) {
+    pthread_mutex_lock(&backup_lock);
+    lock_table(kvs_table, 0);
+    if (backup_thread.running || next_is_delta()) {
+      break;
+    }
+    if (forks_waiting == 0 && backup_try_start(kvs_backups) == 0) {
+      start_now = 1;
+      break;
+    }
+    if (backup_try_reserve(kvs_backups) == 0) {
+      reserved = 1;
+      break;
+    }
+    unlock_table(kvs_table);
+    pthread_mutex_unlock(&backup_lock);
+    backup_wait_room(kvs_backups);
+  }
+
+  task->generation = ++backup_generation;
+  task->wal_position = log_position();
+  size_t num_changes = 0;
+  ChangedPair *changes = take_changes(&num_changes);
+  if (changes != NULL) {
+    // Only the changes are copied, so the table is unlocked before writing them
+    unlock_table(kvs_table);
+    pthread_mutex_unlock(&backup_lock);
+    if (task->snapshot != NULL) {
+      snapshot_cancel(kvs_table, task->snapshot);
+    }
+    int result = write_delta(task->bck_name, task->generation, task->wal_position, changes,
+                             num_changes);
+    free(changes);
+    free_backup_task(task);
+    return result;
+  }
+  // Memory ran out for the copy of a delta, so it has to be full after all
+  if (!backup_thread.running && !start_now && !reserved) {
+    if (forks_waiting == 0 && backup_try_start(kvs_backups) == 0) {
+      start_now = 1;
+    } else if (backup_try_reserve(kvs_backups) == 0) {
+      reserved = 1;
+    } else {
+      // The changes were dropped, so the next BACKUP cannot be a delta either
+      have_full_backup = 0;
+      unlock_table(kvs_table);
+      pthread_mutex_unlock(&backup_lock);
+      free_backup_task(task);
+      return -1;
+    }
+  }
+  // The table is only copied when the BACKUP is started, or now by its child
+  if (!start_now) {
+    unlock_table(kvs_table);
+  }
+
+  // The deltas written since the last full snapshot are removed once the new
+  // one is in place
+  if (kvs_snapshot_path != NULL && deltas_since_full > 0 &&
+      (task->obsolete = malloc(deltas_since_full * sizeof(char *))) != NULL) {
+    while (task->num_obsolete < deltas_since_full &&
+           (task->obsolete[task->num_obsolete] =
+                delta_name(task->generation - 1 - task->num_obsolete)) != NULL) {
+      task->num_obsolete++;
+    }
+  }
+  have_full_backup = 1;
+  deltas_since_full = 0;
+  fulls_pending++;
+
+  if (backup_thread.running) {
+    // Queued in the order of the generations, then started with backup_lock
+    // released. Writes made before the snapshot starts are also in the next
+    // delta, which does no harm.
+    pthread_mutex_lock(&backup_thread.lock);
+    if (backup_thread.tail != NULL) {
+      backup_thread.tail->next = task;
+    } else {
+      backup_thread.head = task;
+    }
+    backup_thread.tail = task;
+    backup_thread.pending++;
+    pthread_mutex_unlock(&backup_thread.lock);
+    pthread_mutex_unlock(&backup_lock);
+
+    snapshot_begin(kvs_table, task->snapshot);
+    pthread_mutex_lock(&backup_thread.lock);
+    task->started = 1;
+    pthread_cond_signal(&backup_thread.wake);
+    pthread_mutex_unlock(&backup_thread.lock);
+    return 0;
+  }
+
+  if (start_now) {
+    pid_t pid = fork_backup(task, NULL);
+    unlock_table(kvs_table);
+    if (pid < 0) {
+      fulls_pending--;
+    }
+    pthread_mutex_unlock(&backup_lock);
+    backup_started(kvs_backups, pid, task);
+    if (pid < 0) {
+      free_backup_task(task);
+      return -1;
+    }
+    return 0;
+  }
+
+  // Queued in the order of the generations; the job moves on, and the child
+  // is forked once fewer than max_backups are running (see spawn_backup)
+  forks_waiting++;
+  backup_submit(kvs_backups, task);
+  pthread_mutex_unlock(&backup_lock);
   return 0;
 }
 
+void kvs_wait_backup() {
+  if (kvs_backups != NULL) {
+    backup_drain(kvs_backups);
+  }
+  pthread_mutex_lock(&backup_thread.lock);
+  while (backup_thread.pending > 0) {
+    pthread_cond_wait(&backup_thread.done, &backup_thread.lock);
+  }
+  pthread_mutex_unlock(&backup_thread.lock);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -184,15 +1876,20 @@ int kvs_subscribe(const char *key, int pipeNoti) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  // Dar lock a hash e adicionar o pipeNoti do cliente a respetiva key
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  char keys[1][MAX_STRING_SIZE];
+  strncpy(keys[0], key, MAX_STRING_SIZE - 1);
+  keys[0][MAX_STRING_SIZE - 1] = '\0';
+
+  // Dar lock a stripe da key e adicionar o pipeNoti do cliente a respetiva key
+  lock_keys(kvs_table, 1, keys, 1);
   
   // Chama a funcao subscribe verificando se deu erro
-  if (subscribe(kvs_table, key, pipeNoti) != 0) {
+  int result = subscribe(kvs_table, keys[0], pipeNoti);
+  unlock_keys(kvs_table, 1, keys);
+  if (result != 0) {
     fprintf(stderr, "Failed to subscribe client to key: %s\n", key);
     return 1;
   }
-  pthread_rwlock_unlock(&kvs_table->tablelock);
   
   return 0;
 }
@@ -202,15 +1899,20 @@ int kvs_unsubscribe(const char *key, int pipeNoti) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  // Dar lock a hash e remover o pipeNoti do cliente da respetiva key
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  char keys[1][MAX_STRING_SIZE];
+  strncpy(keys[0], key, MAX_STRING_SIZE - 1);
+  keys[0][MAX_STRING_SIZE - 1] = '\0';
+
+  // Dar lock a stripe da key e remover o pipeNoti do cliente da respetiva key
+  lock_keys(kvs_table, 1, keys, 1);
 
   // Chama a funcao unsubscribe verificando se deu erro
-  if (unsubscribe(kvs_table, key, pipeNoti) != 0) {
+  int result = unsubscribe(kvs_table, keys[0], pipeNoti);
+  unlock_keys(kvs_table, 1, keys);
+  if (result != 0) {
     fprintf(stderr, "Failed to unsubscribe client to key: %s\n", key);
     return 1;
   }
-  pthread_rwlock_unlock(&kvs_table->tablelock);
 
   return 0;
 }
@@ -221,9 +1923,9 @@ int kvs_disconnect(int pipeNoti) {
     return 1;
   }
   // Da lock a hash e remover todas as keys de um cliente da hash
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  lock_table(kvs_table, 1);
   disconnect(kvs_table, pipeNoti);
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_table(kvs_table);
   return 0;
 }
 
@@ -233,9 +1935,9 @@ int kvs_clean_subscriptions() {
     return 1;
   }
   // Da lock a hash e remover todos os clientes
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  lock_table(kvs_table, 1);
   clean_subscriptions(kvs_table);
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_table(kvs_table);
   return 0;
 }
 
@@ -4,20 +4,100 @@
 #include <stddef.h>
 #include "constants.h"
 
+#define MAX_BACKUP_WRITERS 64  // processes writing each forked BACKUP, at most
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Limits the memory used by the KVS pairs; past it, pairs are evicted
+/// (approximate LRU) and their subscribers notified. Call after kvs_init,
+/// before any job runs.
+/// @param max_bytes Budget in bytes, 0 for no limit.
+/// @return 0 if the limit was set, 1 otherwise.
+int kvs_set_memory_limit(size_t max_bytes);
+
+/// Replays a write-ahead log into the table, creating it if needed, and logs
+/// every change made from then on (see wal.h). Only the records after those
+/// the snapshot loaded holds are replayed, and the others are dropped, as
+/// they are again each time no full BACKUP is left being written. Must be
+/// called before the jobs start.
+/// @param path Path of the log.
+/// @param sync_ms 0 to fsync each change before the command ends, otherwise
+///                how often the log is fsynced, in milliseconds.
+/// @return 0 if the log was opened, 1 otherwise.
+int kvs_open_wal(const char *path, unsigned int sync_ms);
+
+/// Lets up to max_deltas BACKUPs after each full one be deltas, which only
+/// write the pairs changed since the BACKUP before them. A delta BACKUP lists
+/// the pairs changed in its backup file, deleted ones as "(key, DELETED)",
+/// and writes them to "<snapshot>.<generation>.delta" next to the binary
+/// snapshot, if there is one. The first BACKUP after startup is always full.
+/// Must be called before kvs_open_snapshot.
+/// @param max_deltas Number of deltas allowed between full BACKUPs.
+/// @return 0 if successful, 1 if memory ran out.
+int kvs_set_delta_backups(unsigned int max_deltas);
+
+/// Makes full BACKUPs be written by a background thread instead of a forked
+/// child. The job thread only starts a snapshot of the table (see
+/// snapshot_begin in kvs.h), which the thread then walks while the jobs keep
+/// running, so no page tables are copied and writers only wait, once per
+/// BACKUP, for the copy of the stripe they write to. Each BACKUP queued has a
+/// snapshot of its own, so SHOW and the BACKUPs after it never wait for it to
+/// be written; a BACKUP only waits once MAX_SNAPSHOTS (see kvs_common.h)
+/// snapshots are open. Must be called before the jobs start.
+/// @return 0 if the thread was started, 1 otherwise.
+int kvs_start_backup_thread(void);
+
+/// Makes BACKUP write compressed backups, "<job>-<n>.bckz", with the same
+/// text as a ".bck" split in checksummed LZ-compressed blocks (see
+/// bckfile.h), which bckcat checks or decompresses. Must be called before the
+/// jobs start.
+/// @param compress 1 for compressed backups, 0 for text ones (the default).
+void kvs_set_backup_compression(int compress);
+
+/// Splits each full BACKUP written by a forked child between num_writers
+/// processes, forked by the child, each writing the pairs of a part of the
+/// table (see iterate_part in kvs.h) through its own buffer, and appending
+/// whole blocks to the one backup file. The binary snapshot, if there is one,
+/// is written by the child meanwhile. The lines of the backup are then in no
+/// particular order. Must be called before the jobs start.
+/// @param num_writers Processes per BACKUP, in [1, MAX_BACKUP_WRITERS]; 1
+///                    (the default) writes the backup in the child itself.
+void kvs_set_backup_writers(unsigned int num_writers);
+
+/// Starts the scheduler of the full BACKUPs written by forked children (see
+/// scheduler.h). SIGCHLD must be blocked in every thread. Must be called
+/// before the jobs start.
+/// @param max_running Children allowed to write their backups at once.
+/// @param max_queued BACKUPs allowed to wait for their child to be forked; a
+///                   BACKUP waits when that many already do.
+/// @return 0 if the scheduler was started, 1 otherwise.
+int kvs_start_backup_scheduler(size_t max_running, size_t max_queued);
+
+/// Loads the pairs of a binary snapshot into the table, if the file exists,
+/// and makes every BACKUP rewrite it (see snapfile.h). The parts of the
+/// snapshot are loaded by one thread per CPU, then the deltas written after
+/// it are applied in order and merged into a new snapshot. Must be called
+/// before the jobs start and before kvs_open_wal, whose log is replayed on
+/// top of it from the position the snapshot and deltas hold.
+/// @param path Path of the snapshot.
+/// @return 0 if successful, 1 if the snapshot or a delta could not be loaded.
+int kvs_open_snapshot(const char *path);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
+/// A pair with a TTL is deleted when it runs out, unless written again before.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
+/// @param ttls TTL of each pair in milliseconds, 0 for none.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+              unsigned int ttls[]);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
@@ -32,34 +112,141 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
+// A BEGIN ... COMMIT block of a job. Its commands see the table as it was
+// when the block started, plus their own writes, and its writes only reach
+// the table, all at once, on COMMIT. If another commit changed one of the
+// keys the block writes in the meantime, the block is dropped instead.
+typedef struct KvsBlock KvsBlock;
+
+/// Starts a block.
+/// @return The block, NULL on failure.
+KvsBlock *kvs_begin(void);
+
+/// Writes key value pairs in a block.
+/// @param block The block.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param ttls TTL of each pair in milliseconds, counted from the commit, 0 for none.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_block_write(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], unsigned int ttls[]);
+
+/// Reads values as seen by a block, in the format used by READ.
+/// @param block The block.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the key reading, 1 otherwise.
+int kvs_block_read(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+
+/// Deletes key value pairs in a block, in the format used by DELETE.
+/// @param block The block.
+/// @param num_pairs Number of pairs to delete.
+/// @param keys Array of keys' strings.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise.
+int kvs_block_delete(KvsBlock *block, size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+
+/// Applies the writes of a block and frees it. If a key it wrote was changed
+/// by another commit since the block started, nothing is applied and
+/// "[(key,KVSCONFLICT)...]" is written instead. Nothing is applied either if
+/// a write or delete of the block failed.
+/// @param block The block.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the block was committed or dropped, 1 on failure (including
+///         a failed write or delete of the block).
+int kvs_commit(KvsBlock *block, int fd);
+
+/// Drops a block without applying its writes, and frees it.
+/// @param block The block.
+void kvs_abort(KvsBlock *block);
+
+// A WATCH ... MULTI ... EXEC transaction of a job. The commands after MULTI
+// are queued and run by EXEC as one unit, with only the stripes of their keys
+// locked. If a key given to WATCH changed since then, EXEC runs nothing and
+// writes "[(key,KVSCONFLICT)...]" instead.
+typedef struct KvsMulti KvsMulti;
+
+/// Starts a transaction.
+/// @return The transaction, NULL on failure.
+KvsMulti *kvs_multi(void);
+
+/// Watches keys: EXEC will only run if none of them changes until then.
+/// Must be called before any command is queued.
+/// @param multi The transaction.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @return 0 if the keys are watched, 1 otherwise.
+int kvs_watch(KvsMulti *multi, size_t num_keys, char keys[][MAX_STRING_SIZE]);
+
+/// Queues a WRITE in a transaction.
+/// @param multi The transaction.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param ttls TTL of each pair in milliseconds, counted from EXEC, 0 for none.
+/// @return 0 if the command was queued, 1 otherwise.
+int kvs_multi_write(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], unsigned int ttls[]);
+
+/// Queues a READ in a transaction.
+/// @param multi The transaction.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @return 0 if the command was queued, 1 otherwise.
+int kvs_multi_read(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+
+/// Queues a DELETE in a transaction.
+/// @param multi The transaction.
+/// @param num_pairs Number of pairs to delete.
+/// @param keys Array of keys' strings.
+/// @return 0 if the command was queued, 1 otherwise.
+int kvs_multi_delete(KvsMulti *multi, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+
+/// Runs the queued commands of a transaction, writing their output, and
+/// frees it. None of them run if a WATCH or a command could not be queued.
+/// @param multi The transaction.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the transaction ran or was dropped, 1 otherwise (including
+///         a WATCH or command that could not be queued).
+int kvs_exec(KvsMulti *multi, int fd);
+
+/// Frees a transaction without running it.
+/// @param multi The transaction.
+void kvs_discard(KvsMulti *multi);
+
+/// Writes the pairs of a key range, in key order, in the format used by READ.
+/// Takes time proportional to the number of keys in the range.
+/// @param start First key of the range, or the prefix if end is NULL.
+/// @param end Last key of the range (inclusive), NULL to scan a prefix.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the scan was done, 1 otherwise.
+int kvs_scan(const char *start, const char *end, int fd);
+
 /// Writes the state of the KVS.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(size_t num_backup,char* job_filename , char* directory);
+/// backup file, "<directory>/<job name without extension>-<num_backup>.bck"
+/// (".bckz" if compressed).
+/// Full backups are written by a child process (see
+/// kvs_start_backup_scheduler), forked now if fewer than max_running are
+/// writing and otherwise when their turn comes, holding the table as it is
+/// then, or by the backup thread from a snapshot taken now (see
+/// kvs_start_backup_thread), and the call returns without waiting for them;
+/// deltas (see kvs_set_delta_backups) are written by the calling thread.
+/// @return 0 if successful, -1 on failure.
+int kvs_backup(size_t num_backup, const char *job_filename, const char *directory);
 
-/// Waits for the last backup to be called.
+/// Waits until every BACKUP made so far is written.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
 
-// Setter for max_backups
-// @param _max_backups
-void set_max_backups(int _max_backups);
-
-// Setter for n_current_backups
-// @param _n_current_backups
-void set_n_current_backups(int _n_current_backups);
-
-// Getter for n_current_backups
-// @return n_current_backups
-int get_n_current_backups();
-
 int kvs_subscribe(const char *key, int pipeNoti);
 
 int kvs_unsubscribe(const char *key, int pipeNoti);
@@ -1,84 +1,199 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "constants.h"
 #include "io.h"
 
-// Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
-// @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
+#define INPUT_BUFFER (64 * 1024)  // read at a time from a job that cannot be mapped
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+struct JobInput {
+  int fd;
+  const char *data;  // the mapped job, or buffer
+  size_t pos;        // next byte of data to parse
+  size_t end;        // bytes in data
+  char *buffer;      // INPUT_BUFFER bytes, NULL if the job is mapped
+};
 
-    if (bytes_read <= 0) {
-        return -1;
+JobInput *open_job_input(int fd) {
+  JobInput *in = malloc(sizeof(JobInput));
+  if (in == NULL) {
+    return NULL;
+  }
+  in->fd = fd;
+  in->pos = 0;
+  in->buffer = NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (unsigned long long)st.st_size <= SIZE_MAX) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      in->data = data;
+      in->end = (size_t)st.st_size;
+      return in;
     }
+  }
 
-    if (ch == ' ') {
-      return -1;
-    }
+  // Pipes, empty files and files that cannot be mapped are read in blocks
+  in->buffer = malloc(INPUT_BUFFER);
+  if (in->buffer == NULL) {
+    free(in);
+    return NULL;
+  }
+  in->data = in->buffer;
+  in->end = 0;
+  return in;
+}
 
-    if (ch == ',') {
-      value = 0;
-      break;
+void close_job_input(JobInput *in) {
+  if (in->buffer == NULL) {
+    munmap((void *)(uintptr_t)in->data, in->end);
+  }
+  free(in->buffer);
+  free(in);
+}
+
+// Makes at least n bytes of the job available from in->pos, unless it ends
+// first.
+// @return Number of bytes available.
+static size_t fill(JobInput *in, size_t n) {
+  if (in->end - in->pos >= n || in->buffer == NULL) {
+    return in->end - in->pos;
+  }
+  memmove(in->buffer, in->buffer + in->pos, in->end - in->pos);
+  in->end -= in->pos;
+  in->pos = 0;
+  while (in->end < n) {
+    ssize_t bytes_read = read(in->fd, in->buffer + in->end, INPUT_BUFFER - in->end);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
     }
-    else if (ch == ')') {
-      value = 1;
+    if (bytes_read <= 0) {
       break;
     }
-    else if (ch == ']') {
-      value = 2;
+    in->end += (size_t)bytes_read;
+  }
+  return in->end;
+}
+
+// Takes up to n bytes of the job, as read(2) would from the file.
+// @return Number of bytes taken, less than n only at the end of the job.
+static size_t input_read(JobInput *in, void *dst, size_t n) {
+  if (n == 1 && in->pos < in->end) {
+    *(char *)dst = in->data[in->pos++];
+    return 1;
+  }
+  size_t available = fill(in, n);
+  if (n > available) {
+    n = available;
+  }
+  memcpy(dst, in->data + in->pos, n);
+  in->pos += n;
+  return n;
+}
+
+// Finds the first byte that ends a string: ',', ')', ']' or ' '.
+// @param s The bytes.
+// @param n Number of bytes.
+// @return Its position, n if there is none.
+static size_t find_delimiter(const char *s, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i paren = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; i + 16 <= n; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, paren)),
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, bracket), _mm_cmpeq_epi8(chunk, space)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (s[i] == ',' || s[i] == ')' || s[i] == ']' || s[i] == ' ') {
       break;
     }
-
-    buffer[i++] = ch;
   }
+  return i;
+}
 
-  buffer[i] = '\0';
+// Reads a string and indicates the position from where it was
+// extracted, based on the KVS specification.
+// @param in Job to read from.
+// @param buffer To write the string in.
+// @param max Maximum string size.
+static int read_string(JobInput *in, char *buffer, size_t max) {
+  // The string and the delimiter after it are found in one scan
+  size_t available = fill(in, max + 1);
+  size_t n = available < max ? available : max;
+  const char *s = in->data + in->pos;
+  size_t i = find_delimiter(s, n);
+  memcpy(buffer, s, i);
+  if (i < max) {
+    buffer[i] = '\0';
+  }
+  if (i == n) {
+    // Too long, or the job ended
+    in->pos += n;
+    return -1;
+  }
 
-  return value;
+  in->pos += i + 1;
+  switch (s[i]) {
+    case ',':
+      return 0;
+    case ')':
+      return 1;
+    case ']':
+      return 2;
+    default:
+      return -1;
+  }
 }
 
 // Reads a number and stores it in an unsigned integer
 // variable.
-// @param fd File to read from.
+// @param in Job to read from.
 // @param value To store the number in.
 // @param next Will point to the character succeding the number.
-static int read_uint(int fd, unsigned int *value, char *next) {
-  char buf[16];
-
-  int i = 0;
+static int read_uint(JobInput *in, unsigned int *value, char *next) {
+  unsigned long ul = 0;
+  int too_big = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (input_read(in, next, 1) == 0) {
       *next = '\0';
       break;
     }
 
-    *next = buf[i];
-
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
+    if (*next > '9' || *next < '0') {
       break;
     }
 
-    i++;
+    ul = ul * 10 + (unsigned long)(*next - '0');
+    if (ul > UINT_MAX) {
+      too_big = 1;
+      ul = UINT_MAX;
+    }
   }
 
-  unsigned long ul = strtoul(buf, NULL, 10);
-
-  if (ul > UINT_MAX) {
+  if (too_big) {
     return 1;
   }
 
@@ -87,129 +202,221 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-// Jumps file descriptor to next line.
-// @param fd File descriptor.
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+// Jumps to the next line of the job.
+// @param in Job.
+static void cleanup(JobInput *in) {
+  while (fill(in, 1) > 0) {
+    const char *newline = memchr(in->data + in->pos, '\n', in->end - in->pos);
+    if (newline != NULL) {
+      in->pos = (size_t)(newline - in->data) + 1;
+      return;
+    }
+    in->pos = in->end;
+  }
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(JobInput *in) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (input_read(in, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (input_read(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (input_read(in, buf + 5, 1) != 1) {
+          cleanup(in);
           return CMD_INVALID;
         }
-        return CMD_WRITE;
+        if (strncmp(buf, "WRITE ", 6) == 0) {
+          return CMD_WRITE;
+        }
+        if (strncmp(buf, "WATCH ", 6) == 0) {
+          return CMD_WATCH;
+        }
+        cleanup(in);
+        return CMD_INVALID;
       }
 
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (input_read(in, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (input_read(in, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
+      if (input_read(in, buf + 1, 3) != 3) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (input_read(in, buf + 4, 1) != 1 || buf[4] == '\n') {
+          return CMD_INVALID;
+        }
+
+        if (buf[4] != ' ') {
+          cleanup(in);
+          return CMD_INVALID;
+        }
+
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (input_read(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (input_read(in, buf + 1, 4) != 4) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "BEGIN", 5) == 0) {
+        if (input_read(in, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(in);
+          return CMD_INVALID;
+        }
+
+        return CMD_BEGIN;
+      }
+
+      if (input_read(in, buf + 5, 1) != 1 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (input_read(in, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
+    case 'C':
+      if (input_read(in, buf + 1, 5) != 5 || strncmp(buf, "COMMIT", 6) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (input_read(in, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      return CMD_COMMIT;
+
+    case 'M':
+      if (input_read(in, buf + 1, 4) != 4 || strncmp(buf, "MULTI", 5) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (input_read(in, buf + 5, 1) != 0 && buf[5] != '\n') {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      return CMD_MULTI;
+
+    case 'E':
+      if (input_read(in, buf + 1, 3) != 3 || strncmp(buf, "EXEC", 4) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (input_read(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      return CMD_EXEC;
+
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (input_read(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (input_read(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(in);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(in);
       return CMD_INVALID;
   }
 }
 
 // Parses a key value pair.
-// @param fd File decriptor to read from.
+// @param in Job to read from.
 // @param key Pointer where the key will be stored
 // @param value Pointer where the value will be stored
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+int parse_pair(JobInput *in, char *key, char *value, unsigned int *ttl) {
+  if (read_string(in, key, MAX_STRING_SIZE) != 0) {
+    cleanup(in);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  *ttl = 0;
+  int output = read_string(in, value, MAX_STRING_SIZE);
+  if (output == 0) {
+    // (key,value,ttl_ms)
+    char next;
+    // parse_write skips the rest of the line
+    if (read_uint(in, ttl, &next) != 0 || next != ')' || *ttl == 0) {
+      return 0;
+    }
+  } else if (output != 1) {
+    cleanup(in);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(JobInput *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], unsigned int ttls[], size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (input_read(in, &ch, 1) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (input_read(in, &ch, 1) != 1 || ch != '(') {
+    cleanup(in);
     return 0;
   }
 
@@ -217,16 +424,16 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   char key[max_string_size];
   char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if(parse_pair(in, key, value, &ttls[num_pairs]) == 0) {
+      cleanup(in);
       return 0;
     }
 
     strcpy(keys[num_pairs], key);
     strcpy(values[num_pairs++], value);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (input_read(in, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(in);
       return 0;
     }
 
@@ -236,32 +443,32 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (input_read(in, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(JobInput *in, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (input_read(in, &ch, 1) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_keys = 0;
   char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(in, key, max_string_size);
     if(output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
@@ -273,34 +480,34 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (input_read(in, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(JobInput *in, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(in, delay, &ch) != 0) {
+    cleanup(in);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return -1;
     }
 
@@ -308,7 +515,53 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(in);
+    return -1;
+  }
+}
+
+int parse_scan(JobInput *in, char start[MAX_STRING_SIZE], char end[MAX_STRING_SIZE]) {
+  char ch;
+
+  if (input_read(in, &ch, 1) != 1 || ch == '\n') {
     return -1;
   }
+
+  if (ch == '[') {
+    if (read_string(in, start, MAX_STRING_SIZE - 1) != 0 ||
+        read_string(in, end, MAX_STRING_SIZE - 1) != 2) {
+      cleanup(in);
+      return -1;
+    }
+
+    if (input_read(in, &ch, 1) == 1 && ch != '\n') {
+      cleanup(in);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  // Prefix: everything up to the end of the line, which must end with '*'
+  size_t len = 0;
+  while (ch != '*') {
+    if (ch == '\n' || ch == ' ' || len == MAX_STRING_SIZE - 1) {
+      if (ch != '\n') {
+        cleanup(in);
+      }
+      return -1;
+    }
+    start[len++] = ch;
+    if (input_read(in, &ch, 1) != 1) {
+      return -1;
+    }
+  }
+  start[len] = '\0';
+
+  if (input_read(in, &ch, 1) == 1 && ch != '\n') {
+    cleanup(in);
+    return -1;
+  }
+
+  return 1;
 }
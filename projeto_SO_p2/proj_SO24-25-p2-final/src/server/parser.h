@@ -11,42 +11,72 @@ enum Command {
   CMD_SHOW,
   CMD_WAIT,
   CMD_BACKUP,
+  CMD_SCAN,
+  CMD_BEGIN,
+  CMD_COMMIT,
+  CMD_WATCH,
+  CMD_MULTI,
+  CMD_EXEC,
   CMD_HELP,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
 };
 
-// Parses input from the given file descriptor, according to
+// A job file being parsed. Regular files are mapped and parsed in place;
+// anything else is read in large blocks. Either way, strings are found by
+// scanning for their delimiters, 16 bytes at a time where SSE2 is available,
+// instead of with a read(2) per byte.
+typedef struct JobInput JobInput;
+
+/// Starts parsing a job.
+/// @param fd File descriptor of the job, only read through the JobInput from
+///           then on.
+/// @return The job, NULL if memory ran out.
+JobInput *open_job_input(int fd);
+
+/// Stops parsing a job and frees it. The file descriptor is left open.
+/// @param in The job.
+void close_job_input(JobInput *in);
+
+// Parses input from the given job, according to
 // KVS specification.
-// @param fd File descriptor of input.
+// @param in Job to read from.
 // @return enum Command Command code.
-enum Command get_next(int fd);
+enum Command get_next(JobInput *in);
 
-/// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// Parses a WRITE command. Each pair may have a TTL: (key,value,ttl_ms).
+/// @param in Job to read from.
 /// @param keys Array to store the keys
 /// @param values Array to store the values
+/// @param ttls Array to store the TTLs in milliseconds, 0 for pairs without one
 /// @param max_pairs Maximum number of pairs it will write.
 /// @param max_string_size Maximum string size allowed.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(JobInput *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], unsigned int ttls[], size_t max_pairs, size_t max_string_size);
 
 // Parses a READ or a DELETE command.
-// @param fd File descriptor to read from.
+// @param in Job to read from.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
 // @param max_string_size Maximum string size allowed.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(JobInput *in, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param in Job to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(JobInput *in, unsigned int *delay, unsigned int *thread_id);
+
+/// Parses a SCAN command: either a range, "[start,end]", or a prefix, "prefix*".
+/// @param in Job to read from.
+/// @param start Where to store the first key of the range, or the prefix.
+/// @param end Where to store the last key of the range. Not set for a prefix.
+/// @return 0 if a range was parsed, 1 if a prefix was parsed, -1 on error.
+int parse_scan(JobInput *in, char start[MAX_STRING_SIZE], char end[MAX_STRING_SIZE]);
 
 #endif  // KVS_PARSER_H
@@ -0,0 +1,146 @@
+#include "reader.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+
+struct CommandReader {
+  JobInput *input;
+  size_t depth;            // slots in the ring, 0 if there is no parser thread
+  ParsedCommand *slots;    // depth of them, or a single one without the thread
+  size_t next_parsed;      // slot the parser fills next, only used by it
+  size_t next_taken;       // slot the job takes next, only used by it
+  int taken_any;           // 1 once the job took a slot, which it gives back next
+  sem_t parsed;            // slots filled and not taken yet
+  sem_t free;              // slots the parser may fill
+  pthread_t thread;
+};
+
+// Parses the next command of a job and its arguments.
+static void parse_command(JobInput *in, ParsedCommand *command) {
+  command->cmd = get_next(in);
+  command->valid = 1;
+  switch (command->cmd) {
+    case CMD_WRITE:
+      command->num_pairs = parse_write(in, command->keys, command->values, command->ttls,
+                                       MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      command->valid = command->num_pairs != 0;
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+    case CMD_WATCH:
+      command->num_pairs = parse_read_delete(in, command->keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      command->valid = command->num_pairs != 0;
+      break;
+
+    case CMD_SCAN:
+      command->prefix = parse_scan(in, command->start, command->end);
+      command->valid = command->prefix != -1;
+      break;
+
+    case CMD_WAIT:
+      command->valid = parse_wait(in, &command->delay, NULL) != -1;
+      break;
+
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_BEGIN:
+    case CMD_COMMIT:
+    case CMD_MULTI:
+    case CMD_EXEC:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+}
+
+static void *parser_thread(void *arg) {
+  CommandReader *reader = arg;
+
+  // Signals are left to the other threads
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  for (;;) {
+    sem_wait(&reader->free);
+    ParsedCommand *command = &reader->slots[reader->next_parsed];
+    reader->next_parsed = (reader->next_parsed + 1) % reader->depth;
+    parse_command(reader->input, command);
+    sem_post(&reader->parsed);
+    if (command->cmd == EOC) {
+      return NULL;
+    }
+  }
+}
+
+CommandReader *start_command_reader(int fd, size_t depth) {
+  CommandReader *reader = malloc(sizeof(CommandReader));
+  if (reader == NULL) {
+    return NULL;
+  }
+  // The slot being run is only given back when the next one is taken, so the
+  // ring has a slot more than the commands parsed ahead
+  reader->depth = depth > 0 ? depth + 1 : 0;
+  reader->slots = malloc((depth > 0 ? reader->depth : 1) * sizeof(ParsedCommand));
+  reader->input = open_job_input(fd);
+  if (reader->slots == NULL || reader->input == NULL) {
+    if (reader->input != NULL) {
+      close_job_input(reader->input);
+    }
+    free(reader->slots);
+    free(reader);
+    return NULL;
+  }
+  reader->next_parsed = 0;
+  reader->next_taken = 0;
+  reader->taken_any = 0;
+  if (reader->depth == 0) {
+    return reader;
+  }
+
+  sem_init(&reader->parsed, 0, 0);
+  sem_init(&reader->free, 0, (unsigned int)reader->depth);
+  if (pthread_create(&reader->thread, NULL, parser_thread, reader) != 0) {
+    sem_destroy(&reader->parsed);
+    sem_destroy(&reader->free);
+    close_job_input(reader->input);
+    free(reader->slots);
+    free(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+ParsedCommand *next_command(CommandReader *reader) {
+  if (reader->depth == 0) {
+    parse_command(reader->input, &reader->slots[0]);
+    return &reader->slots[0];
+  }
+
+  if (reader->taken_any) {
+    sem_post(&reader->free);
+  }
+  reader->taken_any = 1;
+  while (sem_wait(&reader->parsed) != 0) {
+    // only interrupted by signals, so it is waited for again
+  }
+  ParsedCommand *command = &reader->slots[reader->next_taken];
+  reader->next_taken = (reader->next_taken + 1) % reader->depth;
+  return command;
+}
+
+void stop_command_reader(CommandReader *reader) {
+  if (reader->depth > 0) {
+    pthread_join(reader->thread, NULL);
+    sem_destroy(&reader->parsed);
+    sem_destroy(&reader->free);
+  }
+  close_job_input(reader->input);
+  free(reader->slots);
+  free(reader);
+}
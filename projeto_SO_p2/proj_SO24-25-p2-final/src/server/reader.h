@@ -0,0 +1,53 @@
+#ifndef KVS_READER_H
+#define KVS_READER_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+
+// Parse stage of a job, run ahead of its execution.
+//
+// A CommandReader parses the commands of a job file in a thread of its own
+// while the job's thread runs the commands parsed before them. The two share a
+// ring of slots, filled only by the parser thread and emptied only by the
+// job's thread, so reading the file overlaps with the locks the job waits for
+// and the work it does in the table. The parser waits while the ring is full
+// and the job's thread while it is empty, each on a semaphore, which only
+// enters the kernel when there is something to wait for. With a depth of 0
+// there is no thread, and each command is parsed when it is asked for.
+
+typedef struct ParsedCommand {
+  enum Command cmd;
+  int valid;         // 0 if the arguments of the command could not be parsed
+  size_t num_pairs;  // of WRITE, READ, DELETE and WATCH
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  unsigned int ttls[MAX_WRITE_SIZE];
+  unsigned int delay;           // of WAIT
+  char start[MAX_STRING_SIZE];  // of SCAN, the prefix if prefix is 1
+  char end[MAX_STRING_SIZE];
+  int prefix;
+} ParsedCommand;
+
+typedef struct CommandReader CommandReader;
+
+/// Starts parsing a job file.
+/// @param fd File descriptor of the job, read only by the reader until it is
+///           stopped.
+/// @param depth Commands parsed ahead of the one being run, 0 to parse each
+///              one when it is asked for.
+/// @return The reader, NULL on failure.
+CommandReader *start_command_reader(int fd, size_t depth);
+
+/// Takes the next command of the job, EOC once it has no more.
+/// @param reader The reader.
+/// @return The command, valid until the next call.
+ParsedCommand *next_command(CommandReader *reader);
+
+/// Stops a reader and frees it. Must only be called once next_command returned
+/// EOC.
+/// @param reader The reader.
+void stop_command_reader(CommandReader *reader);
+
+#endif  // KVS_READER_H
@@ -0,0 +1,290 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A child writing the backup of a request.
+typedef struct BackupChild {
+  pid_t pid;
+  void *request;  // NULL if no child uses this place
+} BackupChild;
+
+struct BackupScheduler {
+  size_t max_running;
+  size_t max_queued;
+  pid_t (*spawn)(void *request, const sigset_t *child_mask);
+  void (*done)(void *request, int failed);
+  sigset_t child_mask;     // of the thread that created the scheduler
+  BackupChild *children;   // max_running places
+  void **queue;            // ring of max_queued requests
+  int signal_fd;           // reads SIGCHLD
+  int wake_pipe[2];        // wakes the thread to fork a child, or to stop
+
+  pthread_mutex_t lock;    // protects everything below
+  pthread_cond_t changed;  // signalled when a place is freed or a backup ends
+  size_t head;             // oldest request in the queue
+  size_t queued;           // requests in the queue
+  size_t reserved;         // places of the queue reserved, queued or not
+  size_t running;          // children forked, or being forked
+  int stop;
+  pthread_t thread;
+};
+
+static void wake_thread(BackupScheduler *sched) {
+  char byte = 0;
+  if (write(sched->wake_pipe[1], &byte, 1) < 0) {
+    perror("Failed to wake the backup scheduler");
+  }
+}
+
+// Gives a child one of the places counted by running. Must be called with the
+// lock held.
+static void add_child(BackupScheduler *sched, pid_t pid, void *request) {
+  // running counts the places taken, including this one, so one is free
+  BackupChild *child = sched->children;
+  while (child->request != NULL) {
+    child++;
+  }
+  child->pid = pid;
+  child->request = request;
+}
+
+// Reaps the children that ended and hands their results to done. Must be
+// called with the lock held, which is released while done runs.
+static void reap_children(BackupScheduler *sched) {
+  for (size_t i = 0; i < sched->max_running; i++) {
+    BackupChild *child = &sched->children[i];
+    if (child->request == NULL) {
+      continue;
+    }
+
+    int status;
+    pid_t pid = waitpid(child->pid, &status, WNOHANG);
+    if (pid == 0) {
+      continue;
+    }
+    void *request = child->request;
+    child->request = NULL;
+    pthread_mutex_unlock(&sched->lock);
+    sched->done(request, pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+    pthread_mutex_lock(&sched->lock);
+    sched->running--;
+    pthread_cond_broadcast(&sched->changed);
+  }
+}
+
+// Forks the children of the queued requests, oldest first, while there is
+// room. Must be called with the lock held, which is released while spawn
+// runs, so the job threads can keep queueing meanwhile.
+static void start_children(BackupScheduler *sched) {
+  while (sched->running < sched->max_running && sched->queued > 0) {
+    void *request = sched->queue[sched->head];
+    sched->head = (sched->head + 1) % sched->max_queued;
+    sched->queued--;
+    sched->reserved--;
+    sched->running++;
+    pthread_cond_broadcast(&sched->changed);
+    pthread_mutex_unlock(&sched->lock);
+
+    pid_t pid = sched->spawn(request, &sched->child_mask);
+    if (pid < 0) {
+      sched->done(request, 1);
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    if (pid < 0) {
+      sched->running--;
+      pthread_cond_broadcast(&sched->changed);
+    } else {
+      add_child(sched, pid, request);
+    }
+  }
+}
+
+static void *scheduler_thread(void *arg) {
+  BackupScheduler *sched = arg;
+
+  // Signals are left to the other threads, and the children set their own mask
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  struct pollfd fds[2] = {{sched->signal_fd, POLLIN, 0}, {sched->wake_pipe[0], POLLIN, 0}};
+  pthread_mutex_lock(&sched->lock);
+  while (!sched->stop) {
+    pthread_mutex_unlock(&sched->lock);
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      perror("Failed to wait for the backups");
+      return NULL;
+    }
+    // SIGCHLDs sent meanwhile are merged, so every child is checked anyway
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(sched->signal_fd, &info, sizeof(info)) < 0) {
+        perror("Failed to read SIGCHLD");
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      char bytes[64];
+      if (read(sched->wake_pipe[0], bytes, sizeof(bytes)) < 0) {
+        perror("Failed to read the backup scheduler pipe");
+      }
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    reap_children(sched);
+    start_children(sched);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return NULL;
+}
+
+BackupScheduler *create_backup_scheduler(size_t max_running, size_t max_queued,
+                                         pid_t (*spawn)(void *request, const sigset_t *child_mask),
+                                         void (*done)(void *request, int failed)) {
+  BackupScheduler *sched = calloc(1, sizeof(BackupScheduler));
+  if (sched == NULL) {
+    return NULL;
+  }
+  sched->max_running = max_running;
+  sched->max_queued = max_queued;
+  sched->spawn = spawn;
+  sched->done = done;
+  sched->children = calloc(max_running, sizeof(BackupChild));
+  sched->queue = calloc(max_queued, sizeof(void *));
+  if (sched->children == NULL || sched->queue == NULL) {
+    free(sched->children);
+    free(sched->queue);
+    free(sched);
+    return NULL;
+  }
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &set, &sched->child_mask);
+  sigaddset(&sched->child_mask, SIGCHLD);
+  sched->signal_fd = signalfd(-1, &set, 0);
+  if (sched->signal_fd < 0) {
+    perror("Failed to create the SIGCHLD signalfd");
+    free(sched->children);
+    free(sched->queue);
+    free(sched);
+    return NULL;
+  }
+  if (pipe(sched->wake_pipe) != 0) {
+    perror("Failed to create the backup scheduler pipe");
+    close(sched->signal_fd);
+    free(sched->children);
+    free(sched->queue);
+    free(sched);
+    return NULL;
+  }
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->changed, NULL);
+  if (pthread_create(&sched->thread, NULL, scheduler_thread, sched) != 0) {
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->changed);
+    close(sched->wake_pipe[0]);
+    close(sched->wake_pipe[1]);
+    close(sched->signal_fd);
+    free(sched->children);
+    free(sched->queue);
+    free(sched);
+    return NULL;
+  }
+  return sched;
+}
+
+int backup_try_start(BackupScheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  int busy = sched->running == sched->max_running || sched->reserved > 0;
+  if (!busy) {
+    sched->running++;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return busy;
+}
+
+void backup_started(BackupScheduler *sched, pid_t pid, void *request) {
+  pthread_mutex_lock(&sched->lock);
+  if (pid < 0) {
+    sched->running--;
+    pthread_cond_broadcast(&sched->changed);
+  } else {
+    add_child(sched, pid, request);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  // The thread may have read the SIGCHLD of a child that already ended
+  if (pid >= 0) {
+    wake_thread(sched);
+  }
+}
+
+int backup_try_reserve(BackupScheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  int full = sched->reserved == sched->max_queued;
+  if (!full) {
+    sched->reserved++;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return full;
+}
+
+void backup_wait_room(BackupScheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (sched->reserved == sched->max_queued) {
+    pthread_cond_wait(&sched->changed, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void backup_cancel(BackupScheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->reserved--;
+  pthread_cond_broadcast(&sched->changed);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void backup_submit(BackupScheduler *sched, void *request) {
+  pthread_mutex_lock(&sched->lock);
+  // The reserved place guarantees room in the ring
+  sched->queue[(sched->head + sched->queued) % sched->max_queued] = request;
+  sched->queued++;
+  pthread_mutex_unlock(&sched->lock);
+  wake_thread(sched);
+}
+
+void backup_drain(BackupScheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (sched->reserved > 0 || sched->running > 0) {
+    pthread_cond_wait(&sched->changed, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void free_backup_scheduler(BackupScheduler *sched) {
+  backup_drain(sched);
+  pthread_mutex_lock(&sched->lock);
+  sched->stop = 1;
+  pthread_mutex_unlock(&sched->lock);
+  wake_thread(sched);
+  pthread_join(sched->thread, NULL);
+
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->changed);
+  close(sched->wake_pipe[0]);
+  close(sched->wake_pipe[1]);
+  close(sched->signal_fd);
+  free(sched->children);
+  free(sched->queue);
+  free(sched);
+}
@@ -0,0 +1,86 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+// Scheduler of the BACKUPs written by forked children.
+//
+// A BACKUP forks its child right away when fewer than max_running children
+// are writing and no request is queued, so the child holds the table as it
+// was when the BACKUP ran. Otherwise it only queues a request, which costs no
+// fork and holds no copy of the table, and the job that ran it moves on: the
+// scheduler's thread forks the child of the oldest request when a child ends,
+// so it holds the table as it is then. At most max_running copy-on-write
+// images of the table are thus alive at once. The queue holds at most
+// max_queued requests, and a BACKUP only blocks the job thread that runs it
+// when it is full.
+//
+// Children are reaped by the same thread, woken through a signalfd when
+// SIGCHLD arrives, which waits for each child by its pid (so it never reaps a
+// process it did not fork), hands the result of each backup to the caller
+// and forks the next ones. SIGCHLD must be blocked in every thread of the
+// server, so it is only received through the signalfd.
+
+typedef struct BackupScheduler BackupScheduler;
+
+/// Creates a scheduler and starts its thread. The calling thread, and the
+/// threads it creates from then on, get SIGCHLD blocked; threads created
+/// before must already have it blocked.
+/// @param max_running Children allowed to write their backups at once.
+/// @param max_queued Requests allowed to wait for their turn.
+/// @param spawn Called by the scheduler's thread, with no lock of the
+///              scheduler held, when the turn of a request comes. Forks its
+///              child, which must set child_mask as its signal mask (the
+///              thread blocks every signal), and returns its pid, or -1 if it
+///              could not be forked.
+/// @param done Called by the scheduler's thread, with no lock of the scheduler
+///             held, once the child of a request ended (or could not be
+///             forked), with 1 if the backup failed. Frees the request.
+/// @return The scheduler, NULL on failure.
+BackupScheduler *create_backup_scheduler(size_t max_running, size_t max_queued,
+                                         pid_t (*spawn)(void *request, const sigset_t *child_mask),
+                                         void (*done)(void *request, int failed));
+
+/// Takes a place among the running children, if one is free and no request
+/// is queued, so the caller can fork its child right away.
+/// @param sched The scheduler.
+/// @return 0 if a place was taken, 1 otherwise.
+int backup_try_start(BackupScheduler *sched);
+
+/// Hands the child forked after backup_try_start to the scheduler, which
+/// calls done once it ends.
+/// @param sched The scheduler.
+/// @param pid The child, -1 if it could not be forked, in which case the
+///            place is given back and done is not called.
+/// @param request The request, passed to done.
+void backup_started(BackupScheduler *sched, pid_t pid, void *request);
+
+/// Reserves a place in the queue, without waiting.
+/// @param sched The scheduler.
+/// @return 0 if a place was reserved, 1 if the queue is full.
+int backup_try_reserve(BackupScheduler *sched);
+
+/// Waits until a place can be reserved.
+/// @param sched The scheduler.
+void backup_wait_room(BackupScheduler *sched);
+
+/// Gives back a place reserved by backup_try_reserve that is not used.
+/// @param sched The scheduler.
+void backup_cancel(BackupScheduler *sched);
+
+/// Queues a request in the place reserved by backup_try_reserve. Requests
+/// are forked in the order they were queued.
+/// @param sched The scheduler.
+/// @param request The request, passed to spawn and done.
+void backup_submit(BackupScheduler *sched, void *request);
+
+/// Waits until every request queued has been written (or has failed).
+/// @param sched The scheduler.
+void backup_drain(BackupScheduler *sched);
+
+/// Waits for the requests left, stops the thread and frees the scheduler.
+/// @param sched The scheduler.
+void free_backup_scheduler(BackupScheduler *sched);
+
+#endif  // KVS_SCHEDULER_H
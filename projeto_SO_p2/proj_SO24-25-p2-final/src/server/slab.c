@@ -0,0 +1,204 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define SLAB_GRANULE 16                   // class i holds objects of (i + 1) * 16 bytes
+#define SLAB_NUM_CLASSES 8                // largest class: 128 bytes
+#define SLAB_CHUNK_SIZE (64 * 1024)       // bytes requested from malloc at a time
+#define SLAB_BATCH 32                     // objects moved between a thread cache and the pool
+
+typedef struct FreeObject {
+  struct FreeObject *next;
+} FreeObject;
+
+// Shared pool of one size class.
+typedef struct SizeClass {
+  pthread_mutex_t lock;
+  FreeObject *free;
+  char *chunk;        // unused part of the last chunk
+  size_t chunk_left;  // bytes left in chunk
+} SizeClass;
+
+// Free objects cached by one thread for one size class.
+typedef struct ThreadCache {
+  FreeObject *free;
+  size_t count;
+  size_t allocs;  // counters not yet added to the shared ones
+  size_t frees;
+} ThreadCache;
+
+static SizeClass classes[SLAB_NUM_CLASSES] = {
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0},
+};
+
+static _Thread_local ThreadCache caches[SLAB_NUM_CLASSES];
+static _Thread_local int cache_registered = 0;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t total_allocs = 0;
+static atomic_size_t total_frees = 0;
+static atomic_size_t total_refills = 0;
+static atomic_size_t total_chunks = 0;
+static atomic_size_t total_large_allocs = 0;
+
+static size_t class_of(size_t size) {
+  return (size + SLAB_GRANULE - 1) / SLAB_GRANULE - 1;
+}
+
+static size_t class_size(size_t class) {
+  return (class + 1) * SLAB_GRANULE;
+}
+
+// Adds the counters of a cache to the shared ones.
+static void publish_counters(ThreadCache *cache) {
+  atomic_fetch_add_explicit(&total_allocs, cache->allocs, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total_frees, cache->frees, memory_order_relaxed);
+  cache->allocs = 0;
+  cache->frees = 0;
+}
+
+// Gives up to n objects of a cache back to the shared pool.
+static void flush_cache(size_t class, ThreadCache *cache, size_t n) {
+  if (n == 0 || cache->free == NULL) {
+    return;
+  }
+  FreeObject *first = cache->free;
+  FreeObject *last = first;
+  size_t moved = 1;
+  while (moved < n && last->next != NULL) {
+    last = last->next;
+    moved++;
+  }
+  cache->free = last->next;
+  cache->count -= moved;
+
+  SizeClass *pool = &classes[class];
+  pthread_mutex_lock(&pool->lock);
+  last->next = pool->free;
+  pool->free = first;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs when a thread that used the allocator exits, so its cached objects can
+// be reused by the other threads.
+static void release_caches(void *arg) {
+  ThreadCache *thread_caches = arg;
+  for (size_t class = 0; class < SLAB_NUM_CLASSES; class++) {
+    flush_cache(class, &thread_caches[class], thread_caches[class].count);
+    publish_counters(&thread_caches[class]);
+  }
+}
+
+static void create_cache_key(void) {
+  pthread_key_create(&cache_key, release_caches);
+}
+
+// Makes release_caches run when the calling thread exits. Called on the first
+// use of its caches, whether it allocates or only frees.
+static void register_caches(void) {
+  if (!cache_registered) {
+    pthread_once(&cache_key_once, create_cache_key);
+    pthread_setspecific(cache_key, caches);
+    cache_registered = 1;
+  }
+}
+
+// Moves a batch of objects from the shared pool to the cache, carving a new
+// chunk if the pool has no free objects left.
+// @return 0 if the cache has objects, 1 if memory could not be allocated.
+static int refill_cache(size_t class, ThreadCache *cache) {
+  register_caches();
+
+  SizeClass *pool = &classes[class];
+  size_t size = class_size(class);
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < SLAB_BATCH; i++) {
+    FreeObject *object = pool->free;
+    if (object != NULL) {
+      pool->free = object->next;
+    } else {
+      if (pool->chunk_left < size) {
+        char *chunk = malloc(SLAB_CHUNK_SIZE);
+        if (chunk == NULL) {
+          break;
+        }
+        pool->chunk = chunk;
+        pool->chunk_left = SLAB_CHUNK_SIZE;
+        atomic_fetch_add_explicit(&total_chunks, 1, memory_order_relaxed);
+      }
+      object = (FreeObject *)(void *)pool->chunk;
+      pool->chunk += size;
+      pool->chunk_left -= size;
+    }
+    object->next = cache->free;
+    cache->free = object;
+    cache->count++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  atomic_fetch_add_explicit(&total_refills, 1, memory_order_relaxed);
+  publish_counters(cache);
+  return cache->free == NULL;
+}
+
+void *slab_alloc(size_t size) {
+  if (size == 0 || size > class_size(SLAB_NUM_CLASSES - 1)) {
+    atomic_fetch_add_explicit(&total_large_allocs, 1, memory_order_relaxed);
+    return malloc(size);
+  }
+
+  size_t class = class_of(size);
+  ThreadCache *cache = &caches[class];
+  if (cache->free == NULL && refill_cache(class, cache) != 0) {
+    return NULL;
+  }
+  FreeObject *object = cache->free;
+  cache->free = object->next;
+  cache->count--;
+  cache->allocs++;
+  return object;
+}
+
+void slab_free(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (size == 0 || size > class_size(SLAB_NUM_CLASSES - 1)) {
+    free(ptr);
+    return;
+  }
+
+  register_caches();
+  size_t class = class_of(size);
+  ThreadCache *cache = &caches[class];
+  FreeObject *object = ptr;
+  object->next = cache->free;
+  cache->free = object;
+  cache->count++;
+  cache->frees++;
+  // Keep a bounded cache, so objects freed by one thread (e.g. a DELETE) can
+  // be reused by the others
+  if (cache->count > 2 * SLAB_BATCH) {
+    flush_cache(class, cache, SLAB_BATCH);
+    publish_counters(cache);
+  }
+}
+
+void slab_get_stats(SlabStats *stats) {
+  stats->allocs = atomic_load(&total_allocs);
+  stats->frees = atomic_load(&total_frees);
+  stats->refills = atomic_load(&total_refills);
+  stats->chunks = atomic_load(&total_chunks);
+  stats->large_allocs = atomic_load(&total_large_allocs);
+}
@@ -0,0 +1,35 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+// Size class allocator for the small fixed shape objects of the table (key
+// nodes and subscriber nodes). Objects are carved from 64KB chunks and
+// recycled through per class free lists; each thread keeps a cache of free
+// objects per class, so most allocations and frees take no lock.
+// Sizes above the largest class fall back to malloc.
+
+typedef struct SlabStats {
+  size_t allocs;        // objects handed out by the size classes
+  size_t frees;         // objects given back to the size classes
+  size_t refills;       // times a thread cache went to the shared pool
+  size_t chunks;        // chunks requested from malloc
+  size_t large_allocs;  // allocations too big for any class (served by malloc)
+} SlabStats;
+
+/// Allocates an object of the given size.
+/// @param size Size of the object in bytes.
+/// @return Pointer to the object, NULL on failure.
+void *slab_alloc(size_t size);
+
+/// Frees an object allocated with slab_alloc.
+/// @param ptr Object to free (may be NULL).
+/// @param size Size passed to slab_alloc.
+void slab_free(void *ptr, size_t size);
+
+/// Collects the allocation counters. Counts of threads that are still running
+/// are only added when their caches go to the shared pool.
+/// @param stats Where to store the counters.
+void slab_get_stats(SlabStats *stats);
+
+#endif  // KVS_SLAB_H
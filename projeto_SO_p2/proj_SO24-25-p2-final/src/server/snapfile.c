@@ -0,0 +1,489 @@
+#include "snapfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "io.h"
+
+#define PART_BUFFER 4096             // bytes of a part buffered before they are written
+#define STREAM_BUFFER (64 * 1024)    // bytes buffered by a SnapfileWriter
+#define HAS_TTL 0x80                 // set in the key length of pairs followed by a deadline
+#define DELETED 0x80                 // set in the value length of deleted pairs, which have no value
+#define LENGTH_MASK 0x7F
+#define DEADLINE_SIZE 8
+#define MAX_RECORD (2 + 2 * MAX_STRING_SIZE + DEADLINE_SIZE)
+
+struct Snapfile {
+  const unsigned char *data;  // the whole file, mapped
+  size_t size;
+  const SnapfileHeader *header;
+};
+
+// A full snapshot written by snapfile_write, in two passes over the table: the
+// sizes of the parts are counted first, so the pairs can then be written
+// straight to their place.
+typedef struct PartWriter {
+  TimerWheel *wheel;  // timers of the pairs of the table, NULL if there are none
+  uint64_t now_ms;    // wall clock the TTLs count from, for the deadlines
+  uint64_t mono_ms;   // CLOCK_MONOTONIC at the same time, for the timers
+  int fd;
+  int failed;
+  uint64_t sizes[NUM_STRIPES];    // bytes of each part
+  uint64_t pairs[NUM_STRIPES];    // pairs of each part
+  uint64_t offsets[NUM_STRIPES];  // where the buffer of each part is written
+  size_t used[NUM_STRIPES];
+  uint32_t crcs[NUM_STRIPES];
+  unsigned char buffers[NUM_STRIPES][PART_BUFFER];
+} PartWriter;
+
+// Only used in the child forked by BACKUP, so it is static rather than allocated.
+static PartWriter full_writer;
+
+// A snapshot written in one pass, whose parts come one after the other, so the
+// pairs only go through one buffer and are written in order.
+struct SnapfileWriter {
+  SnapfileHeader header;
+  int fd;
+  int failed;
+  size_t part;     // part of the last pair added
+  uint64_t end;    // bytes of the file written or buffered so far
+  uint64_t now_ms;
+  size_t used;
+  unsigned char buffer[STREAM_BUFFER];
+  char tmp_path[];
+};
+
+static uint64_t realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static size_t part_of(const char *key) {
+  return (size_t)(hash(key) & (NUM_STRIPES - 1));
+}
+
+static void start_writer(PartWriter *w, TimerWheel *wheel, uint64_t real_ms, uint64_t mono_ms) {
+  w->wheel = wheel;
+  w->now_ms = real_ms;
+  w->mono_ms = mono_ms;
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    w->sizes[i] = 0;
+    w->pairs[i] = 0;
+  }
+}
+
+// Time a pair of the table had left at mono_ms, 0 if it has no TTL. A pair
+// that had already run out gets 1, so it is not loaded back.
+static unsigned int ttl_of(const PartWriter *w, const char *key) {
+  uint64_t deadline = w->wheel != NULL ? timer_deadline(w->wheel, key) : 0;
+  if (deadline == 0) {
+    return 0;
+  }
+  if (deadline <= w->mono_ms) {
+    return 1;
+  }
+  return deadline - w->mono_ms < UINT_MAX ? (unsigned int)(deadline - w->mono_ms) : UINT_MAX;
+}
+
+static void size_pair(const char *key, const char *value, void *arg) {
+  PartWriter *w = arg;
+  size_t part = part_of(key);
+  w->sizes[part] += 2 + strlen(key) + strlen(value) + (ttl_of(w, key) != 0 ? DEADLINE_SIZE : 0);
+  w->pairs[part]++;
+}
+
+// Writes all of buf at offset, retrying partial writes.
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+  const unsigned char *bytes = buf;
+  while (len > 0) {
+    ssize_t done = pwrite(fd, bytes, len, (off_t)offset);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    bytes += done;
+    len -= (size_t)done;
+    offset += (uint64_t)done;
+  }
+  return 0;
+}
+
+static void flush_part(PartWriter *w, size_t part) {
+  if (w->used[part] == 0) {
+    return;
+  }
+  w->crcs[part] = crc32(w->crcs[part], w->buffers[part], w->used[part]);
+  if (pwrite_all(w->fd, w->buffers[part], w->used[part], w->offsets[part]) != 0) {
+    w->failed = 1;
+  }
+  w->offsets[part] += w->used[part];
+  w->used[part] = 0;
+}
+
+// Encodes a pair, in at most MAX_RECORD bytes.
+// @param value The value, NULL if the pair was deleted.
+// @param now_ms Wall clock the TTL counts from.
+// @return Bytes written to out.
+static size_t encode_record(unsigned char *out, const char *key, const char *value, unsigned int ttl,
+                            uint64_t now_ms) {
+  unsigned char *start = out;
+  size_t key_len = strlen(key);
+  size_t value_len = value != NULL ? strlen(value) : 0;
+  // Keys and values are shorter than MAX_STRING_SIZE, so their lengths fit in
+  // the low bits of a byte
+  *out++ = (unsigned char)(key_len | (ttl != 0 ? HAS_TTL : 0));
+  memcpy(out, key, key_len);
+  out += key_len;
+  *out++ = (unsigned char)(value != NULL ? value_len : DELETED);
+  memcpy(out, value != NULL ? value : "", value_len);
+  out += value_len;
+  if (ttl != 0) {
+    uint64_t deadline = now_ms + ttl;
+    memcpy(out, &deadline, DEADLINE_SIZE);
+    out += DEADLINE_SIZE;
+  }
+  return (size_t)(out - start);
+}
+
+// Appends a pair to the buffer of its part.
+static void put_record(PartWriter *w, const char *key, const char *value, unsigned int ttl) {
+  size_t part = part_of(key);
+  size_t size = 2 + strlen(key) + strlen(value) + (ttl != 0 ? DEADLINE_SIZE : 0);
+  if (w->used[part] + size > PART_BUFFER) {
+    flush_part(w, part);
+  }
+  w->used[part] += encode_record(w->buffers[part] + w->used[part], key, value, ttl, w->now_ms);
+}
+
+static void put_pair(const char *key, const char *value, void *arg) {
+  PartWriter *w = arg;
+  put_record(w, key, value, ttl_of(w, key));
+}
+
+static void init_header(SnapfileHeader *header, uint32_t kind, uint64_t generation,
+                        uint64_t wal_position) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, SNAPFILE_MAGIC, sizeof(header->magic));
+  header->version = SNAPFILE_VERSION;
+  header->num_parts = NUM_STRIPES;
+  header->generation = generation;
+  header->wal_position = wal_position;
+  header->kind = kind;
+  header->offsets[0] = sizeof(SnapfileHeader);
+}
+
+// Writes the header, once its CRC is set, renames the file to path once it is
+// on disk, and fsyncs the directory so the rename is too. Closes fd in any case.
+// @return 0 if successful, 1 otherwise.
+static int commit_file(int fd, int failed, SnapfileHeader *header, const char *path,
+                       const char *tmp_path) {
+  header->header_crc = crc32(0, header, offsetof(SnapfileHeader, header_crc));
+  if (failed || pwrite_all(fd, header, sizeof(*header), 0) != 0 || fsync(fd) != 0) {
+    close(fd);
+    unlink(tmp_path);
+    return 1;
+  }
+  close(fd);
+  if (rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return 1;
+  }
+  return sync_dir(path);
+}
+
+// Fills the header from the sizes counted and opens the temporary file.
+// @return 0 if successful, 1 if the file could not be created.
+static int open_snapshot(PartWriter *w, SnapfileHeader *header, uint64_t generation,
+                         uint64_t wal_position, const char *tmp_path) {
+  init_header(header, SNAPFILE_FULL, generation, wal_position);
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    header->offsets[i + 1] = header->offsets[i] + w->sizes[i];
+    header->part_pairs[i] = w->pairs[i];
+    header->num_pairs += w->pairs[i];
+  }
+
+  w->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (w->fd < 0) {
+    return 1;
+  }
+  w->failed = 0;
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    w->offsets[i] = header->offsets[i];
+    w->used[i] = 0;
+    w->crcs[i] = 0;
+  }
+  return 0;
+}
+
+
+int snapfile_write(HashTable *ht, TimerWheel *wheel, uint64_t generation, uint64_t wal_position,
+                   uint64_t real_ms, uint64_t mono_ms, const char *path, const char *tmp_path) {
+  PartWriter *w = &full_writer;
+  start_writer(w, wheel, real_ms, mono_ms);
+  iterate_pairs(ht, size_pair, w);
+  SnapfileHeader header;
+  if (open_snapshot(w, &header, generation, wal_position, tmp_path) != 0) {
+    return 1;
+  }
+  iterate_pairs(ht, put_pair, w);
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    flush_part(w, i);
+    header.part_crcs[i] = w->crcs[i];
+  }
+  return commit_file(w->fd, w->failed, &header, path, tmp_path);
+}
+
+SnapfileWriter *snapfile_create(uint32_t kind, uint64_t generation, uint64_t wal_position,
+                                const char *tmp_path) {
+  size_t path_len = strlen(tmp_path);
+  SnapfileWriter *w = malloc(sizeof(SnapfileWriter) + path_len + 1);
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (w->fd < 0) {
+    free(w);
+    return NULL;
+  }
+  init_header(&w->header, kind, generation, wal_position);
+  memcpy(w->tmp_path, tmp_path, path_len + 1);
+  w->failed = 0;
+  w->part = 0;
+  w->end = sizeof(SnapfileHeader);
+  w->now_ms = realtime_ms();
+  w->used = 0;
+  return w;
+}
+
+// Writes the buffer after what was written so far.
+static void flush_stream(SnapfileWriter *w) {
+  if (w->used > 0 && pwrite_all(w->fd, w->buffer, w->used, w->end - w->used) != 0) {
+    w->failed = 1;
+  }
+  w->used = 0;
+}
+
+void snapfile_add(SnapfileWriter *w, const char *key, const char *value, unsigned int ttl_ms) {
+  size_t part = part_of(key);
+  if (part < w->part) {
+    w->failed = 1;  // the parts must be written in order
+    return;
+  }
+  // The parts in between, if any, are empty
+  for (; w->part < part; w->part++) {
+    w->header.offsets[w->part + 1] = w->end;
+  }
+
+  if (w->used + MAX_RECORD > STREAM_BUFFER) {
+    flush_stream(w);
+  }
+  unsigned char *out = w->buffer + w->used;
+  size_t size = encode_record(out, key, value, ttl_ms, w->now_ms);
+  w->header.part_crcs[part] = crc32(w->header.part_crcs[part], out, size);
+  w->header.part_pairs[part]++;
+  w->header.num_pairs++;
+  w->used += size;
+  w->end += size;
+}
+
+int snapfile_commit(SnapfileWriter *w, const char *path) {
+  for (; w->part < NUM_STRIPES; w->part++) {
+    w->header.offsets[w->part + 1] = w->end;
+  }
+  flush_stream(w);
+  int result = commit_file(w->fd, w->failed, &w->header, path, w->tmp_path);
+  free(w);
+  return result;
+}
+
+// Checks the header of a mapped snapshot.
+static int check_header(const SnapfileHeader *header, size_t size) {
+  if (memcmp(header->magic, SNAPFILE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->header_crc != crc32(0, header, offsetof(SnapfileHeader, header_crc))) {
+    fprintf(stderr, "Not a snapshot, or damaged\n");
+    return 1;
+  }
+  if (header->version != SNAPFILE_VERSION || header->num_parts != NUM_STRIPES ||
+      (header->kind != SNAPFILE_FULL && header->kind != SNAPFILE_DELTA)) {
+    fprintf(stderr, "Snapshot written by an incompatible server\n");
+    return 1;
+  }
+  if (header->offsets[0] != sizeof(SnapfileHeader) || header->offsets[NUM_STRIPES] != size) {
+    fprintf(stderr, "Snapshot is truncated\n");
+    return 1;
+  }
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    if (header->offsets[i + 1] < header->offsets[i]) {
+      fprintf(stderr, "Not a snapshot, or damaged\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+Snapfile *snapfile_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      perror("Failed to open the snapshot");
+    }
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("Failed to open the snapshot");
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(SnapfileHeader)) {
+    fprintf(stderr, "Snapshot is truncated\n");
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // The mapping stays valid after the file is closed
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("Failed to map the snapshot");
+    return NULL;
+  }
+  // Every page is read once, by the threads loading the parts
+  posix_madvise(data, size, POSIX_MADV_WILLNEED);
+
+  Snapfile *file = malloc(sizeof(Snapfile));
+  if (file == NULL || check_header(data, size) != 0) {
+    free(file);
+    munmap(data, size);
+    errno = EINVAL;
+    return NULL;
+  }
+  file->data = data;
+  file->size = size;
+  file->header = data;
+  return file;
+}
+
+int snapfile_read_header(const char *path, SnapfileHeader *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  int failed = fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header) ||
+               pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+               check_header(header, (size_t)st.st_size) != 0;
+  close(fd);
+  return failed;
+}
+
+size_t snapfile_pairs(const Snapfile *file) {
+  return (size_t)file->header->num_pairs;
+}
+
+size_t snapfile_part_pairs(const Snapfile *file, size_t part) {
+  return (size_t)file->header->part_pairs[part];
+}
+
+uint64_t snapfile_generation(const Snapfile *file) {
+  return file->header->generation;
+}
+
+uint64_t snapfile_wal_position(const Snapfile *file) {
+  return file->header->wal_position;
+}
+
+int snapfile_is_delta(const Snapfile *file) {
+  return file->header->kind == SNAPFILE_DELTA;
+}
+
+// Walks the pairs of a part, checking that they fit in it.
+// @param deletes 1 if the part may have deleted pairs (only deltas do).
+// @return Number of pairs of the part, UINT64_MAX if one does not fit.
+static uint64_t check_part(const unsigned char *data, size_t size, int deletes) {
+  uint64_t pairs = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t key_len = data[pos] & LENGTH_MASK;
+    size_t extra = data[pos] & HAS_TTL ? DEADLINE_SIZE : 0;
+    if (key_len >= MAX_STRING_SIZE || size - pos < key_len + 2) {
+      return UINT64_MAX;
+    }
+    pos += 1 + key_len;
+    size_t value_len = data[pos] & LENGTH_MASK;
+    if ((data[pos] & DELETED && (!deletes || value_len != 0)) || value_len >= MAX_STRING_SIZE ||
+        size - pos - 1 < value_len + extra) {
+      return UINT64_MAX;
+    }
+    pos += 1 + value_len + extra;
+    pairs++;
+  }
+  return pairs;
+}
+
+int snapfile_read_part(const Snapfile *file, size_t part,
+                       void (*visit)(const char *key, const char *value, unsigned int ttl_ms, void *arg),
+                       void *arg) {
+  const unsigned char *data = file->data + file->header->offsets[part];
+  size_t size = (size_t)(file->header->offsets[part + 1] - file->header->offsets[part]);
+  // Checks the whole part before visiting anything, so a damaged part is all or nothing
+  if (crc32(0, data, size) != file->header->part_crcs[part] ||
+      check_part(data, size, snapfile_is_delta(file)) != file->header->part_pairs[part]) {
+    fprintf(stderr, "Part %zu of the snapshot is damaged\n", part);
+    return 1;
+  }
+
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  uint64_t now = realtime_ms();
+  size_t pos = 0;
+  while (pos < size) {
+    int has_ttl = data[pos] & HAS_TTL;
+    size_t key_len = data[pos++] & LENGTH_MASK;
+    memcpy(key, data + pos, key_len);
+    key[key_len] = '\0';
+    pos += key_len;
+    int deleted = data[pos] & DELETED;
+    size_t value_len = data[pos++] & LENGTH_MASK;
+    memcpy(value, data + pos, value_len);
+    value[value_len] = '\0';
+    pos += value_len;
+
+    unsigned int ttl = 0;
+    if (has_ttl) {
+      uint64_t deadline;
+      memcpy(&deadline, data + pos, DEADLINE_SIZE);
+      pos += DEADLINE_SIZE;
+      if (deadline <= now) {
+        // Ran out while the server was down. In a delta, the pair may be in
+        // the snapshots below, so it must still be deleted
+        if (snapfile_is_delta(file)) {
+          visit(key, NULL, 0, arg);
+        }
+        continue;
+      }
+      ttl = deadline - now < UINT_MAX ? (unsigned int)(deadline - now) : UINT_MAX;
+    }
+    visit(key, deleted ? NULL : value, ttl, arg);
+  }
+  return 0;
+}
+
+void snapfile_close(Snapfile *file) {
+  munmap((void *)file->data, file->size);
+  free(file);
+}
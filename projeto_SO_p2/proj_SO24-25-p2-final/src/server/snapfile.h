@@ -0,0 +1,151 @@
+#ifndef KVS_SNAPFILE_H
+#define KVS_SNAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs.h"
+#include "ttl.h"
+
+// Binary snapshots of the table, written by BACKUP next to the text backups
+// and loaded back on startup.
+//
+// The file starts with a SnapfileHeader and is followed by the pairs, split in
+// NUM_STRIPES parts: part i has the pairs of stripe i (hash(key) &
+// (NUM_STRIPES - 1)), each stored as the length of the key (one byte), the
+// key, the length of the value and the value, without the '\0's. Pairs with
+// a TTL have the top bit of the key length set and are followed by their
+// deadline (8 bytes, wall clock milliseconds, as in the log), so pairs that
+// ran out while the server was down are not loaded. The header has where each
+// part starts, the CRC-32 of each part and, last, its own CRC-32, so the parts
+// can be checked and loaded by different threads.
+//
+// A snapshot is either full, with every pair of the table, or a delta, with
+// only the pairs changed since the BACKUP before it. Deleted pairs of a delta
+// have the top bit of the value length set and no value. Each snapshot has
+// the generation of the BACKUP that wrote it, so deltas can be applied in
+// order on top of the full snapshot they follow, and the position of the
+// write-ahead log (see wal_end) it holds every change up to, so only the
+// records after it are replayed on top.
+//
+// snapfile_write only calls async signal safe functions, so it can run in the
+// child forked by BACKUP. Deltas, and full snapshots written without forking,
+// go through a SnapfileWriter instead, which takes the pairs already in part
+// order and writes them in one pass. Snapshots are written to another file and
+// renamed over the old one when complete, and the directory is fsynced, so a
+// crash never leaves a partial snapshot nor loses one that was committed.
+// With several BACKUPs running at once, the last one to finish is kept.
+
+#define SNAPFILE_MAGIC "KVSSNAP1"
+#define SNAPFILE_VERSION 3
+
+#define SNAPFILE_FULL 0
+#define SNAPFILE_DELTA 1
+
+typedef struct SnapfileHeader {
+  char magic[8];                     // SNAPFILE_MAGIC, without the '\0'
+  uint32_t version;                  // SNAPFILE_VERSION
+  uint32_t num_parts;                // NUM_STRIPES
+  uint64_t num_pairs;
+  uint64_t generation;               // number of the BACKUP that wrote it
+  uint64_t wal_position;             // end of the log records it holds, 0 for none
+  uint64_t offsets[NUM_STRIPES + 1];  // part i is [offsets[i], offsets[i + 1]) of the file
+  uint64_t part_pairs[NUM_STRIPES];  // number of pairs of each part
+  uint32_t part_crcs[NUM_STRIPES];
+  uint32_t kind;                     // SNAPFILE_FULL or SNAPFILE_DELTA
+  uint32_t header_crc;               // CRC-32 of the fields above
+} SnapfileHeader;
+
+typedef struct Snapfile Snapfile;
+typedef struct SnapfileWriter SnapfileWriter;
+
+/// Writes a full snapshot of the table. The table must be locked
+/// (lock_table). Only one can be written at a time per process.
+/// @param ht The table.
+/// @param wheel Timers of the keys with a TTL, NULL if there are none.
+/// @param generation Generation of the snapshot.
+/// @param wal_position Position of the log the table holds every change up
+///                     to, 0 if there is no log.
+/// @param real_ms Wall clock, in milliseconds, the TTLs count from.
+/// @param mono_ms CLOCK_MONOTONIC, in milliseconds, read at the same time as
+///                real_ms, to turn the deadlines of the timers into wall
+///                clock ones.
+/// @param path Path of the snapshot.
+/// @param tmp_path Path where the snapshot is written before being renamed to
+///                 path, in the same file system.
+/// @return 0 if the snapshot was written, 1 otherwise.
+int snapfile_write(HashTable *ht, TimerWheel *wheel, uint64_t generation, uint64_t wal_position,
+                   uint64_t real_ms, uint64_t mono_ms, const char *path, const char *tmp_path);
+
+/// Starts a snapshot written in one pass, whose pairs are added part after
+/// part (that is, stripe after stripe). Not async signal safe, unlike
+/// snapfile_write, but several can be written at once.
+/// @param kind SNAPFILE_FULL or SNAPFILE_DELTA.
+/// @param generation Generation of the snapshot.
+/// @param wal_position As in snapfile_write.
+/// @param tmp_path As in snapfile_write.
+/// @return The writer, NULL on failure.
+SnapfileWriter *snapfile_create(uint32_t kind, uint64_t generation, uint64_t wal_position,
+                                const char *tmp_path);
+
+/// Adds a pair to a snapshot. Pairs must be added in the order of their parts.
+/// @param w The writer.
+/// @param key The key.
+/// @param value The value, NULL if the pair was deleted (deltas only).
+/// @param ttl_ms Time the pair has left, 0 for none.
+void snapfile_add(SnapfileWriter *w, const char *key, const char *value, unsigned int ttl_ms);
+
+/// Completes a snapshot, renaming it to path, and frees the writer.
+/// @param w The writer.
+/// @param path Path of the snapshot.
+/// @return 0 if the snapshot was written, 1 otherwise.
+int snapfile_commit(SnapfileWriter *w, const char *path);
+
+/// Maps a snapshot and checks its header. The parts are only checked when
+/// they are read.
+/// @param path Path of the snapshot.
+/// @return The snapshot, NULL on failure (with errno set to ENOENT if there
+///         is no snapshot).
+Snapfile *snapfile_open(const char *path);
+
+/// Reads and checks the header of a snapshot, without mapping the rest.
+/// @param path Path of the snapshot.
+/// @param header Where to store the header.
+/// @return 0 if successful, 1 otherwise.
+int snapfile_read_header(const char *path, SnapfileHeader *header);
+
+/// @return The number of pairs of a snapshot.
+size_t snapfile_pairs(const Snapfile *file);
+
+/// @return The number of pairs of a part of a snapshot.
+size_t snapfile_part_pairs(const Snapfile *file, size_t part);
+
+/// @return The generation of a snapshot.
+uint64_t snapfile_generation(const Snapfile *file);
+
+/// @return The position of the log a snapshot holds every change up to, 0 if
+///         there was no log.
+uint64_t snapfile_wal_position(const Snapfile *file);
+
+/// @return 1 if the snapshot is a delta, 0 if it is full.
+int snapfile_is_delta(const Snapfile *file);
+
+/// Checks a part of a snapshot and calls visit for each of its pairs. Parts
+/// can be read by different threads at once.
+/// @param file The snapshot.
+/// @param part Part to read, below NUM_STRIPES.
+/// @param visit Function called with the key, the value and the TTL (0 for
+///              none) of each pair that has not run out. In a delta, deleted
+///              pairs and pairs that ran out are visited with a NULL value.
+/// @param arg Argument passed to visit.
+/// @return 0 if successful, 1 if the part is damaged (in which case none of
+///         its pairs was visited).
+int snapfile_read_part(const Snapfile *file, size_t part,
+                       void (*visit)(const char *key, const char *value, unsigned int ttl_ms, void *arg),
+                       void *arg);
+
+/// Unmaps a snapshot.
+/// @param file The snapshot.
+void snapfile_close(Snapfile *file);
+
+#endif  // KVS_SNAPFILE_H
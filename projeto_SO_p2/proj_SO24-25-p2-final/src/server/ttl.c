@@ -0,0 +1,388 @@
+#include "ttl.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kvs.h"
+
+#define TTL_TICK_MS 10                 // resolution of the timers
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)  // slots per level
+#define WHEEL_LEVELS 4                 // the wheel spans 2^24 ticks, about 46 hours
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define EXPIRE_BATCH 64                // keys handed to expire per unlock of the wheel
+
+// Links of a circular list of timers, whose head is a bare TimerLink.
+typedef struct TimerLink {
+  struct TimerLink *prev;
+  struct TimerLink *next;
+} TimerLink;
+
+typedef struct Timer {
+  TimerLink link;    // must be the first member; protected by the wheel lock
+  int linked;        // 1 while in a slot or in due (wheel lock)
+  uint64_t expires;  // tick at which the key expires (wheel lock and stripe lock to write)
+  uint64_t hash;
+  struct Timer *map_next;  // protected by the key's stripe lock
+  char key[MAX_STRING_SIZE];
+} Timer;
+
+// Timers of the keys of one stripe, chained by map_next.
+typedef struct TimerMap {
+  Timer **buckets;
+  size_t size;  // a power of two, 0 until the first timer
+  size_t count;
+} TimerMap;
+
+struct TimerWheel {
+  pthread_mutex_t lock;  // protects the lists and the fields up to due
+  pthread_cond_t wake;   // signalled when the wheel stops being empty, or to stop
+  uint64_t now;          // last tick processed
+  size_t count;          // linked timers
+  int stop;
+  TimerLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  TimerLink due;  // timers that ran out, not yet handed to expire
+
+  TimerMap maps[NUM_STRIPES];  // maps[i] is protected by stripe i of the table
+
+  void (*expire)(const char *key, void *arg);
+  void *arg;
+  pthread_t thread;
+};
+
+static uint64_t current_tick(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000) / TTL_TICK_MS;
+}
+
+static struct timespec tick_to_timespec(uint64_t tick) {
+  uint64_t ms = tick * TTL_TICK_MS;
+  return (struct timespec){(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+}
+
+static void list_init(TimerLink *head) {
+  head->prev = head;
+  head->next = head;
+}
+
+static void list_add(TimerLink *head, TimerLink *link) {
+  link->next = head;
+  link->prev = head->prev;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void list_del(TimerLink *link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+}
+
+// Moves every timer of a list to the end of another one.
+static void list_splice(TimerLink *from, TimerLink *to) {
+  if (from->next == from) {
+    return;
+  }
+  from->next->prev = to->prev;
+  to->prev->next = from->next;
+  from->prev->next = to;
+  to->prev = from->prev;
+  list_init(from);
+}
+
+// Links a timer in the slot of its deadline. Called with the wheel locked and
+// timer->expires >= wheel->now.
+static void wheel_insert(TimerWheel *wheel, Timer *timer) {
+  uint64_t expires = timer->expires;
+  if (expires - wheel->now >= WHEEL_SPAN) {
+    // Parked in the farthest slot, and placed again when the wheel gets there
+    expires = wheel->now + WHEEL_SPAN - 1;
+  }
+  uint64_t delta = expires - wheel->now;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)) != 0) {
+    level++;
+  }
+  size_t slot = (size_t)(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  list_add(&wheel->slots[level][slot], &timer->link);
+}
+
+// Advances the wheel by one tick, moving the timers that ran out to due.
+// Called with the wheel locked.
+static void wheel_tick(TimerWheel *wheel) {
+  wheel->now++;
+  // Every WHEEL_SLOTS^level ticks, the next slot of a level is spread over
+  // the levels below; the timers due now land in the current slot of level 0
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if ((wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0) {
+      break;
+    }
+    size_t slot = (size_t)(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    TimerLink list;
+    list_init(&list);
+    list_splice(&wheel->slots[level][slot], &list);
+    while (list.next != &list) {
+      TimerLink *link = list.next;
+      list_del(link);
+      wheel_insert(wheel, (Timer *)link);
+    }
+  }
+  list_splice(&wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)], &wheel->due);
+}
+
+static void *expiry_thread(void *arg) {
+  TimerWheel *wheel = arg;
+
+  // Signals are left to the other threads
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&wheel->lock);
+  while (!wheel->stop) {
+    if (wheel->count == 0) {
+      // timer_arm moves the wheel to the current tick when it gets a timer
+      pthread_cond_wait(&wheel->wake, &wheel->lock);
+      continue;
+    }
+
+    uint64_t target = current_tick();
+    while (wheel->now < target && wheel->due.next == &wheel->due) {
+      wheel_tick(wheel);
+    }
+
+    if (wheel->due.next != &wheel->due) {
+      // Only copies of the keys leave the lock: the timers stay in their maps,
+      // and expire finds out with timer_expired whether they were set again
+      char keys[EXPIRE_BATCH][MAX_STRING_SIZE];
+      size_t num_keys = 0;
+      while (num_keys < EXPIRE_BATCH && wheel->due.next != &wheel->due) {
+        Timer *timer = (Timer *)wheel->due.next;
+        list_del(&timer->link);
+        timer->linked = 0;
+        wheel->count--;
+        memcpy(keys[num_keys++], timer->key, MAX_STRING_SIZE);
+      }
+      pthread_mutex_unlock(&wheel->lock);
+      for (size_t i = 0; i < num_keys; i++) {
+        wheel->expire(keys[i], wheel->arg);
+      }
+      pthread_mutex_lock(&wheel->lock);
+      continue;
+    }
+
+    struct timespec deadline = tick_to_timespec(wheel->now + 1);
+    pthread_cond_timedwait(&wheel->wake, &wheel->lock, &deadline);
+  }
+  pthread_mutex_unlock(&wheel->lock);
+  return NULL;
+}
+
+TimerWheel *create_timer_wheel(void (*expire)(const char *key, void *arg), void *arg) {
+  TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+  if (wheel == NULL) {
+    return NULL;
+  }
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+      list_init(&wheel->slots[level][slot]);
+    }
+  }
+  list_init(&wheel->due);
+  wheel->now = current_tick();
+  wheel->expire = expire;
+  wheel->arg = arg;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wheel->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&wheel->lock, NULL);
+
+  if (pthread_create(&wheel->thread, NULL, expiry_thread, wheel) != 0) {
+    pthread_cond_destroy(&wheel->wake);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+    return NULL;
+  }
+  return wheel;
+}
+
+static TimerMap *map_of(TimerWheel *wheel, uint64_t h) {
+  return &wheel->maps[h & (NUM_STRIPES - 1)];
+}
+
+// The low bits of the hash pick the stripe, so the buckets use the high ones.
+static size_t bucket_of(const TimerMap *map, uint64_t h) {
+  return (size_t)(h >> 32) & (map->size - 1);
+}
+
+// Finds the timer of a key.
+// @return The link pointing to the timer, NULL if the key has none.
+static Timer **map_find(TimerMap *map, uint64_t h, const char *key) {
+  if (map->count == 0) {
+    return NULL;
+  }
+  Timer **link = &map->buckets[bucket_of(map, h)];
+  while (*link != NULL && ((*link)->hash != h || strcmp((*link)->key, key) != 0)) {
+    link = &(*link)->map_next;
+  }
+  return *link != NULL ? link : NULL;
+}
+
+// Makes room for one more timer in a map, doubling its buckets when full.
+// @return 0 if successful, 1 if memory ran out.
+static int map_reserve(TimerMap *map) {
+  if (map->count < map->size) {
+    return 0;
+  }
+  size_t size = map->size ? map->size * 2 : 16;
+  Timer **buckets = calloc(size, sizeof(Timer *));
+  if (buckets == NULL) {
+    return 1;
+  }
+  TimerMap grown = {buckets, size, map->count};
+  for (size_t i = 0; i < map->size; i++) {
+    Timer *next;
+    for (Timer *timer = map->buckets[i]; timer != NULL; timer = next) {
+      next = timer->map_next;
+      Timer **bucket = &buckets[bucket_of(&grown, timer->hash)];
+      timer->map_next = *bucket;
+      *bucket = timer;
+    }
+  }
+  free(map->buckets);
+  *map = grown;
+  return 0;
+}
+
+int timer_arm(TimerWheel *wheel, const char *key, unsigned int ttl_ms) {
+  uint64_t h = hash(key);
+  TimerMap *map = map_of(wheel, h);
+  Timer **link = map_find(map, h, key);
+  Timer *timer = link != NULL ? *link : NULL;
+  if (timer == NULL) {
+    if (map_reserve(map) != 0 || (timer = malloc(sizeof(Timer))) == NULL) {
+      return 1;
+    }
+    timer->linked = 0;
+    timer->hash = h;
+    strncpy(timer->key, key, MAX_STRING_SIZE - 1);
+    timer->key[MAX_STRING_SIZE - 1] = '\0';
+    Timer **bucket = &map->buckets[bucket_of(map, h)];
+    timer->map_next = *bucket;
+    *bucket = timer;
+    map->count++;
+  }
+
+  uint64_t ticks = ((uint64_t)ttl_ms + TTL_TICK_MS - 1) / TTL_TICK_MS;
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->linked) {
+    list_del(&timer->link);
+  } else {
+    timer->linked = 1;
+    if (wheel->count++ == 0) {
+      // The slots are empty, so the wheel can jump to the current tick
+      wheel->now = current_tick();
+      pthread_cond_signal(&wheel->wake);
+    }
+  }
+  // Read with the wheel locked, so it is not behind wheel->now
+  timer->expires = current_tick() + (ticks > 0 ? ticks : 1);
+  wheel_insert(wheel, timer);
+  pthread_mutex_unlock(&wheel->lock);
+  return 0;
+}
+
+// Removes a timer from its map and from the wheel, and frees it.
+static void remove_timer(TimerWheel *wheel, TimerMap *map, Timer **link) {
+  Timer *timer = *link;
+  *link = timer->map_next;
+  map->count--;
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->linked) {
+    list_del(&timer->link);
+    wheel->count--;
+  }
+  pthread_mutex_unlock(&wheel->lock);
+  free(timer);
+}
+
+void timer_cancel(TimerWheel *wheel, const char *key) {
+  uint64_t h = hash(key);
+  TimerMap *map = map_of(wheel, h);
+  Timer **link = map_find(map, h, key);
+  if (link != NULL) {
+    remove_timer(wheel, map, link);
+  }
+}
+
+int timer_expired(TimerWheel *wheel, const char *key) {
+  uint64_t h = hash(key);
+  TimerMap *map = map_of(wheel, h);
+  Timer **link = map_find(map, h, key);
+  if (link == NULL) {
+    return 0;
+  }
+  // Timers leave the wheel unlinked when handed to expire, and timer_arm
+  // links them again
+  pthread_mutex_lock(&wheel->lock);
+  int expired = !(*link)->linked;
+  pthread_mutex_unlock(&wheel->lock);
+  if (expired) {
+    remove_timer(wheel, map, link);
+  }
+  return expired;
+}
+
+unsigned int timer_remaining(TimerWheel *wheel, const char *key) {
+  uint64_t h = hash(key);
+  Timer **link = map_find(map_of(wheel, h), h, key);
+  if (link == NULL) {
+    return 0;
+  }
+  // Only timer_arm changes expires, with the stripe locked for writing, so it
+  // can be read without the wheel lock
+  uint64_t now = current_tick();
+  uint64_t expires = (*link)->expires;
+  if (expires <= now) {
+    return 1;
+  }
+  uint64_t ms = (expires - now) * TTL_TICK_MS;
+  return ms < UINT_MAX ? (unsigned int)ms : UINT_MAX;
+}
+
+uint64_t timer_deadline(TimerWheel *wheel, const char *key) {
+  uint64_t h = hash(key);
+  Timer **link = map_find(map_of(wheel, h), h, key);
+  return link != NULL ? (*link)->expires * TTL_TICK_MS : 0;
+}
+
+void free_timer_wheel(TimerWheel *wheel) {
+  pthread_mutex_lock(&wheel->lock);
+  wheel->stop = 1;
+  pthread_cond_signal(&wheel->wake);
+  pthread_mutex_unlock(&wheel->lock);
+  pthread_join(wheel->thread, NULL);
+
+  for (size_t i = 0; i < NUM_STRIPES; i++) {
+    TimerMap *map = &wheel->maps[i];
+    for (size_t b = 0; b < map->size; b++) {
+      Timer *next;
+      for (Timer *timer = map->buckets[b]; timer != NULL; timer = next) {
+        next = timer->map_next;
+        free(timer);
+      }
+    }
+    free(map->buckets);
+  }
+  pthread_cond_destroy(&wheel->wake);
+  pthread_mutex_destroy(&wheel->lock);
+  free(wheel);
+}
@@ -0,0 +1,75 @@
+#ifndef KVS_TTL_H
+#define KVS_TTL_H
+
+#include <stdint.h>
+
+#include "constants.h"
+
+// Expiry of the keys written with a TTL ("WRITE [(key,value,ttl_ms)]").
+//
+// Deadlines are kept in a hierarchical timer wheel: WHEEL_LEVELS levels of
+// WHEEL_SLOTS slots, where a slot of level l spans WHEEL_SLOTS^l ticks of
+// TTL_TICK_MS. Arming or cancelling a timer only links or unlinks it in a
+// slot. A background thread advances the wheel once per tick, expiring the
+// keys of the current slot of level 0 and, every WHEEL_SLOTS^l ticks, moving
+// the timers of the next slot of level l down to the levels below. Expiring
+// keys never goes through the table.
+//
+// A key has at most one timer. Timers are found by key in a hash table per
+// lock stripe, protected by the stripe lock the callers already hold, so
+// writes of keys without a TTL never take the lock of the wheel.
+
+typedef struct TimerWheel TimerWheel;
+
+/// Creates an empty wheel and starts its thread.
+/// @param expire Called by the thread, without any lock held, with the key of
+///               every timer that runs out. It should lock the key's stripe
+///               and check timer_expired before removing the pair, since the
+///               key may have been written again meanwhile.
+/// @param arg Passed to expire.
+/// @return The wheel, NULL on failure.
+TimerWheel *create_timer_wheel(void (*expire)(const char *key, void *arg), void *arg);
+
+/// Sets the timer of a key, replacing the one it had. Must be called with the
+/// key's stripe locked for writing.
+/// @param wheel The wheel.
+/// @param key The key.
+/// @param ttl_ms Time until the key expires, in milliseconds.
+/// @return 0 if the timer was set, 1 if memory ran out.
+int timer_arm(TimerWheel *wheel, const char *key, unsigned int ttl_ms);
+
+/// Removes the timer of a key, if it has one. Must be called with the key's
+/// stripe locked for writing.
+/// @param wheel The wheel.
+/// @param key The key.
+void timer_cancel(TimerWheel *wheel, const char *key);
+
+/// Tells whether the timer of a key ran out, and removes it if so. Must be
+/// called with the key's stripe locked for writing.
+/// @param wheel The wheel.
+/// @param key The key.
+/// @return 1 if the key must be removed, 0 if its timer was cancelled or set
+///         again since it was handed to expire.
+int timer_expired(TimerWheel *wheel, const char *key);
+
+/// Tells how long a key has left. Must be called with the key's stripe
+/// locked, for reading at least. Async signal safe, so it can be used after
+/// fork.
+/// @param wheel The wheel.
+/// @param key The key.
+/// @return Milliseconds until the key expires (at least 1), 0 if it has no
+///         timer.
+unsigned int timer_remaining(TimerWheel *wheel, const char *key);
+
+/// Tells when a key expires, with the same locking as timer_remaining.
+/// @param wheel The wheel.
+/// @param key The key.
+/// @return CLOCK_MONOTONIC time, in milliseconds, at which the key expires, 0
+///         if it has no timer.
+uint64_t timer_deadline(TimerWheel *wheel, const char *key);
+
+/// Stops the thread and frees the wheel.
+/// @param wheel The wheel.
+void free_timer_wheel(TimerWheel *wheel);
+
+#endif  // KVS_TTL_H
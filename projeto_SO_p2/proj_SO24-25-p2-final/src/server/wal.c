@@ -0,0 +1,550 @@
+#include "wal.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "crc.h"
+#include "io.h"
+
+#define WAL_MAGIC "KVSWAL2\n"  // first bytes of a log, followed by the position of its first byte
+#define WAL_MAGIC_SIZE 8
+#define WAL_HEADER 16          // magic and position
+#define COPY_BUFFER (64 * 1024)  // bytes copied at a time by wal_checkpoint
+#define RECORD_HEADER 8        // length and CRC-32 of the contents
+#define BATCH_INLINE 4096      // commits up to this size need no allocation
+
+// Changes of the commit being built by a thread. Each write is 'W', the key
+// length, the key, the value length, the value and the deadline (8 bytes, 0
+// for none); each delete is 'D', the key length and the key.
+typedef struct WalBatch {
+  char *data;  // first, or an allocated buffer for large commits
+  size_t size;
+  size_t capacity;
+  int failed;  // 1 if memory ran out, so the commit cannot be logged
+  char first[BATCH_INLINE];
+} WalBatch;
+
+static _Thread_local WalBatch batch = {0};
+
+struct Wal {
+  int fd;  // only replaced by wal_checkpoint, while no flush runs
+  unsigned int sync_ms;
+  char *path;
+
+  pthread_mutex_t lock;  // protects everything below
+  pthread_cond_t done;   // signalled when a flush ends, or to stop
+  char *buffer;          // records appended and not written yet
+  size_t size;
+  size_t capacity;
+  char *spare;  // the other buffer, written by the flushing thread
+  size_t spare_capacity;
+  uint64_t base;      // position of the first byte of the file
+  uint64_t appended;  // end of the last record appended
+  uint64_t written;   // end of the records written to the file
+  uint64_t synced;    // end of the records fsynced
+  int flushing;       // 1 while a thread writes the spare buffer
+  int failed;         // 1 once a write or fsync failed
+  int stop;
+  pthread_t thread;  // fsyncs every sync_ms, if sync_ms is not 0
+};
+
+static uint64_t realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Writes len bytes, retrying partial writes.
+static int write_all(int fd, const char *ptr, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, ptr, len);
+    if (written < 0) {
+      perror("Error writing the WAL");
+      return 1;
+    }
+    ptr += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Writes the header of a log at the start of the file.
+static int write_header(int fd, uint64_t base) {
+  char header[WAL_HEADER];
+  memcpy(header, WAL_MAGIC, WAL_MAGIC_SIZE);
+  memcpy(header + WAL_MAGIC_SIZE, &base, sizeof(base));
+  return lseek(fd, 0, SEEK_SET) != 0 || write_all(fd, header, WAL_HEADER) != 0;
+}
+
+// Appends bytes to the calling thread's commit.
+static void batch_add(const void *data, size_t size) {
+  if (batch.data == NULL) {
+    batch.data = batch.first;
+    batch.capacity = BATCH_INLINE;
+  }
+  if (batch.size + size > batch.capacity) {
+    size_t capacity = batch.capacity * 2;
+    while (capacity < batch.size + size) {
+      capacity *= 2;
+    }
+    char *grown = batch.data == batch.first ? malloc(capacity) : realloc(batch.data, capacity);
+    if (grown == NULL) {
+      batch.failed = 1;
+      return;
+    }
+    if (batch.data == batch.first) {
+      memcpy(grown, batch.first, batch.size);
+    }
+    batch.data = grown;
+    batch.capacity = capacity;
+  }
+  memcpy(batch.data + batch.size, data, size);
+  batch.size += size;
+}
+
+static void batch_add_string(const char *str) {
+  unsigned char len = (unsigned char)strnlen(str, MAX_STRING_SIZE - 1);
+  batch_add(&len, 1);
+  batch_add(str, len);
+}
+
+void wal_put_write(const char *key, const char *value, unsigned int ttl_ms) {
+  uint64_t deadline = ttl_ms ? realtime_ms() + ttl_ms : 0;
+  batch_add("W", 1);
+  batch_add_string(key);
+  batch_add_string(value);
+  batch_add(&deadline, sizeof(deadline));
+}
+
+void wal_put_delete(const char *key) {
+  batch_add("D", 1);
+  batch_add_string(key);
+}
+
+// Reads a string written by batch_add_string.
+// @return Bytes read, 0 if the record ends before it does.
+static size_t read_string(const char *data, size_t size, char str[MAX_STRING_SIZE]) {
+  if (size < 1 || (unsigned char)data[0] > size - 1 || (unsigned char)data[0] >= MAX_STRING_SIZE) {
+    return 0;
+  }
+  size_t len = (unsigned char)data[0];
+  memcpy(str, data + 1, len);
+  str[len] = '\0';
+  return len + 1;
+}
+
+// Applies the changes of a record.
+// @return 0 if the record is well formed, 1 otherwise.
+static int replay_record(const char *data, size_t size,
+                         void (*apply)(const char *, const char *, unsigned int, void *), void *arg) {
+  uint64_t now = realtime_ms();
+  size_t pos = 0;
+  while (pos < size) {
+    char type = data[pos++];
+    char key[MAX_STRING_SIZE];
+    size_t n = read_string(data + pos, size - pos, key);
+    if (n == 0 || (type != 'W' && type != 'D')) {
+      return 1;
+    }
+    pos += n;
+    if (type == 'D') {
+      apply(key, NULL, 0, arg);
+      continue;
+    }
+
+    char value[MAX_STRING_SIZE];
+    uint64_t deadline;
+    n = read_string(data + pos, size - pos, value);
+    if (n == 0 || size - pos - n < sizeof(deadline)) {
+      return 1;
+    }
+    pos += n;
+    memcpy(&deadline, data + pos, sizeof(deadline));
+    pos += sizeof(deadline);
+
+    if (deadline == 0) {
+      apply(key, value, 0, arg);
+    } else if (deadline > now) {
+      uint64_t ttl = deadline - now;
+      apply(key, value, ttl > UINT32_MAX ? UINT32_MAX : (unsigned int)ttl, arg);
+    } else {
+      // Ran out while the server was down
+      apply(key, NULL, 0, arg);
+    }
+  }
+  return 0;
+}
+
+// Replays the records of a log that end after a position.
+// @param base Where to store the position of the first byte of the file.
+// @return End of the last good record in the file, or -1 if the file is not
+//         a log or could not be read.
+static off_t replay(int fd, uint64_t from, uint64_t *base,
+                    void (*apply)(const char *, const char *, unsigned int, void *), void *arg) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    // The records of the snapshot loaded, if any, are not in this log
+    *base = from > WAL_HEADER ? from - WAL_HEADER : 0;
+    return write_header(fd, *base) == 0 ? WAL_HEADER : -1;
+  }
+
+  char *data = malloc(size);
+  if (data == NULL) {
+    return -1;
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, data + done, size - done);
+    if (n <= 0) {
+      free(data);
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  if (size < WAL_HEADER || memcmp(data, WAL_MAGIC, WAL_MAGIC_SIZE) != 0) {
+    free(data);
+    return -1;
+  }
+  memcpy(base, data + WAL_MAGIC_SIZE, sizeof(*base));
+
+  size_t pos = WAL_HEADER;
+  while (size - pos >= RECORD_HEADER) {
+    uint32_t len;
+    uint32_t crc;
+    memcpy(&len, data + pos, sizeof(len));
+    memcpy(&crc, data + pos + sizeof(len), sizeof(crc));
+    if (len > size - pos - RECORD_HEADER || crc32(0, data + pos + RECORD_HEADER, len) != crc) {
+      break;
+    }
+    // Records the snapshot already holds are skipped
+    if (*base + pos + RECORD_HEADER + len > from &&
+        replay_record(data + pos + RECORD_HEADER, len, apply, arg) != 0) {
+      break;
+    }
+    pos += RECORD_HEADER + len;
+  }
+  free(data);
+  return (off_t)pos;
+}
+
+// Writes the records appended so far, and fsyncs them if sync is not 0.
+// Called with the log locked and no flush running; unlocks it meanwhile, so
+// other threads keep appending to the other buffer.
+static void flush(Wal *wal, int sync) {
+  wal->flushing = 1;
+  char *data = wal->buffer;
+  size_t size = wal->size;
+  size_t capacity = wal->capacity;
+  uint64_t end = wal->appended;
+  wal->buffer = wal->spare;
+  wal->capacity = wal->spare_capacity;
+  wal->size = 0;
+  pthread_mutex_unlock(&wal->lock);
+
+  int failed = write_all(wal->fd, data, size) != 0;
+  if (!failed && sync && fdatasync(wal->fd) != 0) {
+    perror("Error syncing the WAL");
+    failed = 1;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  wal->spare = data;
+  wal->spare_capacity = capacity;
+  if (failed) {
+    wal->failed = 1;
+  } else {
+    wal->written = end;
+    if (sync) {
+      wal->synced = end;
+    }
+  }
+  wal->flushing = 0;
+  pthread_cond_broadcast(&wal->done);
+}
+
+static void *sync_thread(void *arg) {
+  Wal *wal = arg;
+
+  // Signals are left to the other threads
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&wal->lock);
+  while (!wal->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wal->sync_ms / 1000;
+    deadline.tv_nsec += (long)(wal->sync_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!wal->stop && pthread_cond_timedwait(&wal->done, &wal->lock, &deadline) == 0) {
+    }
+    while (wal->flushing) {
+      pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    if (!wal->failed && wal->synced < wal->appended) {
+      flush(wal, 1);
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
+
+Wal *wal_open(const char *path, uint64_t from, unsigned int sync_ms,
+              void (*apply)(const char *key, const char *value, unsigned int ttl_ms, void *arg),
+              void *arg) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("Failed to open the WAL");
+    return NULL;
+  }
+
+  uint64_t base;
+  off_t end = replay(fd, from, &base, apply, arg);
+  if (end < 0) {
+    fprintf(stderr, "Failed to read the WAL %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  if (base + (uint64_t)end < from) {
+    // Every record is older than the snapshot, so the log starts over after it
+    base = from - WAL_HEADER;
+    end = WAL_HEADER;
+    if (write_header(fd, base) != 0) {
+      close(fd);
+      return NULL;
+    }
+  } else if (base > 0 && base + WAL_HEADER > from) {
+    fprintf(stderr, "The WAL %s does not go back to the snapshot, the changes in between are lost\n",
+            path);
+  }
+  // Drops a record cut short by a crash, so new ones follow the good ones
+  if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) != end || fdatasync(fd) != 0) {
+    perror("Failed to prepare the WAL");
+    close(fd);
+    return NULL;
+  }
+
+  Wal *wal = calloc(1, sizeof(Wal));
+  if (wal == NULL) {
+    close(fd);
+    return NULL;
+  }
+  wal->path = strdup(path);
+  if (wal->path == NULL) {
+    free(wal);
+    close(fd);
+    return NULL;
+  }
+  wal->fd = fd;
+  wal->sync_ms = sync_ms;
+  wal->base = base;
+  wal->appended = wal->written = wal->synced = base + (uint64_t)end;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal->done, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (sync_ms != 0 && pthread_create(&wal->thread, NULL, sync_thread, wal) != 0) {
+    pthread_cond_destroy(&wal->done);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal->path);
+    free(wal);
+    close(fd);
+    return NULL;
+  }
+  return wal;
+}
+
+uint64_t wal_commit(Wal *wal) {
+  if (batch.size == 0) {
+    return 0;
+  }
+  if (batch.failed) {
+    perror("Error buffering the WAL");
+  }
+  uint32_t header[2] = {(uint32_t)batch.size, crc32(0, batch.data, batch.size)};
+  size_t size = RECORD_HEADER + batch.size;
+
+  pthread_mutex_lock(&wal->lock);
+  uint64_t lsn = 0;
+  wal->failed |= batch.failed;
+  if (!wal->failed && wal->size + size > wal->capacity) {
+    size_t capacity = wal->capacity ? wal->capacity * 2 : 64 * 1024;
+    while (capacity < wal->size + size) {
+      capacity *= 2;
+    }
+    char *buffer = realloc(wal->buffer, capacity);
+    if (buffer == NULL) {
+      perror("Error buffering the WAL");
+      wal->failed = 1;
+    } else {
+      wal->buffer = buffer;
+      wal->capacity = capacity;
+    }
+  }
+  if (!wal->failed) {
+    memcpy(wal->buffer + wal->size, header, RECORD_HEADER);
+    memcpy(wal->buffer + wal->size + RECORD_HEADER, batch.data, batch.size);
+    wal->size += size;
+    wal->appended += size;
+    lsn = wal->appended;
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  if (batch.data != batch.first) {
+    free(batch.data);
+    batch.data = batch.first;
+    batch.capacity = BATCH_INLINE;
+  }
+  batch.size = 0;
+  batch.failed = 0;
+  // A failed append is reported by wal_sync
+  return lsn != 0 ? lsn : UINT64_MAX;
+}
+
+int wal_sync(Wal *wal, uint64_t lsn) {
+  if (lsn == 0) {
+    return 0;
+  }
+  int sync = wal->sync_ms == 0;
+  pthread_mutex_lock(&wal->lock);
+  while (!wal->failed && (sync ? wal->synced : wal->written) < lsn) {
+    if (wal->flushing) {
+      // The records appended meanwhile go in the next flush
+      pthread_cond_wait(&wal->done, &wal->lock);
+    } else {
+      flush(wal, sync);
+    }
+  }
+  int failed = wal->failed;
+  pthread_mutex_unlock(&wal->lock);
+  return failed;
+}
+
+uint64_t wal_end(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t end = wal->appended;
+  pthread_mutex_unlock(&wal->lock);
+  return end;
+}
+
+// Copies the bytes of the file in [start, end) after what was written to fd.
+static int copy_records(int from_fd, uint64_t start, uint64_t end, int fd) {
+  char buffer[COPY_BUFFER];
+  while (start < end) {
+    size_t size = end - start < COPY_BUFFER ? (size_t)(end - start) : COPY_BUFFER;
+    ssize_t n = pread(from_fd, buffer, size, (off_t)start);
+    if (n <= 0 || write_all(fd, buffer, (size_t)n) != 0) {
+      return 1;
+    }
+    start += (uint64_t)n;
+  }
+  return 0;
+}
+
+int wal_checkpoint(Wal *wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t base = wal->base;
+  uint64_t written = wal->written;
+  int failed = wal->failed;
+  pthread_mutex_unlock(&wal->lock);
+  // Records still in the buffer are written to the new file later
+  if (lsn > written) {
+    lsn = written;
+  }
+  if (failed || lsn <= base + WAL_HEADER) {
+    return failed;
+  }
+
+  size_t path_len = strlen(wal->path) + sizeof(".tmp");
+  char *tmp_path = malloc(path_len);
+  if (tmp_path == NULL) {
+    return 1;
+  }
+  snprintf(tmp_path, path_len, "%s.tmp", wal->path);
+  // Most of the records are copied while the flushes go on
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  failed = fd < 0 || write_header(fd, lsn - WAL_HEADER) != 0 ||
+           copy_records(wal->fd, lsn - base, written - base, fd) != 0;
+
+  // The ones written meanwhile are copied with the flushes held off, so none
+  // goes to the old file once the new one replaces it
+  pthread_mutex_lock(&wal->lock);
+  while (wal->flushing) {
+    pthread_cond_wait(&wal->done, &wal->lock);
+  }
+  wal->flushing = 1;
+  uint64_t end = wal->written;
+  pthread_mutex_unlock(&wal->lock);
+
+  failed = failed || copy_records(wal->fd, written - base, end - base, fd) != 0 ||
+           fdatasync(fd) != 0 || rename(tmp_path, wal->path) != 0;
+  if (failed) {
+    perror("Failed to checkpoint the WAL");
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(tmp_path);
+  } else if (sync_dir(wal->path) != 0) {
+    // The new log is in place either way, and both hold the records after lsn
+    perror("Failed to sync the directory of the WAL");
+  }
+  free(tmp_path);
+
+  pthread_mutex_lock(&wal->lock);
+  if (!failed) {
+    close(wal->fd);
+    wal->fd = fd;
+    wal->base = lsn - WAL_HEADER;
+    wal->synced = end;
+  }
+  wal->flushing = 0;
+  pthread_cond_broadcast(&wal->done);
+  pthread_mutex_unlock(&wal->lock);
+  return failed;
+}
+
+void wal_close(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stop = 1;
+  pthread_cond_broadcast(&wal->done);
+  pthread_mutex_unlock(&wal->lock);
+  if (wal->sync_ms != 0) {
+    pthread_join(wal->thread, NULL);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  while (wal->flushing) {
+    pthread_cond_wait(&wal->done, &wal->lock);
+  }
+  if (!wal->failed && wal->synced < wal->appended) {
+    flush(wal, 1);
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  close(wal->fd);
+  pthread_cond_destroy(&wal->done);
+  pthread_mutex_destroy(&wal->lock);
+  free(wal->buffer);
+  free(wal->spare);
+  free(wal->path);
+  free(wal);
+}
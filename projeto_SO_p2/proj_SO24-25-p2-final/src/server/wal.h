@@ -0,0 +1,95 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stdint.h>
+
+// Write-ahead log of the changes made to the table, replayed on startup.
+//
+// Each commit (a WRITE, a DELETE, a block or a transaction) is one record:
+// its length, the CRC-32 of its contents, then its writes and deletes. The
+// changes of a commit are collected in a buffer of the calling thread while
+// its stripes are locked (wal_put_write, wal_put_delete), so the log has the
+// changes of every key in the order they were made, and appended to the log
+// by wal_commit. wal_sync, called once the stripes are unlocked, waits until
+// the record is in the file.
+//
+// Group commit: records are appended to a shared buffer, and the first thread
+// that needs its record in the file writes (and syncs) every record appended
+// so far, so the threads waiting meanwhile share a single write and fsync.
+//
+// Records are numbered by their position, which keeps growing across
+// restarts and checkpoints: the file starts with the position of its first
+// byte. A snapshot records the position it holds every change up to (see
+// wal_end), so only the records after it are replayed on top, and the
+// records before it can be dropped once it is on disk (see wal_checkpoint).
+//
+// TTLs are logged as a wall clock deadline, so pairs that ran out while the
+// server was down are not restored. Pairs evicted by the memory limit are
+// logged as deletes, in the commit of the write that evicted them, so replay
+// drops the same pairs the clients were told about (and the delta BACKUPs
+// recorded) rather than letting the limit pick its own.
+
+typedef struct Wal Wal;
+
+/// Opens a log, replaying the records it has after a position, and creates it
+/// if needed. A record cut short by a crash (or damaged) ends the log: it is
+/// dropped with everything after it.
+/// @param path Path of the log.
+/// @param from Position the snapshot loaded holds every change up to, 0 if
+///             there is none: the records before it are skipped, and new ones
+///             go after it even if the log ends before.
+/// @param sync_ms 0 to fsync before wal_sync returns, otherwise wal_sync
+///                only waits for the write and the log is fsynced every
+///                sync_ms milliseconds.
+/// @param apply Called for every change in the log, in order: value is NULL
+///              for deletes, ttl_ms is 0 for pairs without a TTL.
+/// @param arg Passed to apply.
+/// @return The log, NULL on failure.
+Wal *wal_open(const char *path, uint64_t from, unsigned int sync_ms,
+              void (*apply)(const char *key, const char *value, unsigned int ttl_ms, void *arg),
+              void *arg);
+
+/// Adds a write to the commit being built by the calling thread.
+/// @param key The key.
+/// @param value The value.
+/// @param ttl_ms TTL of the pair in milliseconds, 0 for none.
+void wal_put_write(const char *key, const char *value, unsigned int ttl_ms);
+
+/// Adds a delete to the commit being built by the calling thread.
+/// @param key The key.
+void wal_put_delete(const char *key);
+
+/// Appends the commit built by the calling thread to the log. Must be called
+/// with the stripes of its keys still locked.
+/// @param wal The log.
+/// @return Position to pass to wal_sync, 0 if there was nothing to log.
+uint64_t wal_commit(Wal *wal);
+
+/// Waits until a commit is in the log file (and fsynced, if sync_ms is 0).
+/// @param wal The log.
+/// @param lsn Position returned by wal_commit.
+/// @return 0 if successful, 1 if the log could not be written.
+int wal_sync(Wal *wal, uint64_t lsn);
+
+/// Position of the end of the last record appended. Called while no commit
+/// can be appended (the whole table locked), a snapshot of the table taken
+/// then holds every change up to it.
+/// @param wal The log.
+/// @return The position.
+uint64_t wal_end(Wal *wal);
+
+/// Drops the records before a position, once a snapshot that holds every
+/// change up to it is on disk, by copying the others to a new file renamed
+/// over the log. Commits go on meanwhile. Records not written to the file yet
+/// are kept. Must not be called by two threads at once.
+/// @param wal The log.
+/// @param lsn Position of a snapshot, as given by wal_end.
+/// @return 0 if successful, 1 if the log could not be rewritten (in which
+///         case it is left as it was).
+int wal_checkpoint(Wal *wal, uint64_t lsn);
+
+/// Writes and fsyncs what is left, and closes the log.
+/// @param wal The log.
+void wal_close(Wal *wal);
+
+#endif  // KVS_WAL_H